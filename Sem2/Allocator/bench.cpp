@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <vector>
+#include "benchmark/benchmark.h"
+
+#include "block_allocators.cpp"
+#include "concurrent_allocators.cpp"
+#include "memory_resources.cpp"
+#include "object_pool.cpp"
+
+typedef alc::__bucket_manager<uint64_t> manager_t;
+
+// Marks every block of the manager as taken without going through allocate()
+// Filling a million blocks through the bitmap scan alone would take minutes
+static void saturate(manager_t& m) {
+    if (m.table != nullptr)
+        memset(m.table, 0, m.table_size());
+    m.free_head = nullptr;
+    m.untouched = m.block_count;
+    m.available = 0;
+}
+
+//////// __bucket_manager: free-list vs bitmap scan
+
+// Frees a random block of a full bucket and allocates it back
+// range(0) - block count, range(1) - 1 for free-list mode, 0 for bitmap mode
+static void BM_ManagerChurn(benchmark::State& state) {
+    const size_t count = state.range(0);
+    const size_t block = 2;
+    std::vector<uint64_t> buffer(count*block);
+    manager_t manager(buffer.data(), count, block*sizeof(uint64_t), state.range(1));
+    saturate(manager);
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> dist(0, count-1);
+    for (auto _ : state) {
+        manager.deallocate(manager.block_pointer(dist(rng)), block);
+        benchmark::DoNotOptimize(manager.allocate(block));
+    }
+    state.SetItemsProcessed(state.iterations()*2);
+}
+BENCHMARK(BM_ManagerChurn)
+    ->ArgNames({"blocks", "freelist"})
+    ->ArgsProduct({{10000, 1000000}, {0, 1}});
+
+// Allocates the whole bucket, then frees it in reverse
+static void BM_ManagerFillDrain(benchmark::State& state) {
+    const size_t count = state.range(0);
+    const size_t block = 2;
+    std::vector<uint64_t> buffer(count*block);
+    std::vector<uint64_t*> ptrs(count);
+    manager_t manager(buffer.data(), count, block*sizeof(uint64_t), state.range(1));
+
+    for (auto _ : state) {
+        for (size_t i = 0; i < count; i++)
+            ptrs[i] = manager.allocate(block);
+        for (size_t i = count; i > 0; i--)
+            manager.deallocate(ptrs[i-1], block);
+    }
+    state.SetItemsProcessed(state.iterations()*count*2);
+}
+BENCHMARK(BM_ManagerFillDrain)
+    ->ArgNames({"blocks", "freelist"})
+    ->ArgsProduct({{10000}, {0, 1}})
+    ->Args({1000000, 1});
+
+//////// bucket_allocator: deallocation
+
+typedef alc::bucket_allocator<uint64_t,
+    alc::bucket_traits<1 << 12, 1>,  alc::bucket_traits<1 << 12, 2>,
+    alc::bucket_traits<1 << 12, 3>,  alc::bucket_traits<1 << 12, 4>,
+    alc::bucket_traits<1 << 12, 6>,  alc::bucket_traits<1 << 12, 8>,
+    alc::bucket_traits<1 << 12, 12>, alc::bucket_traits<1 << 12, 16>
+> churn_bucket_allocator;
+
+// Allocates a burst of objects of every size and frees it
+// range(0) - 1 to pass the size to deallocate, 0 to make it locate the bucket by the pointer
+static void BM_BucketChurn(benchmark::State& state) {
+    static churn_bucket_allocator allocator;
+    const size_t burst = 256;
+    const bool   sized = state.range(0);
+    uint64_t* ptrs[burst];
+    for (auto _ : state) {
+        for (size_t i = 0; i < burst; i++)
+            ptrs[i] = allocator.allocate(1 + i%16);
+        for (size_t i = 0; i < burst; i++)
+            allocator.deallocate(ptrs[i], sized ? 1 + i%16 : 0);
+    }
+    state.SetItemsProcessed(state.iterations()*burst*2);
+}
+BENCHMARK(BM_BucketChurn)->ArgName("sized")->Arg(0)->Arg(1);
+
+// Allocates a burst of same-size objects and frees it, one by one or as a batch
+// range(0) - 1 for allocate_batch/deallocate_batch, 0 for a loop of allocate/deallocate
+static void BM_BucketBurst(benchmark::State& state) {
+    static churn_bucket_allocator allocator;
+    const size_t burst = 512;
+    const bool   batch = state.range(0);
+    uint64_t* ptrs[burst];
+    for (auto _ : state) {
+        if (batch) {
+            allocator.allocate_batch(burst, 4, ptrs);
+            allocator.deallocate_batch(ptrs, burst, 4);
+        } else {
+            for (size_t i = 0; i < burst; i++)
+                ptrs[i] = allocator.allocate(4);
+            for (size_t i = 0; i < burst; i++)
+                allocator.deallocate(ptrs[i], 4);
+        }
+    }
+    state.SetItemsProcessed(state.iterations()*burst*2);
+}
+BENCHMARK(BM_BucketBurst)->ArgName("batch")->Arg(0)->Arg(1);
+
+//////// Sharing an allocator between threads
+
+typedef alc::bucket_allocator<uint64_t,
+    alc::bucket_traits<1 << 16, 1>,
+    alc::bucket_traits<1 << 16, 2>,
+    alc::bucket_traits<1 << 16, 4>
+> shared_bucket_allocator;
+
+typedef alc::concurrent_bucket_allocator<uint64_t,
+    alc::bucket_traits<1 << 16, 1>,
+    alc::bucket_traits<1 << 16, 2>,
+    alc::bucket_traits<1 << 16, 4>
+> magazine_bucket_allocator;
+
+// What we had to do before concurrent_bucket_allocator
+template <class Alloc>
+class locked_allocator {
+    std::mutex lock;
+    Alloc      allocator;
+public:
+    uint64_t* allocate(size_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        return allocator.allocate(n);
+    }
+    void deallocate(uint64_t* p, size_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        allocator.deallocate(p, n);
+    }
+};
+
+static const int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+// Every thread allocates a burst of mixed-size objects and frees it
+template <class Alloc>
+static void BM_Threads(benchmark::State& state) {
+    static Alloc allocator;
+    const size_t burst = 64;
+    uint64_t* ptrs[burst];
+    for (auto _ : state) {
+        for (size_t i = 0; i < burst; i++)
+            ptrs[i] = allocator.allocate(1 << i%3);
+        for (size_t i = 0; i < burst; i++)
+            allocator.deallocate(ptrs[i], 1 << i%3);
+    }
+    state.SetItemsProcessed(state.iterations()*burst*2);
+}
+BENCHMARK_TEMPLATE(BM_Threads, std::allocator<uint64_t>)
+    ->ThreadRange(1, max_threads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Threads, locked_allocator<shared_bucket_allocator>)
+    ->ThreadRange(1, max_threads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Threads, magazine_bucket_allocator)
+    ->ThreadRange(1, max_threads)->UseRealTime();
+
+// Buckets that are too small for the threads, almost every block comes from the slabs
+typedef alc::concurrent_bucket_allocator<uint64_t,
+    alc::bucket_traits<16, 1>,
+    alc::bucket_traits<16, 2>,
+    alc::bucket_traits<16, 4>
+> small_magazine_bucket_allocator;
+
+class growing_magazine_allocator: public small_magazine_bucket_allocator {
+    static alc::growth_policy growth() {
+        alc::growth_policy policy;
+        policy.grow = true;
+        return policy;
+    }
+public:
+    growing_magazine_allocator(): small_magazine_bucket_allocator(growth()) {}
+};
+
+BENCHMARK_TEMPLATE(BM_Threads, growing_magazine_allocator)
+    ->ThreadRange(1, max_threads)->UseRealTime();
+
+typedef alc::block_allocator<uint64_t, 1 << 16, 4>        shared_block_allocator;
+typedef alc::atomic_block_allocator<uint64_t, 1 << 16, 4> lockfree_block_allocator;
+
+BENCHMARK_TEMPLATE(BM_Threads, locked_allocator<shared_block_allocator>)
+    ->ThreadRange(1, max_threads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Threads, lockfree_block_allocator)
+    ->ThreadRange(1, max_threads)->UseRealTime();
+
+//////// Arena backing
+
+// range(0) of the arena benchmarks
+static alc::arena_backing backing_option(int option) {
+    alc::arena_backing backing;
+    if (option == 0)
+        return backing;
+    backing.source    = alc::arena_backing::mapped;
+    backing.populate  = (option == 2 || option >= 4);
+    backing.hugepages = (option >= 3);
+    backing.lock      = (option == 5);
+    return backing;
+}
+
+static const std::vector<std::string> backing_names = {
+    "malloc", "mmap", "mmap+populate", "mmap+hugepages", "mmap+hugepages+populate", "mmap+hugepages+populate+mlock"
+};
+
+// 256 MiB of 64 Byte blocks
+typedef alc::block_allocator<uint8_t, 1 << 22, 64> large_block_allocator;
+
+// Constructs the allocator and touches every block once, the way a service warms up
+static void BM_ArenaStartup(benchmark::State& state) {
+    state.SetLabel(backing_names[state.range(0)]);
+    for (auto _ : state) {
+        try {
+            large_block_allocator allocator(backing_option(state.range(0)));
+            for (size_t i = 0; i < (1 << 22); i++)
+                allocator.allocate(64)[0] = i;
+        } catch (std::bad_alloc&) {
+            state.SkipWithError("Couldn't get the arena (RLIMIT_MEMLOCK?)");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_ArenaStartup)->DenseRange(0, 5)->Unit(benchmark::kMillisecond)->Iterations(3);
+
+// Writes to random blocks of a warmed up arena, TLB misses are the most of it
+static void BM_ArenaSteadyState(benchmark::State& state) {
+    state.SetLabel(backing_names[state.range(0)]);
+    std::vector<uint8_t*> blocks(1 << 22);
+    try {
+        large_block_allocator allocator(backing_option(state.range(0)));
+        for (auto& block : blocks) {
+            block = allocator.allocate(64);
+            block[0] = 0;
+        }
+
+        std::mt19937 rng(42);
+        for (auto _ : state) {
+            uint8_t* block = blocks[rng() & ((1 << 22) - 1)];
+            allocator.deallocate(block, 64);
+            benchmark::DoNotOptimize(++allocator.allocate(64)[0]);
+        }
+        state.SetItemsProcessed(state.iterations());
+    } catch (std::bad_alloc&) {
+        state.SkipWithError("Couldn't get the arena (RLIMIT_MEMLOCK?)");
+    }
+}
+BENCHMARK(BM_ArenaSteadyState)->DenseRange(0, 5);
+
+//////// std::pmr containers
+
+// Byte sizes from a list node to a rehashed bucket array
+#define PMR_BENCH_BUCKETS                                       \
+    alc::bucket_traits<1 << 14, 32>,  alc::bucket_traits<1 << 13, 64>,  \
+    alc::bucket_traits<1 << 10, 256>, alc::bucket_traits<1 << 8, 4096>, \
+    alc::bucket_traits<1 << 4, 1 << 16>
+
+struct new_delete_source {
+    std::pmr::memory_resource* get() { return std::pmr::new_delete_resource(); }
+};
+
+template <class Resource>
+struct resource_source {
+    Resource resource;
+    std::pmr::memory_resource* get() { return &resource; }
+};
+
+typedef resource_source<std::pmr::unsynchronized_pool_resource>               pool_source;
+typedef resource_source<alc::unsynchronized_bucket_resource<PMR_BENCH_BUCKETS>> bucket_source;
+typedef resource_source<alc::synchronized_bucket_resource<PMR_BENCH_BUCKETS>>   sync_bucket_source;
+
+// Fills a hash map and erases everything from it
+template <class Source>
+static void BM_PmrUnorderedMap(benchmark::State& state) {
+    Source source;
+    const int keys = state.range(0);
+    for (auto _ : state) {
+        std::pmr::unordered_map<int, int> map(source.get());
+        for (int i = 0; i < keys; i++)
+            map[i*7] = i;
+        for (int i = 0; i < keys; i++)
+            map.erase(i*7);
+    }
+    state.SetItemsProcessed(state.iterations()*keys*2);
+}
+BENCHMARK_TEMPLATE(BM_PmrUnorderedMap, new_delete_source)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_PmrUnorderedMap, pool_source)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_PmrUnorderedMap, bucket_source)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_PmrUnorderedMap, sync_bucket_source)->Arg(1000);
+
+// Grows a vector of strings that don't fit into the small string buffer
+template <class Source>
+static void BM_PmrVectorOfStrings(benchmark::State& state) {
+    Source source;
+    const int count = state.range(0);
+    for (auto _ : state) {
+        std::pmr::vector<std::pmr::string> strings(source.get());
+        for (int i = 0; i < count; i++)
+            strings.emplace_back("a string that is too long for the small buffer");
+        benchmark::DoNotOptimize(strings.data());
+    }
+    state.SetItemsProcessed(state.iterations()*count);
+}
+BENCHMARK_TEMPLATE(BM_PmrVectorOfStrings, new_delete_source)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_PmrVectorOfStrings, pool_source)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_PmrVectorOfStrings, bucket_source)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_PmrVectorOfStrings, sync_bucket_source)->Arg(1000);
+
+//////// False sharing
+
+typedef alc::bucket_allocator<uint64_t, alc::bucket_traits<64, 1>>     packed_counter_allocator;
+typedef alc::bucket_allocator<uint64_t, alc::cache_line_bucket<64, 1>> padded_counter_allocator;
+
+constexpr int max_counter_threads = 8;
+
+// Counters allocated one right after another, like per-thread state usually is
+template <class Alloc>
+static std::atomic<uint64_t>** thread_counters() {
+    static Alloc allocator;
+    static std::atomic<uint64_t>* counters[max_counter_threads];
+    for (int i = 0; i < max_counter_threads; i++)
+        counters[i] = new (allocator.allocate(1)) std::atomic<uint64_t>(0);
+    return counters;
+}
+
+// Every thread bumps a counter of it's own
+template <class Alloc>
+static void BM_FalseSharing(benchmark::State& state) {
+    static std::atomic<uint64_t>** counters = thread_counters<Alloc>();
+    std::atomic<uint64_t>& counter = *counters[state.thread_index()];
+    for (auto _ : state)
+        counter.fetch_add(1, std::memory_order_relaxed);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_FalseSharing, packed_counter_allocator)->ThreadRange(1, max_counter_threads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FalseSharing, padded_counter_allocator)->ThreadRange(1, max_counter_threads)->UseRealTime();
+
+//////// Phase-based workloads
+
+typedef alc::bucket_allocator<int,
+    alc::bucket_traits<1 << 14, 6>,
+    alc::bucket_traits<1 << 14, 12>
+> phase_bucket_allocator;
+typedef alc::monotonic_allocator<int, 1 << 20> phase_monotonic_allocator;
+
+template <class Alloc>
+static void end_phase(Alloc&) {}
+
+template <class T, size_t size>
+static void end_phase(alc::monotonic_allocator<T, size>& allocator) {
+    allocator.reset();
+}
+
+// A parse-like phase: a map and a list of short-lived objects that all die at the end
+// range(0) - objects per container
+template <class Alloc>
+static void BM_Phase(benchmark::State& state) {
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const int, int>> map_alloc;
+    const int count = state.range(0);
+    Alloc allocator;
+    for (auto _ : state) {
+        {
+            std::map<int, int, std::less<int>, map_alloc> map{map_alloc(allocator)};
+            std::list<int, Alloc> list(allocator);
+            for (int i = 0; i < count; i++) {
+                map.emplace(i*7919 % count, i);
+                list.push_back(i);
+            }
+            benchmark::DoNotOptimize(map.size() + list.size());
+        }
+        end_phase(allocator);
+    }
+    state.SetItemsProcessed(state.iterations()*count*2);
+}
+BENCHMARK_TEMPLATE(BM_Phase, std::allocator<int>)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_Phase, phase_bucket_allocator)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_Phase, phase_monotonic_allocator)->Arg(1000);
+
+//////// object_pool: entity tables
+
+struct entity {
+    uint64_t id;
+    double   position[3];
+    double   velocity[3];
+    uint64_t flags;
+};
+
+// Sums over range(0) entities, every 8th of which was destroyed
+// Same entities behind unique_ptrs, allocated in a random order, for comparison
+static void BM_PoolIterate(benchmark::State& state) {
+    const size_t count = state.range(0);
+    alc::object_pool<entity> pool(count);
+    std::vector<alc::object_pool<entity>::handle> handles;
+    for (size_t i = 0; i < count; i++)
+        handles.push_back(pool.emplace(entity{i, {}, {1, 1, 1}, 0}));
+    for (size_t i = 0; i < count; i += 8)
+        pool.destroy(handles[i]);
+
+    for (auto _ : state) {
+        double sum = 0;
+        for (entity& e : pool)
+            sum += e.velocity[0];
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations()*pool.size());
+}
+BENCHMARK(BM_PoolIterate)->Arg(1 << 12)->Arg(1 << 20);
+
+static void BM_PointerIterate(benchmark::State& state) {
+    const size_t count = state.range(0);
+    std::vector<std::unique_ptr<entity>> all;
+    for (size_t i = 0; i < count; i++)
+        all.push_back(std::make_unique<entity>(entity{i, {}, {1, 1, 1}, 0}));
+    std::shuffle(all.begin(), all.end(), std::mt19937(42));
+    std::vector<std::unique_ptr<entity>> live;
+    for (size_t i = 0; i < count; i++) {
+        if (i%8 != 0)
+            live.push_back(std::move(all[i]));
+    }
+    std::shuffle(live.begin(), live.end(), std::mt19937(7));
+
+    for (auto _ : state) {
+        double sum = 0;
+        for (const std::unique_ptr<entity>& e : live)
+            sum += e->velocity[0];
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations()*live.size());
+}
+BENCHMARK(BM_PointerIterate)->Arg(1 << 12)->Arg(1 << 20);
+
+BENCHMARK_MAIN();
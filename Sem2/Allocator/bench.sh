@@ -0,0 +1,3 @@
+clear
+g++ -O2 -DNDEBUG -o bench bench.cpp -std=c++17 -lbenchmark -lpthread && ./bench "$@"
+rm ./bench
@@ -1,21 +1,153 @@
 #pragma once
 #include <memory>
-// Only for std::sort because I'm lazy
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <algorithm>
+#include <type_traits>
+#include <sys/mman.h>
+
+// Keeps the availability bitmap next to the free-list to catch double frees
+// In bitmap mode the table is always there, so this only matters for free-list mode
+#ifndef SEGALLOC_DFREE_CHECK
+#ifdef NDEBUG
+#define SEGALLOC_DFREE_CHECK 0
+#else
+#define SEGALLOC_DFREE_CHECK 1
+#endif
+#endif
 
-#define SEGALLOC_DEBUG 1
+// Per-bucket counters, see alc::bucket_stats
+#ifndef SEGALLOC_STATS
+#define SEGALLOC_STATS 0
+#endif
 
-#if SEGALLOC_DEBUG
-#define SEGALLOC_DPRINT(...) printf(__VA_ARGS__);
+#if SEGALLOC_STATS
+#define SEGALLOC_COUNT(...) __VA_ARGS__;
 #else
-#define SEGALLOC_DPRINT(...)
+#define SEGALLOC_COUNT(...)
 #endif
 
 namespace alc {
 
 
+// Snapshot of a bucket's counters
+// Only the geometry and in_use are filled, unless SEGALLOC_STATS is on
+struct bucket_stats {
+    // Byte size of a block
+    std::size_t block_size      = 0;
+    std::size_t block_count     = 0;
+    // Blocks that are given out right now
+    std::size_t in_use          = 0;
+    std::size_t allocations     = 0;
+    std::size_t frees           = 0;
+    // Most blocks ever given out at once
+    std::size_t high_water      = 0;
+    // Requests that went to a bigger bucket, because this one was full
+    std::size_t fallbacks       = 0;
+    // Requests for this bucket that ended in std::bad_alloc
+    std::size_t failures        = 0;
+    // Bytes asked for by all the allocations
+    std::size_t requested_bytes = 0;
+
+    // Bytes given out by all the allocations
+    std::size_t block_bytes() const noexcept {
+        return allocations*block_size;
+    }
+
+    // Internal fragmentation: the share of given out Bytes that nobody asked for
+    double fragmentation() const noexcept {
+        return (block_bytes() == 0) ? 0.0 : 1.0 - (double)requested_bytes/block_bytes();
+    }
+
+    // Adds the counters of another bucket of the same size class (e.g. a slab)
+    // high_water becomes an upper bound, since the peaks didn't necessarily happen together
+    bucket_stats& operator+= (const bucket_stats& other) noexcept {
+        block_count     += other.block_count;
+        in_use          += other.in_use;
+        allocations     += other.allocations;
+        frees           += other.frees;
+        high_water      += other.high_water;
+        fallbacks       += other.fallbacks;
+        failures        += other.failures;
+        requested_bytes += other.requested_bytes;
+        return *this;
+    }
+};
+
+// Dumps a stats() snapshot as a JSON array, one object per bucket
+inline std::string stats_json(const std::vector<bucket_stats>& stats) {
+    std::string json = "[";
+    for (std::size_t i = 0; i < stats.size(); i++) {
+        const bucket_stats& s = stats[i];
+        char fragmentation[32];
+        snprintf(fragmentation, sizeof(fragmentation), "%.6f", s.fragmentation());
+        json += (i == 0) ? "\n" : ",\n";
+        json += "  {\"block_size\": "     + std::to_string(s.block_size)
+             +  ", \"block_count\": "     + std::to_string(s.block_count)
+             +  ", \"in_use\": "          + std::to_string(s.in_use)
+             +  ", \"allocations\": "     + std::to_string(s.allocations)
+             +  ", \"frees\": "           + std::to_string(s.frees)
+             +  ", \"high_water\": "      + std::to_string(s.high_water)
+             +  ", \"fallbacks\": "       + std::to_string(s.fallbacks)
+             +  ", \"failures\": "        + std::to_string(s.failures)
+             +  ", \"requested_bytes\": " + std::to_string(s.requested_bytes)
+             +  ", \"block_bytes\": "     + std::to_string(s.block_bytes())
+             +  ", \"fragmentation\": "   + fragmentation + "}";
+    }
+    json += stats.empty() ? "]" : "\n]";
+    return json;
+}
+
+// Counters of a bucket manager, only kept with SEGALLOC_STATS
+// Counter - size_t, or std::atomic<size_t> for thread-safe managers
+template <class Counter>
+struct __bucket_counters {
+    Counter allocations{0};
+    Counter frees{0};
+    Counter high_water{0};
+    Counter fallbacks{0};
+    Counter failures{0};
+    Counter requested_bytes{0};
+
+    void raise_high_water(std::size_t in_use) noexcept {
+        std::size_t current = high_water;
+        while (current < in_use && !update(high_water, current, in_use)) {}
+    }
+
+    void fill(bucket_stats& stats) const noexcept {
+        stats.allocations     = allocations;
+        stats.frees           = frees;
+        stats.high_water      = high_water;
+        stats.fallbacks       = fallbacks;
+        stats.failures        = failures;
+        stats.requested_bytes = requested_bytes;
+    }
+
+private:
+    static bool update(std::size_t& value, std::size_t&, std::size_t desired) noexcept {
+        value = desired;
+        return true;
+    }
+
+    static bool update(std::atomic<std::size_t>& value, std::size_t& expected, std::size_t desired) noexcept {
+        return value.compare_exchange_weak(expected, desired, std::memory_order_relaxed);
+    }
+};
+
+
 // Memory-map for a bucket
 // Relies on outside objects for freeing it's buffer pointer
+// Works in one of two modes:
+// * free-list - every free block stores the address of the next free block inside itself,
+//   so allocation and deallocation are O(1). Used whenever a block can hold a pointer
+// * bitmap - the table is scanned for an available block, used for tiny blocks
 template <class T>
 class __bucket_manager {
 //////// TYPEDEFS
@@ -39,7 +171,18 @@ public:
     size_type available;
     // Bitmap for block availability
     // true == block available
+    // In free-list mode only present with SEGALLOC_DFREE_CHECK, nullptr otherwise
     uint8_t*  table;
+    // Head of the intrusive free-list
+    void*     free_head;
+    // Index of the first block that was never given out
+    // Blocks from it onwards are free, but not linked into the free-list yet
+    size_type untouched;
+    // true == free-list mode, false == bitmap mode
+    bool      freelist;
+    #if SEGALLOC_STATS
+    __bucket_counters<size_type> counters;
+    #endif
 
 //////// INTERNAL FUNCTIONS
     // Sets the corresponding bit in the table to val
@@ -54,6 +197,34 @@ public:
         return ((table[ind/8] >> (7 - ind%8)) & 1);
     }
 
+    // Sets count bits starting from first, whole bytes at once
+    void set_table_range(size_type first, size_type count, bool val) {
+        size_type ind = first, end = first + count;
+        for (; ind < end && ind%8 != 0; ind++)
+            set_table(ind, val);
+        for (; ind+8 <= end; ind += 8)
+            table[ind/8] = val ? 0xFF : 0;
+        for (; ind < end; ind++)
+            set_table(ind, val);
+    }
+
+    // Byte size of the table
+    size_type table_size() const noexcept {
+        return (block_count+7)/8;
+    }
+
+    // Reads the link stored inside a free block
+    // memcpy, because blocks aren't necessarily aligned for a pointer
+    static void* next_free(void* block) noexcept {
+        void* next;
+        memcpy(&next, block, sizeof(next));
+        return next;
+    }
+
+    static void set_next_free(void* block, void* next) noexcept {
+        memcpy(block, &next, sizeof(next));
+    }
+
     // One-past-end pointer to the end of the buffer
     pointer end_ptr() const noexcept {
         return block_pointer(block_count);
@@ -64,6 +235,11 @@ public:
         return (start_ptr + index*block_capacity());
     }
 
+    // Index of the block at the pointer
+    size_type block_index(const pointer p) const noexcept {
+        return (p - start_ptr)/block_capacity();
+    }
+
     // Returns how much of T objects a block can hold
     size_type block_capacity() const noexcept {
         return block_size/value_size();
@@ -73,34 +249,64 @@ public:
         return (p >= start_ptr && p < end_ptr());
     }
 
-    //////// INIT / DEINIT
+    // Puts the block back without touching available, false if it's not a taken block of this bucket
+    bool release(const pointer& p) {
+        if (!contains(p))
+            return false;
+        // A pointer inside the bucket that is off the block stride was never given out
+        assert((p - start_ptr) % block_capacity() == 0);
+        if ((p - start_ptr) % block_capacity() != 0)
+            return false;
 
-    __bucket_manager():
-        start_ptr(nullptr), block_size(0), block_count(0), available(0), table(nullptr) {}
+        // Check if pointer (block) is already free
+        // Without the table a double free in free-list mode goes unnoticed
+        if (table != nullptr) {
+            size_type index = block_index(p);
+            if (get_table(index))
+                return false;
+            set_table(index, true);
+        }
 
-    __bucket_manager(const pointer& ptr, const size_type& b_count, const size_type& b_size):
-        start_ptr(ptr), block_size(b_size), block_count(b_count), available(b_count) {
-        table = (uint8_t*)malloc((block_count+7)/8);
+        if (freelist) {
+            set_next_free(p, free_head);
+            free_head = p;
+        }
+        return true;
+    }
 
-        SEGALLOC_DPRINT("__bucket_manager(%p) - Created table @ %p\n", this, table);
+    //////// INIT / DEINIT
 
-        for (int i = 0; i < block_count; i++)
-            set_table(i, true);
+    __bucket_manager():
+        start_ptr(nullptr), block_count(0), block_size(0), available(0), table(nullptr),
+        free_head(nullptr), untouched(0), freelist(false) {}
+
+    // use_freelist is ignored if a block is too small to hold a pointer
+    __bucket_manager(const pointer& ptr, const size_type& b_count, const size_type& b_size, bool use_freelist = true):
+        start_ptr(ptr), block_count(b_count), block_size(b_size), available(b_count), table(nullptr),
+        free_head(nullptr), untouched(0), freelist(use_freelist && b_size >= sizeof(void*)) {
+        if (!freelist || SEGALLOC_DFREE_CHECK) {
+            table = (uint8_t*)malloc(table_size());
+            // 0xFF == all 8 blocks available, the padding bits of the last byte are kept at 0
+            memset(table, 0xFF, block_count/8);
+            if (block_count%8 != 0)
+                table[block_count/8] = (uint8_t)(0xFF00 >> block_count%8);
+        }
     }
 
     __bucket_manager(const __bucket_manager<T>& other):
-        start_ptr(other.start_ptr), block_size(other.block_size),
-        block_count(other.block_count), available(other.block_count) {
+        start_ptr(other.start_ptr), block_count(other.block_count), block_size(other.block_size),
+        available(other.available), table(nullptr), free_head(other.free_head),
+        untouched(other.untouched), freelist(other.freelist) {
             // Copy table
-            table = (uint8_t*)malloc((block_count+7)/8);
-            SEGALLOC_DPRINT("__bucket_manager(%p) - Copying table @ %p -> %p\n", this, other.table, table);
-            for (int i = 0; i < (block_count+7)/8; i++)
-                table[i] = other.table[i];
+            if (other.table != nullptr) {
+                table = (uint8_t*)malloc(table_size());
+                memcpy(table, other.table, table_size());
+            }
+            SEGALLOC_COUNT(counters = other.counters)
         }
     
     ~__bucket_manager() {
         if (table != nullptr) {
-            SEGALLOC_DPRINT("__bucket_manager(%p) - Freeing table @ %p\n", this, table);
             free(table);
         }
     }
@@ -116,6 +322,15 @@ public:
         return (block_capacity() * (available != 0));
     }
 
+    bucket_stats stats() const noexcept {
+        bucket_stats result;
+        result.block_size  = block_size;
+        result.block_count = block_count;
+        result.in_use      = block_count - available;
+        SEGALLOC_COUNT(counters.fill(result))
+        return result;
+    }
+
     // Function for ease of working with T == void
     constexpr static size_type value_size() {
         if (std::is_same<T, void>::value) {
@@ -129,62 +344,114 @@ public:
 
     pointer allocate(const size_type& n) {
         // Check that we have the space
-        if (available == 0 || n > max_size())
+        if (available == 0 || n > max_size()) {
+            SEGALLOC_COUNT(++counters.failures)
             throw std::bad_alloc();
+        }
         
-        // Find an available block
-        size_type block_index;
-        for (block_index = 0; block_index < block_count; block_index++) {
-            if (table[block_index/8] == 0) {
-                block_index += 8;
-                continue;
+        pointer block;
+        if (freelist) {
+            // Pop the free-list, or take a fresh block if it's empty
+            if (free_head != nullptr) {
+                block = (pointer)free_head;
+                free_head = next_free(free_head);
+            } else {
+                block = block_pointer(untouched++);
             }
-            if (get_table(block_index))
-                break;
+        } else {
+            // Find an available block, skipping fully taken bytes
+            size_type index = 0;
+            while (table[index/8] == 0)
+                index += 8;
+            while (!get_table(index))
+                ++index;
+            block = block_pointer(index);
         }
 
         // Boring stuff
-        set_table(block_index, false);
+        if (table != nullptr)
+            set_table(block_index(block), false);
         --available;
+        SEGALLOC_COUNT(
+            ++counters.allocations;
+            counters.requested_bytes += n*value_size();
+            counters.raise_high_water(block_count - available)
+        )
 
-        #if SEGALLOC_DEBUG
-        printf("__bucket_manager(%p) - Allocated block %lu\n", this, block_index);
-        printf("BLOCK\tOFFSET\tPOINTER\tAVAILABLE?\n");
-        for (int i = 0; i < block_count; i++)
-            printf("%d\t%lu\t%p\t%d\n", i, (uint8_t*)block_pointer(i)-(uint8_t*)start_ptr, block_pointer(i), get_table(i));
-        #endif
-
-        return block_pointer(block_index);
+        return block;
     }
 
     void deallocate(const pointer& p, const size_type& n) {
-        if (
-            (p - start_ptr) % block_capacity() != 0 // Pointer is not aligned
-            || !contains(p)  // Pointer is outside of bounds
-        ) {
-            SEGALLOC_DPRINT("__bucket_manager(%p) - Failed to deallocate pointer:\n", this);
-            SEGALLOC_DPRINT("START:\t%p\t%lu\n", start_ptr, (uint8_t*)p-(uint8_t*)start_ptr);
-            SEGALLOC_DPRINT("PTR:\t%p\t%d\n",   p,         0);
-            SEGALLOC_DPRINT("END:\t%p\t%lu\n",   end_ptr(), (uint8_t*)p-(uint8_t*)end_ptr());
+        if (!release(p))
             return;
-        }
-
-        size_type block_index = (p-start_ptr)/block_size;
+        // Without the table double frees get through release, catches them once they free too much
+        assert(available < block_count);
+        ++available;
+        SEGALLOC_COUNT(++counters.frees)
+    }
 
-        // Check if pointer (block) is already free
-        if (get_table(block_index))
-            return;
+    // Claims up to count blocks of n objects into out, returns how many it got
+    // Free-list mode pops the list, then takes the never touched blocks as one contiguous run,
+    // bitmap mode makes a single pass over the table, taking fully free bytes at once
+    size_type allocate_batch(size_type count, const size_type& n, pointer* out) {
+        if (n > block_capacity())
+            return 0;
+        count = std::min(count, available);
+
+        size_type done = 0;
+        if (freelist) {
+            while (done < count && free_head != nullptr) {
+                out[done] = (pointer)free_head;
+                free_head = next_free(free_head);
+                if (table != nullptr)
+                    set_table(block_index(out[done]), false);
+                ++done;
+            }
+            // Whatever is left is guaranteed to be untouched
+            const size_type run = count - done;
+            for (size_type i = 0; i < run; i++)
+                out[done++] = block_pointer(untouched + i);
+            if (table != nullptr)
+                set_table_range(untouched, run, false);
+            untouched += run;
+        } else {
+            for (size_type byte = 0; done < count; byte++) {
+                if (table[byte] == 0)
+                    continue;
+                if (table[byte] == 0xFF && count - done >= 8) {
+                    for (size_type i = 0; i < 8; i++)
+                        out[done++] = block_pointer(byte*8 + i);
+                    table[byte] = 0;
+                    continue;
+                }
+                // Highest bit is the first block of the byte
+                while (table[byte] != 0 && done < count) {
+                    size_type bit = __builtin_clz((unsigned)table[byte]) - (sizeof(unsigned)-1)*8;
+                    out[done++] = block_pointer(byte*8 + bit);
+                    table[byte] &= ~(0x80 >> bit);
+                }
+            }
+        }
 
-        // Free pointer
-        set_table(block_index, true);
-        ++available;
+        available -= done;
+        SEGALLOC_COUNT(
+            counters.allocations += done;
+            counters.requested_bytes += done*n*value_size();
+            counters.raise_high_water(block_count - available)
+        )
+        return done;
+    }
 
-        #if SEGALLOC_DEBUG
-        printf("__bucket_manager(%p) - Deallocated block %lu\n", this, block_index);
-        printf("BLOCK\tOFFSET\tPOINTER\tAVAILABLE?\n");
-        for (int i = 0; i < block_count; i++)
-            printf("%d\t%lu\t%p\t%d\n", i, (uint8_t*)block_pointer(i)-(uint8_t*)start_ptr, block_pointer(i), get_table(i));
-        #endif
+    // Returns count blocks, the ones that aren't taken blocks of this bucket are skipped
+    // Returns how many were actually freed
+    size_type deallocate_batch(const pointer* ptrs, size_type count, const size_type&) {
+        size_type freed = 0;
+        for (size_type i = 0; i < count; i++)
+            freed += release(ptrs[i]);
+        assert(available + freed <= block_count);
+        available += freed;
+        SEGALLOC_COUNT(counters.frees += freed)
+        return freed;
     }
 
     //////// OPERATORS
@@ -195,7 +462,8 @@ public:
             l.block_count == r.block_count &&
             l.block_size  == r.block_size &&
             l.available   == r.available &&
-            l.table       == r.table
+            l.table       == r.table &&
+            l.free_head   == r.free_head
         );
     }
 
@@ -204,28 +472,355 @@ public:
     }
 
     __bucket_manager& operator= (const __bucket_manager& other) {
+        if (this == &other)
+            return *this;
         start_ptr   = other.start_ptr;
         block_count = other.block_count;
         block_size  = other.block_size;
         available   = other.available;
+        free_head   = other.free_head;
+        untouched   = other.untouched;
+        freelist    = other.freelist;
         
         // Copy table
         free(table);
-        table = (uint8_t*)malloc((block_count+7)/8);
-        for (int i = 0; i < (block_count+7)/8; i++)
-            table[i] = other.table[i];
+        table = nullptr;
+        if (other.table != nullptr) {
+            table = (uint8_t*)malloc(table_size());
+            memcpy(table, other.table, table_size());
+        }
+        SEGALLOC_COUNT(counters = other.counters)
         
         return *this;
     }
 };
 
 
-// Allocates same-size blocks that it then can give out
-// T - the type for the allocator
-// block_size - the amount of T objects inside a block (NOT BYTESIZE!!!)
-// block_count - Amount of blocks
-template <class T, size_t block_count, size_t block_size>
-class block_allocator: std::allocator<T> {
+// Where an arena takes it's buffer from
+struct arena_backing {
+    enum source_type {
+        heap,   // malloc
+        mapped  // anonymous mmap, straight from the OS
+    };
+    source_type source    = heap;
+    // mapped only: ask for transparent huge pages (madvise(MADV_HUGEPAGE)), the buffer is aligned to 2 MiB for that
+    bool        hugepages = false;
+    // mapped only: fault every page in right away (MAP_POPULATE), so it happens in the constructor and not under load
+    bool        populate  = false;
+    // mapped only: mlock the buffer, so it's never swapped out
+    bool        lock      = false;
+};
+
+constexpr std::size_t __hugepage_size = std::size_t(2) << 20;
+
+// Length of the mapping for a buffer of size Bytes
+inline std::size_t __arena_length(std::size_t size, const arena_backing& backing) noexcept {
+    if (size == 0)
+        size = 1;
+    if (backing.hugepages)
+        size = (size + __hugepage_size-1) & ~(__hugepage_size-1);
+    return size;
+}
+
+// Biggest power of 2 (up to a page) that divides the block size
+// Blocks of a buffer aligned to it keep any alignment their size was padded to
+constexpr std::size_t __block_align(std::size_t b_size) noexcept {
+    return (b_size == 0) ? 1 : std::min<std::size_t>(b_size & (~b_size + 1), 4096);
+}
+
+// Byte size of n objects, throws std::bad_alloc if it doesn't fit into a size_t
+inline std::size_t __request_bytes(std::size_t n, std::size_t value_size) {
+    if (n > std::size_t(-1)/value_size)
+        throw std::bad_alloc();
+    return n*value_size;
+}
+
+// Gets a buffer for an arena, throws std::bad_alloc if it can't
+// align - up to a page, mapped buffers are always page-aligned
+inline uint8_t* __arena_map(std::size_t size, const arena_backing& backing, std::size_t align = 1) {
+    if (backing.source == arena_backing::heap) {
+        // aligned_alloc wants the size to be a multiple of the alignment
+        uint8_t* ptr = (align <= alignof(std::max_align_t))
+            ? (uint8_t*)malloc(size)
+            : (uint8_t*)aligned_alloc(align, (size + align-1) & ~(align-1));
+        if (ptr == nullptr && size != 0)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    const std::size_t length = __arena_length(size, backing);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    #ifdef MAP_POPULATE
+    // With huge pages populating has to wait until after madvise
+    if (backing.populate && !backing.hugepages)
+        flags |= MAP_POPULATE;
+    #endif
+
+    // Huge pages need a 2 MiB aligned buffer, so map more and cut off the ends
+    const std::size_t padding = backing.hugepages ? __hugepage_size : 0;
+    uint8_t* mapping = (uint8_t*)::mmap(nullptr, length + padding, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapping == MAP_FAILED)
+        throw std::bad_alloc();
+    uint8_t* ptr = mapping;
+    if (padding != 0) {
+        ptr = (uint8_t*)(((uintptr_t)mapping + padding-1) & ~(uintptr_t)(padding-1));
+        if (ptr != mapping)
+            ::munmap(mapping, ptr - mapping);
+        ::munmap(ptr + length, mapping + padding - ptr);
+    }
+
+    if (backing.hugepages) {
+        #ifdef MADV_HUGEPAGE
+        ::madvise(ptr, length, MADV_HUGEPAGE);
+        #endif
+        if (backing.populate) {
+            for (std::size_t offset = 0; offset < length; offset += 4096)
+                ptr[offset] = 0;
+        }
+    }
+
+    if (backing.lock && ::mlock(ptr, length) != 0) {
+        ::munmap(ptr, length);
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+inline void __arena_unmap(uint8_t* ptr, std::size_t size, const arena_backing& backing) noexcept {
+    if (backing.source == arena_backing::heap)
+        free(ptr);
+    else
+        ::munmap(ptr, __arena_length(size, backing));
+}
+
+// What an allocator does when a size class runs out
+// By default nothing, it throws std::bad_alloc like a fixed arena should
+struct growth_policy {
+    // true == chain a new slab to the size class instead of throwing
+    bool        grow       = false;
+    // Every new slab has this many times more blocks than the previous one
+    std::size_t factor     = 2;
+    // How many fully empty slabs of a size class are kept before they're given back to the OS
+    std::size_t hysteresis = 1;
+};
+
+// Extra blocks for a size class that ran out
+template <class Manager>
+struct __slab {
+    typedef std::size_t size_type;
+
+    arena_backing backing;
+    uint8_t*      data;
+    Manager       manager;
+    __slab*       next;
+
+    __slab(size_type b_count, size_type b_size, __slab* next_slab, const arena_backing& source):
+        backing(source), data(__arena_map(b_count*b_size, backing, __block_align(b_size))),
+        manager(data, b_count, b_size), next(next_slab) {}
+
+    ~__slab() {
+        __arena_unmap(data, manager.block_count*manager.block_size, backing);
+    }
+
+    bool empty() const noexcept {
+        return manager.available == manager.block_count;
+    }
+};
+
+// Slabs of a single size class, newest (and the biggest) first
+template <class Manager>
+struct __slab_chain {
+    typedef std::size_t     size_type;
+    typedef __slab<Manager> slab;
+
+    slab*     head  = nullptr;
+    // Amount of fully empty slabs
+    size_type empty = 0;
+
+    __slab_chain() = default;
+    __slab_chain(const __slab_chain&) = delete;
+    __slab_chain& operator= (const __slab_chain&) = delete;
+
+    ~__slab_chain() {
+        while (head != nullptr) {
+            slab* next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    // Adds the counters of every slab
+    void add_stats(bucket_stats& stats) const noexcept {
+        for (slab* s = head; s != nullptr; s = s->next)
+            stats += s->manager.stats();
+    }
+
+    // Block count of the next slab
+    size_type next_count(size_type base_count, const growth_policy& policy) const noexcept {
+        size_type count = (head != nullptr) ? head->manager.block_count : base_count;
+        return std::max<size_type>(count*policy.factor, 1);
+    }
+
+    // Allocates in the first slab with space, nullptr if every slab is full
+    uint8_t* allocate(size_type n) {
+        for (slab* s = head; s != nullptr; s = s->next) {
+            if (s->manager.full())
+                continue;
+            if (s->empty())
+                --empty;
+            return s->manager.allocate(n);
+        }
+        return nullptr;
+    }
+
+    // Claims up to count blocks from the slabs with space, returns how many it got
+    size_type allocate_batch(size_type count, size_type n, uint8_t** out) {
+        size_type done = 0;
+        for (slab* s = head; s != nullptr && done < count; s = s->next) {
+            if (s->manager.full())
+                continue;
+            if (s->empty())
+                --empty;
+            done += s->manager.allocate_batch(count - done, n, out + done);
+        }
+        return done;
+    }
+
+    // Chains a new slab and allocates in it
+    uint8_t* grow(size_type b_count, size_type b_size, size_type n, const arena_backing& backing) {
+        head = new slab(b_count, b_size, head, backing);
+        return head->manager.allocate(n);
+    }
+
+    // Returns false if the pointer isn't in any of the slabs
+    bool deallocate(uint8_t* p, size_type n, const growth_policy& policy) {
+        for (slab** link = &head; *link != nullptr; link = &(*link)->next) {
+            slab* s = *link;
+            if (!s->manager.contains(p))
+                continue;
+            // Only a free that empties the slab counts, not one the manager ignored
+            const bool was_empty = s->empty();
+            s->manager.deallocate(p, n);
+            if (!was_empty && s->empty() && ++empty > policy.hysteresis) {
+                *link = s->next;
+                delete s;
+                --empty;
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+
+// Memory shared by all copies of a block_allocator (and it's rebinds)
+// Manager - the block bookkeeping, works in Bytes
+// The slabs are guarded by a mutex, so they don't break a thread-safe Manager
+template <class Manager>
+struct __block_arena {
+    typedef std::size_t size_type;
+
+    arena_backing         backing;
+    uint8_t*              data;
+    Manager               manager;
+    growth_policy         policy;
+    __slab_chain<Manager> slabs;
+    std::mutex            slabs_lock;
+
+    __block_arena(size_type b_count, size_type b_size, const growth_policy& growth, const arena_backing& source):
+        backing(source), data(__arena_map(b_count*b_size, backing, __block_align(b_size))),
+        manager(data, b_count, b_size), policy(growth) {}
+
+    __block_arena(const __block_arena&) = delete;
+    __block_arena& operator= (const __block_arena&) = delete;
+
+    ~__block_arena() {
+        __arena_unmap(data, manager.block_count*manager.block_size, backing);
+    }
+
+    uint8_t* allocate(size_type n) {
+        if (!policy.grow || n > manager.block_size)
+            return manager.allocate(n);
+
+        // With a thread-safe Manager someone might take the last block after the check
+        if (!manager.full()) {
+            try {
+                return manager.allocate(n);
+            } catch (std::bad_alloc&) {}
+        }
+
+        std::lock_guard<std::mutex> guard(slabs_lock);
+        uint8_t* ptr = slabs.allocate(n);
+        if (ptr == nullptr)
+            ptr = slabs.grow(slabs.next_count(manager.block_count, policy), manager.block_size, n, backing);
+        return ptr;
+    }
+
+    void deallocate(uint8_t* p, size_type n) {
+        if (!policy.grow || manager.contains(p)) {
+            manager.deallocate(p, n);
+            return;
+        }
+        std::lock_guard<std::mutex> guard(slabs_lock);
+        slabs.deallocate(p, n, policy);
+    }
+
+    // All or nothing: on std::bad_alloc none of the blocks are kept
+    void allocate_batch(size_type count, size_type n, uint8_t** out) {
+        size_type done = manager.allocate_batch(count, n, out);
+        if (done < count && policy.grow && n <= manager.block_size) {
+            try {
+                std::lock_guard<std::mutex> guard(slabs_lock);
+                done += slabs.allocate_batch(count - done, n, out + done);
+                while (done < count) {
+                    out[done++] = slabs.grow(slabs.next_count(manager.block_count, policy), manager.block_size, n, backing);
+                    done += slabs.allocate_batch(count - done, n, out + done);
+                }
+            } catch (std::bad_alloc&) {
+                deallocate_batch(out, done, n);
+                throw;
+            }
+        }
+        if (done < count) {
+            deallocate_batch(out, done, n);
+            throw std::bad_alloc();
+        }
+    }
+
+    // Blocks of the main buffer are returned in runs, the slab ones - one by one under the lock
+    void deallocate_batch(uint8_t* const* ptrs, size_type count, size_type n) {
+        if (!policy.grow) {
+            manager.deallocate_batch(ptrs, count, n);
+            return;
+        }
+        for (size_type i = 0, j; i < count; i = j) {
+            for (j = i; j < count && manager.contains(ptrs[j]); j++) {}
+            manager.deallocate_batch(ptrs + i, j - i, n);
+            if (j == count)
+                break;
+            std::lock_guard<std::mutex> guard(slabs_lock);
+            for (; j < count && !manager.contains(ptrs[j]); j++)
+                slabs.deallocate(ptrs[j], n, policy);
+        }
+    }
+
+    size_type max_size() const noexcept {
+        return policy.grow ? manager.block_size : manager.max_size();
+    }
+
+    std::vector<bucket_stats> stats() {
+        std::vector<bucket_stats> result(1, manager.stats());
+        std::lock_guard<std::mutex> guard(slabs_lock);
+        slabs.add_stats(result[0]);
+        return result;
+    }
+};
+
+
+// block_allocator with the block size in Bytes, so all of it's rebinds are the same template
+// and know the geometry of the blocks they share
+template <class T, size_t block_count, size_t block_bytes, class Manager>
+class __block_allocator {
 //////// TYPEDEFS
 public:
     typedef T                 value_type;
@@ -236,59 +831,193 @@ public:
     typedef std::size_t       size_type;
     typedef std::ptrdiff_t    difference_type;
 
+    // The blocks go wherever the allocator goes
+    typedef std::true_type    propagate_on_container_copy_assignment;
+    typedef std::true_type    propagate_on_container_move_assignment;
+    typedef std::true_type    propagate_on_container_swap;
+    typedef std::false_type   is_always_equal;
+
+    // Rebound allocators keep the block size of the original, since they share it's arena
+    template <class U>
+    struct rebind {
+        typedef __block_allocator<U, block_count, block_bytes, Manager> other;
+    };
+
+    // Alignment of every block in Bytes
+    constexpr static size_type block_align = __block_align(block_bytes);
+
+    // Rebinds share the blocks of the original, so a node type of a container
+    // can need more alignment than the blocks have
+    static_assert(alignof(typename std::conditional<std::is_same<T, void>::value, uint8_t, T>::type) <= block_align,
+        "the blocks don't keep the alignment of T, give them a size that is a multiple of it");
+
 private:
-    typedef __bucket_manager<T> bucket_manager;
-    bucket_manager manager;
-    pointer        data;
+    typedef __block_arena<Manager> arena_type;
+    std::shared_ptr<arena_type> arena;
+
+    template <class, size_t, size_t, class>
+    friend class __block_allocator;
 
-    size_type value_size() const noexcept {
-        return bucket_manager::value_size();
+    constexpr static size_type value_size() noexcept {
+        return __bucket_manager<T>::value_size();
     }
 
 public:
-    block_allocator() {
-        size_type alloc_size = block_count*block_size*value_size();
-        data = (pointer)malloc(alloc_size);
-        manager = bucket_manager(data, block_count, block_size*value_size());
-    }
+    __block_allocator():
+        arena(std::make_shared<arena_type>(block_count, block_bytes, growth_policy(), arena_backing())) {}
 
-    ~block_allocator() {
-        free(data);
-    }
+    explicit __block_allocator(const growth_policy& policy, const arena_backing& backing = arena_backing()):
+        arena(std::make_shared<arena_type>(block_count, block_bytes, policy, backing)) {}
+
+    explicit __block_allocator(const arena_backing& backing):
+        arena(std::make_shared<arena_type>(block_count, block_bytes, growth_policy(), backing)) {}
+
+    template <class U>
+    __block_allocator(const __block_allocator<U, block_count, block_bytes, Manager>& other) noexcept:
+        arena(other.arena) {}
 
     inline pointer allocate(const size_type& n) {
-        return manager.allocate(n);
+        return (pointer)arena->allocate(__request_bytes(n, value_size()));
     }
 
     inline void deallocate(const pointer& p, const size_type& n) {
-        manager.deallocate(p,n);
+        arena->deallocate((uint8_t*)p, n*value_size());
+    }
+
+    // Allocates count blocks of n objects each into out
+    // All or nothing: throws std::bad_alloc without keeping any of them
+    void allocate_batch(size_type count, size_type n, pointer* out) {
+        arena->allocate_batch(count, __request_bytes(n, value_size()), (uint8_t**)out);
+    }
+
+    void deallocate_batch(const pointer* ptrs, size_type count, size_type n) {
+        arena->deallocate_batch((uint8_t* const*)ptrs, count, n*value_size());
     }
 
     inline size_type max_size() const {
-        return manager.max_size();
+        return arena->max_size()/value_size();
+    }
+
+    // Counters of the blocks, see bucket_stats and SEGALLOC_STATS
+    std::vector<bucket_stats> stats() const {
+        return arena->stats();
+    }
+
+    //////// OPERATORS
+
+    // Members and not friends, so they can see the other allocator's arena
+    template <class U>
+    bool operator== (const __block_allocator<U, block_count, block_bytes, Manager>& r) const noexcept {
+        return arena == r.arena;
+    }
+
+    template <class U>
+    bool operator!= (const __block_allocator<U, block_count, block_bytes, Manager>& r) const noexcept {
+        return !(*this==r);
     }
 };
 
-// Struct for defining a block, used in bucket_allocator
-template <size_t count, size_t size>
-struct bucket_traits {
-    constexpr static size_t block_count() noexcept {
-        return count;
+// Allocates same-size blocks that it then can give out
+// Copies and rebinds share the same blocks, so one allocator can serve a whole container
+// A growth_policy passed to the constructor lets it chain more blocks instead of throwing,
+// an arena_backing - take the memory from mmap, with huge pages, prefaulted and/or locked
+// T - the type for the allocator
+// block_size - the amount of T objects inside a block (NOT BYTESIZE!!!)
+// block_count - Amount of blocks
+// Manager - the block bookkeeping, alc::__atomic_bucket_manager makes the allocator thread-safe
+template <class T, size_t block_count, size_t block_size, class Manager = __bucket_manager<uint8_t>>
+using block_allocator = __block_allocator<T, block_count, block_size*__bucket_manager<T>::value_size(), Manager>;
+
+// Chunk chained to a __monotonic_arena once it's buffer ran out
+struct __monotonic_chunk {
+    arena_backing      backing;
+    uint8_t*           data;
+    std::size_t        size;
+    __monotonic_chunk* next;
+
+    __monotonic_chunk(std::size_t bytes, __monotonic_chunk* next_chunk, const arena_backing& source):
+        backing(source), data(__arena_map(bytes, backing)), size(bytes), next(next_chunk) {}
+
+    ~__monotonic_chunk() {
+        __arena_unmap(data, size, backing);
     }
+};
 
-    constexpr static size_t block_size() noexcept {
-        return size;
+// Memory shared by all copies of a monotonic_allocator (and it's rebinds)
+// Memory is given out by bumping a pointer, and only taken back all at once by reset()
+struct __monotonic_arena {
+    typedef std::size_t size_type;
+
+    arena_backing      backing;
+    uint8_t*           data;
+    size_type          data_size;
+    growth_policy      policy;
+    // Chained chunks, the newest first
+    __monotonic_chunk* chunks;
+    // Next free Byte and the end of the buffer/chunk that is being used
+    uint8_t*           current;
+    uint8_t*           end;
+
+    __monotonic_arena(size_type bytes, const growth_policy& growth, const arena_backing& source):
+        backing(source), data(__arena_map(bytes, backing)), data_size(bytes), policy(growth),
+        chunks(nullptr), current(data), end(data + bytes) {}
+
+    __monotonic_arena(const __monotonic_arena&) = delete;
+    __monotonic_arena& operator= (const __monotonic_arena&) = delete;
+
+    ~__monotonic_arena() {
+        release_chunks();
+        __arena_unmap(data, data_size, backing);
+    }
+
+    void release_chunks() noexcept {
+        while (chunks != nullptr) {
+            __monotonic_chunk* next = chunks->next;
+            delete chunks;
+            chunks = next;
+        }
+    }
+
+    // align has to be a power of 2
+    uint8_t* allocate(size_type bytes, size_type align) {
+        uint8_t* ptr = (uint8_t*)(((uintptr_t)current + align-1) & ~(uintptr_t)(align-1));
+        if (ptr > end || bytes > (size_type)(end - ptr)) {
+            if (!policy.grow)
+                throw std::bad_alloc();
+            // Every chunk is factor times bigger than the last one, and fits the request
+            size_type last = (chunks == nullptr) ? data_size : chunks->size;
+            chunks  = new __monotonic_chunk(std::max(last*policy.factor, bytes + align), chunks, backing);
+            current = chunks->data;
+            end     = chunks->data + chunks->size;
+            ptr     = (uint8_t*)(((uintptr_t)current + align-1) & ~(uintptr_t)(align-1));
+        }
+        current = ptr + bytes;
+        return ptr;
+    }
+
+    // Gives back everything at once, the chained chunks go back to the system
+    void reset() noexcept {
+        release_chunks();
+        current = data;
+        end     = data + data_size;
+    }
+
+    // Bytes left before the arena has to grow
+    size_type available() const noexcept {
+        return end - current;
     }
 };
 
 
-// Allocates buckets with blocks of different sizes
-// It is recommended that alc::bucket_traits are used,
-// however, any literal type which has these 2 functions is allowed:
-// * size_t ::block_count()  - amount of blocks inside the bucket
-// * size_t ::block_size()   - amount of items in each block (NOT BYTESIZE!!!!)
-template<class T, typename... buckets>
-class bucket_allocator: std::allocator<T> {
+// Gives out memory by bumping a pointer, for objects that all die together
+// deallocate does nothing, the whole arena is taken back at once by reset()
+// Copies and rebinds share the same arena, so reset() on any of them frees everything
+// A growth_policy passed to the constructor lets it chain more memory instead of throwing,
+// an arena_backing - take the memory from mmap, with huge pages, prefaulted and/or locked
+// T - the type for the allocator
+// size - Byte size of the arena
+template <class T, size_t size>
+class monotonic_allocator {
 //////// TYPEDEFS
 public:
     typedef T                 value_type;
@@ -299,148 +1028,393 @@ public:
     typedef std::size_t       size_type;
     typedef std::ptrdiff_t    difference_type;
 
+    // The arena goes wherever the allocator goes
+    typedef std::true_type    propagate_on_container_copy_assignment;
+    typedef std::true_type    propagate_on_container_move_assignment;
+    typedef std::true_type    propagate_on_container_swap;
+    typedef std::false_type   is_always_equal;
+
+    template <class U>
+    struct rebind {
+        typedef monotonic_allocator<U, size> other;
+    };
+
 private:
-    typedef __bucket_manager<T> bucket_manager;
-    // Bucket managers for every bucket
-    bucket_manager* managers;
-    // Pointer to the start of allocator's internal buffer
-    pointer         data;
-    // How much T objects can the biggest available block hold
-    size_type       max_block;
+    std::shared_ptr<__monotonic_arena> arena;
+
+    template <class, size_t>
+    friend class monotonic_allocator;
 
-    size_type value_size() const noexcept {
-        return bucket_manager::value_size();
+    constexpr static size_type value_size() noexcept {
+        return __bucket_manager<T>::value_size();
     }
 
-    size_type buckets_count() const noexcept {
-        return sizeof...(buckets);
+    constexpr static size_type value_align() noexcept {
+        return std::alignment_of<typename std::conditional<std::is_same<T, void>::value, uint8_t, T>::type>::value;
     }
 
 public:
+    monotonic_allocator():
+        arena(std::make_shared<__monotonic_arena>(size, growth_policy(), arena_backing())) {}
+
+    explicit monotonic_allocator(const growth_policy& policy, const arena_backing& backing = arena_backing()):
+        arena(std::make_shared<__monotonic_arena>(size, policy, backing)) {}
+
+    explicit monotonic_allocator(const arena_backing& backing):
+        arena(std::make_shared<__monotonic_arena>(size, growth_policy(), backing)) {}
+
+    template <class U>
+    monotonic_allocator(const monotonic_allocator<U, size>& other) noexcept:
+        arena(other.arena) {}
+
+    inline pointer allocate(const size_type& n) {
+        return (pointer)arena->allocate(__request_bytes(n, value_size()), value_align());
+    }
+
+    inline void deallocate(const pointer&, const size_type&) noexcept {}
+
+    // Everything given out by this arena is freed in O(1)
+    // Objects in it have to be dead (or trivially destructible) by then
+    inline void reset() noexcept {
+        arena->reset();
+    }
+
+    inline size_type max_size() const noexcept {
+        return arena->policy.grow ? size_type(-1)/value_size() : arena->available()/value_size();
+    }
+
+    //////// OPERATORS
+
+    // Members and not friends, so they can see the other allocator's arena
+    template <class U>
+    bool operator== (const monotonic_allocator<U, size>& r) const noexcept {
+        return arena == r.arena;
+    }
+
+    template <class U>
+    bool operator!= (const monotonic_allocator<U, size>& r) const noexcept {
+        return !(*this==r);
+    }
+};
+
+// Size of a cache line on everything we run on
+constexpr size_t cache_line_size = 64;
+
+// Struct for defining a block, used in bucket_allocator
+// align - alignment of every block in Bytes, blocks are padded up to a multiple of it
+template <size_t count, size_t size, size_t align = 1>
+struct bucket_traits {
+    static_assert((align & (align-1)) == 0 && align <= 4096, "block alignment has to be a power of 2, up to 4096");
+
+    constexpr static size_t block_count() noexcept {
+        return count;
+    }
+
+    constexpr static size_t block_size() noexcept {
+        return size;
+    }
+
+    constexpr static size_t block_align() noexcept {
+        return align;
+    }
+};
+
+// One block per cache line: blocks are padded to whole lines,
+// so objects given to different threads never share one
+template <size_t count, size_t size>
+using cache_line_bucket = bucket_traits<count, size, cache_line_size>;
+
+// Alignment of the bucket's blocks, 1 if it doesn't have block_align()
+template <class bucket, class = void>
+struct __bucket_align {
+    constexpr static size_t value = 1;
+};
+
+template <class bucket>
+struct __bucket_align<bucket, decltype((void)bucket::block_align())> {
+    constexpr static size_t value = bucket::block_align();
+};
+
+// Bucket with the block size in Bytes
+// Buckets of a bucket_allocator are converted to it, so the rebound allocators share the arena type
+template <size_t count, size_t bytes, size_t align = 1>
+struct __byte_bucket {
+    constexpr static size_t block_count() noexcept {
+        return count;
+    }
+
+    constexpr static size_t block_size() noexcept {
+        return bytes;
+    }
+
+    constexpr static size_t block_align() noexcept {
+        return align;
+    }
+};
+
+// Blocks are aligned for T too, and padded to the alignment
+template <class T, class bucket>
+struct __to_byte_bucket {
+    constexpr static size_t align = std::max<size_t>(
+        __bucket_align<bucket>::value,
+        std::alignment_of<typename std::conditional<std::is_same<T, void>::value, uint8_t, T>::type>::value
+    );
+    constexpr static size_t bytes = bucket::block_size()*__bucket_manager<T>::value_size();
+
+    typedef __byte_bucket<bucket::block_count(), (bytes + align-1) & ~(align-1), align> type;
+};
+
+// Already in Bytes, happens with rebound allocators
+// Kept as is, so the rebound allocator shares the original's arena type, the alignment
+// that T needs is checked against the blocks' instead (see bucket_allocator::block_align)
+template <class T, size_t count, size_t bytes, size_t align>
+struct __to_byte_bucket<T, __byte_bucket<count, bytes, align>> {
+    typedef __byte_bucket<count, bytes, align> type;
+};
+
+
+// Compile-time geometry of bucket_allocator's buckets
+// Buckets are sorted by block size, biggest first. This is also the fallback order:
+// when a bucket is full, the one before it is the next best fit
+template <typename... buckets>
+struct __bucket_layout {
+    typedef std::size_t size_type;
+    // Smallest type that can index every bucket
+    typedef typename std::conditional<(sizeof...(buckets) < 256), uint8_t, uint16_t>::type index_type;
+
+    constexpr static size_type count = sizeof...(buckets);
+    static_assert(count > 0, "bucket_allocator needs at least one bucket");
+
+    // Requests up to this size are mapped to a bucket with a single table lookup
+    // Bigger ones (if there are such buckets) walk over the few buckets above it
+    constexpr static size_type lookup_limit = 4096;
+
+    struct geometry {
+        std::array<size_type, count> counts;
+        std::array<size_type, count> sizes;
+    };
+
+    // Stable insertion sort, so equal buckets keep their order
+    constexpr static geometry sort_buckets() {
+        geometry g = {{{buckets::block_count()...}}, {{buckets::block_size()...}}};
+        for (size_type i = 1; i < count; i++) {
+            for (size_type j = i; j > 0 && g.sizes[j-1] < g.sizes[j]; j--) {
+                size_type size  = g.sizes[j];
+                size_type cnt   = g.counts[j];
+                g.sizes[j]      = g.sizes[j-1];
+                g.counts[j]     = g.counts[j-1];
+                g.sizes[j-1]    = size;
+                g.counts[j-1]   = cnt;
+            }
+        }
+        return g;
+    }
+
+    constexpr static geometry sorted = sort_buckets();
+
+    // Alignment that the buffer (and every bucket in it) needs
+    constexpr static size_type max_align = std::max<size_type>({size_type(1), __bucket_align<buckets>::value...});
+
+    // Alignment that every block has, whichever bucket or slab it comes from
+    // A block keeps the __block_align of it's size, up to the alignment of the buffer,
+    // which is at least max_align_t's
+    constexpr static size_type block_align = std::min<size_type>({
+        std::min<size_type>(__block_align(buckets::block_size()), std::max<size_type>(alignof(std::max_align_t), max_align))...
+    });
+
+    // Biggest block, in items
+    constexpr static size_type max_block = sorted.sizes[0];
+
+    constexpr static size_type table_size = ((max_block < lookup_limit) ? max_block : lookup_limit) + 1;
+
+    // table[n] - the smallest bucket that fits n items
+    // Among equal buckets it's the last one, so the fallback tries the equal ones first
+    constexpr static std::array<index_type, table_size> make_table() {
+        std::array<index_type, table_size> table = {};
+        size_type bucket = count-1;
+        for (size_type n = 0; n < table_size; n++) {
+            while (sorted.sizes[bucket] < n)
+                --bucket;
+            table[n] = bucket;
+        }
+        return table;
+    }
+
+    constexpr static std::array<index_type, table_size> table = make_table();
+
+    // size_class() of a request that no bucket fits
+    constexpr static size_type npos = size_type(-1);
+
+    // Index of the smallest bucket that fits n items, npos if there's none
+    constexpr static size_type size_class(size_type n) noexcept {
+        if (n < table_size)
+            return table[n];
+        if (n > max_block)
+            return npos;
+        size_type bucket = table[table_size-1];
+        while (sorted.sizes[bucket] < n)
+            --bucket;
+        return bucket;
+    }
+};
+
+
+// log2 of the page size of a __bucket_arena with buckets of these Byte sizes
+// Pages are no bigger than the smallest bucket (but at least 64 Bytes),
+// so padding a bucket to a page at most doubles it
+// Buckets start on a page, so pages also keep the alignment of the blocks
+inline unsigned __bucket_page_shift(const std::size_t* bucket_bytes, std::size_t count, std::size_t max_align) noexcept {
+    std::size_t smallest = SIZE_MAX;
+    for (std::size_t i = 0; i < count; i++)
+        smallest = std::min(smallest, bucket_bytes[i]);
+    unsigned page_shift = 6;
+    while (page_shift < 12 && (std::size_t(2) << page_shift) <= smallest)
+        ++page_shift;
+    while ((std::size_t(1) << page_shift) < max_align)
+        ++page_shift;
+    return page_shift;
+}
+
+// Byte size of a __bucket_arena's buffer, with every bucket padded to a page
+inline std::size_t __bucket_buffer_size(const std::size_t* bucket_bytes, std::size_t count, unsigned page_shift) noexcept {
+    const std::size_t page_size = std::size_t(1) << page_shift;
+    std::size_t size = 0;
+    for (std::size_t i = 0; i < count; i++)
+        size += (bucket_bytes[i] + page_size-1) & ~(page_size-1);
+    return size;
+}
+
+// Memory shared by all copies of a bucket_allocator (and it's rebinds)
+// Everything is in Bytes
+template <typename... buckets>
+struct __bucket_arena {
+    typedef std::size_t                 size_type;
+    typedef __bucket_manager<uint8_t>   bucket_manager;
+    typedef __bucket_layout<buckets...> layout;
+
+    // Bucket managers for every bucket, in layout order
+    bucket_manager* managers;
+    // Pointer to the start of the internal buffer
+    uint8_t*        data;
+    // Byte size of the internal buffer
+    size_type       data_size;
+    // How much Bytes can the biggest available block hold
+    size_type       max_block;
+    // Every bucket starts on a page boundary (relative to data), so a page belongs to a single bucket
+    // pages[i] - the bucket the i-th page belongs to
+    typename layout::index_type* pages;
+    // log2 of the page size
+    unsigned        page_shift;
+    growth_policy   policy;
+    arena_backing   backing;
+    // Slabs chained to every bucket once it ran out, in layout order
+    std::array<__slab_chain<bucket_manager>, sizeof...(buckets)> slabs;
+
+    size_type buckets_count() const noexcept {
+        return sizeof...(buckets);
+    }
 
     //////// INIT / DEINIT
 
-    bucket_allocator() {
+    __bucket_arena(const growth_policy& growth, const arena_backing& source): policy(growth), backing(source) {
         // Step 1: create bucket_manager's
+        // The buckets are already sorted at compile time
         managers = (bucket_manager*)malloc(sizeof...(buckets)*sizeof(bucket_manager));
-        bucket_manager* curr_manager = managers;
-
-        // Loads of weird syntax to iterate over parameter pack
-        size_t counts[] = {buckets::block_count()...};
-        size_t sizes[]  = {buckets::block_size()...};
-        size_t alloc_size = 0;
-        for (int i = 0; i < sizeof...(buckets); i++) {
-            alloc_size += sizes[i]*counts[i];
-            new (curr_manager) bucket_manager(nullptr, counts[i], sizes[i]*value_size());
-            ++curr_manager;
+        std::array<size_t, sizeof...(buckets)> bucket_bytes;
+        for (size_type i = 0; i < buckets_count(); i++) {
+            bucket_bytes[i] = layout::sorted.sizes[i]*layout::sorted.counts[i];
+            new (managers + i) bucket_manager(nullptr, layout::sorted.counts[i], layout::sorted.sizes[i]);
         }
 
-
-        // Step 2: sort bucket managers for easier time
-        auto manager_comp = [] (const bucket_manager& l, const bucket_manager& r) {
-            return l.max_size() > r.max_size();
-        };
-        std::sort(managers, managers+sizeof...(buckets), manager_comp);
+        // Step 2: pick the page size
+        page_shift = __bucket_page_shift(bucket_bytes.data(), buckets_count(), layout::max_align);
+        const size_t page_size = size_t(1) << page_shift;
 
         // Step 3: allocate and set pointers
-        // Allocating the buffer
-        alloc_size *= value_size();
-        data = (pointer)malloc(alloc_size);
-        pointer currptr = data;
-        SEGALLOC_DPRINT("bucket_allocator(%p) - Allocated %lu Byte buffer @ %p\n", this, alloc_size, data);
-
-        // Setting pointers accordingly
-        for (int i = 0; i < buckets_count(); i++) {
-            SEGALLOC_DPRINT("bucket_allocator(%p) - Gave managers[%d] pointer %p (%lu Bytes from start)\n", this, i, currptr, (uint8_t*)currptr-(uint8_t*)data);
-            managers[i].start_ptr = currptr;
-            currptr += managers[i].block_capacity()*managers[i].block_count;
+        // Allocating the buffer, with every bucket padded to a page
+        const size_t alloc_size = __bucket_buffer_size(bucket_bytes.data(), buckets_count(), page_shift);
+        data      = __arena_map(alloc_size, backing, layout::max_align);
+        data_size = alloc_size;
+        pages     = (typename layout::index_type*)malloc((alloc_size >> page_shift)*sizeof(*pages));
+
+        // Setting pointers and pages accordingly
+        size_t offset = 0;
+        for (size_type i = 0; i < buckets_count(); i++) {
+            managers[i].start_ptr = data + offset;
+            size_t bucket_pages = (managers[i].block_size*managers[i].block_count + page_size-1) >> page_shift;
+            std::fill_n(pages + (offset >> page_shift), bucket_pages, i);
+            offset += bucket_pages << page_shift;
         }
 
         max_block = managers[0].max_size();
     }
 
-    ~bucket_allocator() {
-        for (int i = 0; i < buckets_count(); i++)
+    __bucket_arena(const __bucket_arena&) = delete;
+    __bucket_arena& operator= (const __bucket_arena&) = delete;
+
+    ~__bucket_arena() {
+        for (size_type i = 0; i < buckets_count(); i++)
             managers[i].~__bucket_manager();
-        free(data);
+        __arena_unmap(data, data_size, backing);
+        free(pages);
         free(managers);
     }
 
-private:
-    // Searches for the most appropriate bucket for the size
-    int search_bucket(size_type sz) {
-        int l = 0;
-        int r = buckets_count() - 1;
-        while (l < r) {
-            int mid = (l+r)/2;
-            if (managers[mid].block_capacity() == sz) {
-                return mid;
-            } else if (managers[mid].block_capacity() < sz) {
-                r = --mid;
-            } else {
-                l = ++mid;
-            }
-        }
-        return l;
+    //////// SECONDARY FUNCTIONS
+
+    bool contains(const uint8_t* p) const noexcept {
+        return (p >= data && p < data + data_size);
     }
 
     // Locates the bucket in which the pointer is
-    size_type locate_bucket(pointer p) {
-        int l = 0;
-        int r = buckets_count() - 1;
-        while (l < r) {
-            int mid = (l+r)/2;
-            if (managers[mid].contains(p)) {
-                return mid;
-            } else if (p > managers[mid].start_ptr) {
-                l = ++mid;
-            } else {
-                r = mid;
-            }
-        }
-        return l;
+    // Requires that the pointer is inside the buffer
+    size_type locate_bucket(const uint8_t* p) const noexcept {
+        return pages[(p - data) >> page_shift];
     }
 
-    // One-past-end pointer to the end of the buffer
-    pointer data_end() {
-        return managers[buckets_count()-1].start_ptr + managers[buckets_count()-1].block_capacity()*managers[buckets_count()-1].block_count;
+    inline size_type max_size() const noexcept {
+        return policy.grow ? layout::max_block : max_block;
     }
 
-public:
-    
-    pointer allocate(size_type n) {
-        if (max_size() < n)
-            throw std::bad_alloc();
-        // Locate closest by size
-        int bucket_index = search_bucket(n);
+    // One entry per bucket, in layout order, slabs are added to their bucket
+    std::vector<bucket_stats> stats() const {
+        std::vector<bucket_stats> result;
+        for (size_type i = 0; i < buckets_count(); i++) {
+            result.push_back(managers[i].stats());
+            slabs[i].add_stats(result.back());
+        }
+        return result;
+    }
 
-        // Move to bigger allocs until a free one is find
-        while (
-            (managers[bucket_index].full() || (managers[bucket_index].block_capacity() < n))
-               && bucket_index >= 0
-            ) {
-            --bucket_index;
+    // Recounts max_block from scratch, done once per batch
+    void update_max_block() noexcept {
+        max_block = 0;
+        for (size_type i = 0; i < buckets_count(); i++) {
+            if (!managers[i].full()) {
+                max_block = managers[i].block_capacity();
+                return;
+            }
         }
-        
-        // Ideally should never happen
-        if (bucket_index < 0)
-            throw std::bad_alloc();
-        
-        SEGALLOC_DPRINT("bucket_allocator(%p) - Allocating %lu Bytes in bucket %d\n", this, n, bucket_index);
-        pointer ptr = managers[bucket_index].allocate(n);
+    }
+
+    //////// ALLOCATION
+
+    // Allocates in a specific bucket and keeps max_block up to date
+    uint8_t* allocate_in(size_type bucket_index, size_type n) {
+        uint8_t* ptr = managers[bucket_index].allocate(n);
 
         // Check if we might have a new max_block
         if (managers[bucket_index].block_capacity() == max_block && managers[bucket_index].full()) {
 
             // Check left
-            for (int i = bucket_index-1; i >= 0; i--) {
+            for (size_type i = bucket_index; i-- > 0;) {
                 // Means there's another bucket of size max_size
                 if (!managers[i].full())
                     return ptr;
             }
 
             // Check right
-            for (int i = bucket_index+1; i < buckets_count(); i++) {
+            for (size_type i = bucket_index+1; i < buckets_count(); i++) {
                 // Means there's another chunk of size max_size
                 if (!managers[i].full()) {
                     max_block = managers[i].block_capacity();
@@ -452,16 +1426,9 @@ public:
 
         return ptr;
     }
-    
-    void deallocate(pointer p, size_type n) {
-        // Check that it actually belongs in the allocator
-        if (p < data || p >= data_end()) {
-            return;
-        }
 
-        // Deallocating
-        int bucket_index = locate_bucket(p);
-        SEGALLOC_DPRINT("bucket_allocator(%p) - Deallocating %p in bucket %d (%lu Bytes from start)\n", this, p, bucket_index, (uint8_t*)p-(uint8_t*)data);
+    // Deallocates in a specific bucket and keeps max_block up to date
+    void deallocate_in(size_type bucket_index, uint8_t* p, size_type n) {
         managers[bucket_index].deallocate(p, n);
 
         // Check if we got a new max_block
@@ -470,10 +1437,274 @@ public:
         }
     }
 
+    // Claims up to count blocks of a specific bucket, then of it's slabs, returns how many it got
+    // Doesn't chain new slabs, allocate() does that once the bigger buckets ran out too
+    size_type allocate_batch_in(size_type bucket_index, size_type count, size_type n, uint8_t** out) {
+        size_type done = managers[bucket_index].allocate_batch(count, n, out);
+        if (done != 0)
+            update_max_block();
+        if (policy.grow && done < count)
+            done += slabs[bucket_index].allocate_batch(count - done, n, out + done);
+        return done;
+    }
+
+    // Returns blocks of a specific bucket or it's slabs at once
+    void deallocate_batch_in(size_type bucket_index, uint8_t* const* ptrs, size_type count) {
+        bucket_manager& manager = managers[bucket_index];
+        for (size_type i = 0, j; i < count; i = j) {
+            j = i+1;
+            if (!manager.contains(ptrs[i])) {
+                if (policy.grow)
+                    slabs[bucket_index].deallocate(ptrs[i], 0, policy);
+                continue;
+            }
+            while (j < count && manager.contains(ptrs[j]))
+                ++j;
+            manager.deallocate_batch(ptrs + i, j - i, 0);
+        }
+        if (!manager.full() && manager.block_capacity() > max_block)
+            max_block = manager.block_capacity();
+    }
+
+    uint8_t* allocate(size_type n) {
+        if (max_size() < n) {
+            SEGALLOC_COUNT(++managers[(layout::size_class(n) == layout::npos) ? 0 : layout::size_class(n)].counters.failures)
+            throw std::bad_alloc();
+        }
+        // Locate closest by size
+        const size_type size_class = layout::size_class(n);
+        size_type bucket_index = size_class;
+
+        // Slabs of the closest bucket come before the bigger buckets
+        if (policy.grow && managers[bucket_index].full()) {
+            uint8_t* ptr = slabs[size_class].allocate(n);
+            if (ptr != nullptr)
+                return ptr;
+        }
+
+        // Move to bigger allocs until a free one is find
+        // Going past the biggest one wraps around to npos
+        while (bucket_index != layout::npos && managers[bucket_index].full())
+            --bucket_index;
+        
+        if (bucket_index == layout::npos) {
+            if (!policy.grow) {
+                SEGALLOC_COUNT(++managers[size_class].counters.failures)
+                throw std::bad_alloc();
+            }
+            __slab_chain<bucket_manager>& chain = slabs[size_class];
+            return chain.grow(chain.next_count(managers[size_class].block_count, policy), managers[size_class].block_size, n, backing);
+        }
+        
+        SEGALLOC_COUNT(managers[size_class].counters.fallbacks += (bucket_index != size_class))
+        return allocate_in(bucket_index, n);
+    }
+    
+    void deallocate(uint8_t* p, size_type n) {
+        // Check that it actually belongs in the allocator
+        if (!contains(p)) {
+            if (policy.grow)
+                deallocate_slab(p, n);
+            return;
+        }
+
+        // Sized fast path: the block is most likely in the bucket n maps to
+        size_type bucket_index = layout::size_class(n);
+        if (n == 0 || bucket_index == layout::npos || !managers[bucket_index].contains(p))
+            bucket_index = locate_bucket(p);
+        deallocate_in(bucket_index, p, n);
+    }
+
+    // Claims count blocks of n Bytes, going over the buckets in the same order as allocate()
+    // All or nothing: on std::bad_alloc none of the blocks are kept
+    void allocate_batch(size_type count, size_type n, uint8_t** out) {
+        if (count == 0)
+            return;
+        const size_type size_class = layout::size_class(n);
+        if (size_class == layout::npos) {
+            SEGALLOC_COUNT(++managers[0].counters.failures)
+            throw std::bad_alloc();
+        }
+
+        size_type done = managers[size_class].allocate_batch(count, n, out);
+        if (policy.grow)
+            done += slabs[size_class].allocate_batch(count - done, n, out + done);
+        for (size_type i = size_class; i-- > 0 && done < count;) {
+            size_type taken = managers[i].allocate_batch(count - done, n, out + done);
+            SEGALLOC_COUNT(managers[size_class].counters.fallbacks += taken)
+            done += taken;
+        }
+        update_max_block();
+
+        try {
+            __slab_chain<bucket_manager>& chain = slabs[size_class];
+            while (done < count && policy.grow) {
+                out[done++] = chain.grow(chain.next_count(managers[size_class].block_count, policy), managers[size_class].block_size, n, backing);
+                done += chain.allocate_batch(count - done, n, out + done);
+            }
+        } catch (std::bad_alloc&) {
+            deallocate_batch(out, done, n);
+            throw;
+        }
+        if (done < count) {
+            SEGALLOC_COUNT(++managers[size_class].counters.failures)
+            deallocate_batch(out, done, n);
+            throw std::bad_alloc();
+        }
+    }
+
+    // Pointers of the same bucket that come in a row are returned to it at once
+    void deallocate_batch(uint8_t* const* ptrs, size_type count, size_type n) {
+        const size_type size_class = layout::size_class(n);
+        for (size_type i = 0, j; i < count; i = j) {
+            j = i+1;
+            if (!contains(ptrs[i])) {
+                if (policy.grow)
+                    deallocate_slab(ptrs[i], n);
+                continue;
+            }
+            size_type bucket_index = size_class;
+            if (n == 0 || bucket_index == layout::npos || !managers[bucket_index].contains(ptrs[i]))
+                bucket_index = locate_bucket(ptrs[i]);
+            while (j < count && managers[bucket_index].contains(ptrs[j]))
+                ++j;
+            managers[bucket_index].deallocate_batch(ptrs + i, j - i, n);
+        }
+        update_max_block();
+    }
+
+    // Looks for the slab of the pointer, starting with the size class of n
+    void deallocate_slab(uint8_t* p, size_type n) {
+        const size_type size_class = layout::size_class(n);
+        if (n != 0 && size_class != layout::npos && slabs[size_class].deallocate(p, n, policy))
+            return;
+        for (size_type i = 0; i < buckets_count(); i++) {
+            if (slabs[i].deallocate(p, n, policy))
+                return;
+        }
+    }
+};
+
+
+// bucket_allocator with the buckets already converted to __byte_bucket's
+// The conversion is done once, by the alias, so every rebind is the same template
+// and rebinding back gives the original type
+template<class T, typename... buckets>
+class __bucket_allocator {
+//////// TYPEDEFS
+public:
+    typedef T                 value_type;
+    typedef value_type*       pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type&       reference;
+    typedef const value_type& const_reference;
+    typedef std::size_t       size_type;
+    typedef std::ptrdiff_t    difference_type;
+
+    // The buckets go wherever the allocator goes
+    typedef std::true_type    propagate_on_container_copy_assignment;
+    typedef std::true_type    propagate_on_container_move_assignment;
+    typedef std::true_type    propagate_on_container_swap;
+    typedef std::false_type   is_always_equal;
+
+    // Rebound allocators get the same buckets in Bytes, so they keep the geometry of the original
+    template <class U>
+    struct rebind {
+        typedef __bucket_allocator<U, buckets...> other;
+    };
+
+private:
+    typedef __bucket_arena<buckets...> arena_type;
+    std::shared_ptr<arena_type> arena;
+
+public:
+    // Alignment of every block in Bytes
+    constexpr static size_type block_align = arena_type::layout::block_align;
+
+    // Rebinds share the buckets of the original, so a node type of a container
+    // can need more alignment than the blocks were laid out for
+    static_assert(alignof(typename std::conditional<std::is_same<T, void>::value, uint8_t, T>::type) <= block_align,
+        "the buckets don't keep the alignment of T, give them a bucket_traits align or a size that is a multiple of it");
+
+private:
+
+    template <class, typename...>
+    friend class __bucket_allocator;
+
+    constexpr static size_type value_size() noexcept {
+        return __bucket_manager<T>::value_size();
+    }
+
+public:
+
+    //////// INIT / DEINIT
+
+    __bucket_allocator(): arena(std::make_shared<arena_type>(growth_policy(), arena_backing())) {}
+
+    explicit __bucket_allocator(const growth_policy& policy, const arena_backing& backing = arena_backing()):
+        arena(std::make_shared<arena_type>(policy, backing)) {}
+
+    explicit __bucket_allocator(const arena_backing& backing):
+        arena(std::make_shared<arena_type>(growth_policy(), backing)) {}
+
+    // Only compiles if the other allocator has the same buckets
+    template <class U, typename... others>
+    __bucket_allocator(const __bucket_allocator<U, others...>& other) noexcept: arena(other.arena) {}
+
+    //////// ALLOCATION
+    
+    pointer allocate(size_type n) {
+        return (pointer)arena->allocate(__request_bytes(n, value_size()));
+    }
+    
+    void deallocate(pointer p, size_type n) {
+        arena->deallocate((uint8_t*)p, n*value_size());
+    }
+
+    // Allocates count blocks of n objects each into out, a whole run of a bucket at a time
+    // All or nothing: throws std::bad_alloc without keeping any of them
+    void allocate_batch(size_type count, size_type n, pointer* out) {
+        arena->allocate_batch(count, __request_bytes(n, value_size()), (uint8_t**)out);
+    }
+
+    // n is the same size hint as in deallocate, 0 if unknown
+    void deallocate_batch(const pointer* ptrs, size_type count, size_type n) {
+        arena->deallocate_batch((uint8_t* const*)ptrs, count, n*value_size());
+    }
 
     inline size_type max_size() const noexcept {
-        return max_block;
+        return arena->max_size()/value_size();
+    }
+
+    // Counters of every bucket in layout order, see bucket_stats and SEGALLOC_STATS
+    std::vector<bucket_stats> stats() const {
+        return arena->stats();
+    }
+
+    //////// OPERATORS
+
+    // Members and not friends, so they can see the other allocator's arena
+    template <class U, typename... others>
+    bool operator== (const __bucket_allocator<U, others...>& r) const noexcept {
+        return (void*)arena.get() == (void*)r.arena.get();
+    }
+
+    template <class U, typename... others>
+    bool operator!= (const __bucket_allocator<U, others...>& r) const noexcept {
+        return !(*this==r);
     }
 };
 
-}
\ No newline at end of file
+// Allocates buckets with blocks of different sizes
+// Copies and rebinds share the same buckets, so one allocator can serve a whole container
+// A growth_policy passed to the constructor lets it chain more blocks to a bucket instead of throwing,
+// an arena_backing - take the memory from mmap, with huge pages, prefaulted and/or locked
+// It is recommended that alc::bucket_traits are used,
+// however, any literal type which has these 2 functions is allowed:
+// * size_t ::block_count()  - amount of blocks inside the bucket
+// * size_t ::block_size()   - amount of items in each block (NOT BYTESIZE!!!!)
+// and optionally size_t ::block_align() - alignment of each block in Bytes, see cache_line_bucket
+template<class T, typename... buckets>
+using bucket_allocator = __bucket_allocator<T, typename __to_byte_bucket<T, buckets>::type...>;
+
+}
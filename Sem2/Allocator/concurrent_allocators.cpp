@@ -0,0 +1,456 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include "block_allocators.cpp"
+
+namespace alc {
+
+// Lock-free version of __bucket_manager
+// The availability table is made of 64-bit atomic words, a block is claimed
+// by a CAS on the first word with a free bit and returned with fetch_or
+// Relies on outside objects for freeing it's buffer pointer
+template <class T>
+class __atomic_bucket_manager {
+//////// TYPEDEFS
+public:
+    typedef T                 value_type;
+    typedef value_type*       pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type&       reference;
+    typedef const value_type& const_reference;
+    typedef std::size_t       size_type;
+    typedef std::ptrdiff_t    difference_type;
+
+//////// INTERNAL VALUES
+    // Start of the data buffer, aka the address of the first block
+    pointer   start_ptr;
+    // Amount of blocks
+    size_type block_count;
+    // Byte size of a single block
+    size_type block_size;
+    // Amount of available blocks
+    // Only a hint for full() and max_size(), the table is what decides
+    // Read it through available_blocks(), it can wrap below zero for a moment
+    std::atomic<size_type> available;
+    // Bitmap for block availability, block i is bit i%64 of word i/64
+    // 1 == block available
+    std::atomic<uint64_t>* table;
+    // Word where the last block was found, searching starts from it
+    std::atomic<size_type> hint;
+    #if SEGALLOC_STATS
+    __bucket_counters<std::atomic<size_type>> counters;
+    #endif
+
+//////// INTERNAL FUNCTIONS
+    size_type word_count() const noexcept {
+        return (block_count+63)/64;
+    }
+
+    // One-past-end pointer to the end of the buffer
+    pointer end_ptr() const noexcept {
+        return block_pointer(block_count);
+    }
+
+    // Pointer to the start of a block
+    pointer block_pointer(const size_type& index) const noexcept {
+        return (start_ptr + index*block_capacity());
+    }
+
+    // Index of the block at the pointer
+    size_type block_index(const pointer p) const noexcept {
+        return (p - start_ptr)/block_capacity();
+    }
+
+    // Returns how much of T objects a block can hold
+    size_type block_capacity() const noexcept {
+        return block_size/value_size();
+    }
+
+    bool contains(const pointer p) const {
+        return (p >= start_ptr && p < end_ptr());
+    }
+
+    // Sets the block's bit without touching available, false if it's not a taken block of this bucket
+    bool release(const pointer& p) {
+        // Pointer is outside of bounds or not aligned
+        if (!contains(p) || (p - start_ptr) % block_capacity() != 0)
+            return false;
+
+        size_type index = block_index(p);
+        uint64_t  mask  = uint64_t(1) << index%64;
+        // Block was already free
+        return !(table[index/64].fetch_or(mask, std::memory_order_release) & mask);
+    }
+
+    // available, clamped to [0, block_count]
+    // A freed block's bit is set before available goes up, so an allocation in between
+    // takes the block and pushes available below zero until the free catches up
+    size_type available_blocks() const noexcept {
+        const size_type count = available.load(std::memory_order_relaxed);
+        return (count > block_count) ? 0 : count;
+    }
+
+    //////// INIT / DEINIT
+
+    __atomic_bucket_manager(const pointer& ptr, const size_type& b_count, const size_type& b_size):
+        start_ptr(ptr), block_count(b_count), block_size(b_size), available(b_count), hint(0) {
+        table = new std::atomic<uint64_t>[word_count()];
+        for (size_type i = 0; i < block_count/64; i++)
+            table[i].store(~uint64_t(0), std::memory_order_relaxed);
+        // Padding bits of the last word are kept at 0
+        if (block_count%64 != 0)
+            table[block_count/64].store((uint64_t(1) << block_count%64) - 1, std::memory_order_relaxed);
+    }
+
+    // Blocks can't be given out by two managers at once
+    __atomic_bucket_manager(const __atomic_bucket_manager&) = delete;
+    __atomic_bucket_manager& operator= (const __atomic_bucket_manager&) = delete;
+
+    ~__atomic_bucket_manager() {
+        delete[] table;
+    }
+
+    //////// SECONDARY FUNCTIONS
+
+    bool full() const noexcept {
+        return (available_blocks() == 0);
+    }
+
+    // returns the amount if T objects (NOT BYTESIZE!!!) that could fit inside a block
+    size_type max_size() const noexcept {
+        return (block_capacity() * !full());
+    }
+
+    // Counters are read one by one, so a snapshot taken under load is only approximate
+    bucket_stats stats() const noexcept {
+        bucket_stats result;
+        result.block_size  = block_size;
+        result.block_count = block_count;
+        result.in_use      = block_count - available_blocks();
+        SEGALLOC_COUNT(counters.fill(result))
+        return result;
+    }
+
+    // Function for ease of working with T == void
+    constexpr static size_type value_size() {
+        return __bucket_manager<T>::value_size();
+    }
+
+    //////// ALLOCATION
+
+    pointer allocate(const size_type& n) {
+        if (n > block_capacity()) {
+            SEGALLOC_COUNT(counters.failures.fetch_add(1, std::memory_order_relaxed))
+            throw std::bad_alloc();
+        }
+
+        const size_type words = word_count();
+        size_type word = hint.load(std::memory_order_relaxed);
+        for (size_type i = 0; i < words; i++, word++) {
+            if (word == words)
+                word = 0;
+            uint64_t bits = table[word].load(std::memory_order_relaxed);
+            // Clear the lowest set bit, reloading the word if someone else was faster
+            while (bits != 0) {
+                if (table[word].compare_exchange_weak(bits, bits & (bits-1), std::memory_order_acquire, std::memory_order_relaxed)) {
+                    hint.store(word, std::memory_order_relaxed);
+                    SEGALLOC_COUNT(
+                        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+                        counters.requested_bytes.fetch_add(n*value_size(), std::memory_order_relaxed);
+                        counters.raise_high_water(std::min(block_count, block_count - available_blocks() + 1))
+                    )
+                    available.fetch_sub(1, std::memory_order_relaxed);
+                    return block_pointer(word*64 + __builtin_ctzll(bits));
+                }
+            }
+        }
+
+        SEGALLOC_COUNT(counters.failures.fetch_add(1, std::memory_order_relaxed))
+        throw std::bad_alloc();
+    }
+
+    void deallocate(const pointer& p, const size_type&) {
+        if (!release(p))
+            return;
+        available.fetch_add(1, std::memory_order_relaxed);
+        SEGALLOC_COUNT(counters.frees.fetch_add(1, std::memory_order_relaxed))
+    }
+
+    // Claims up to count blocks into out, returns how many it got
+    // Takes as many bits of a word as it needs with a single CAS
+    size_type allocate_batch(size_type count, const size_type& n, pointer* out) {
+        if (n > block_capacity())
+            return 0;
+
+        const size_type words = word_count();
+        size_type done = 0;
+        size_type word = hint.load(std::memory_order_relaxed);
+        for (size_type i = 0; i < words && done < count; i++, word++) {
+            if (word == words)
+                word = 0;
+            uint64_t bits  = table[word].load(std::memory_order_relaxed);
+            uint64_t taken = 0;
+            do {
+                // The lowest count-done bits of the word
+                taken = bits;
+                for (size_type k = __builtin_popcountll(taken); k > count - done; k--)
+                    taken &= ~(uint64_t(1) << (63 - __builtin_clzll(taken)));
+            } while (bits != 0 && !table[word].compare_exchange_weak(bits, bits & ~taken, std::memory_order_acquire, std::memory_order_relaxed));
+
+            if (taken == 0)
+                continue;
+            hint.store(word, std::memory_order_relaxed);
+            for (; taken != 0; taken &= taken-1)
+                out[done++] = block_pointer(word*64 + __builtin_ctzll(taken));
+        }
+
+        available.fetch_sub(done, std::memory_order_relaxed);
+        SEGALLOC_COUNT(
+            counters.allocations.fetch_add(done, std::memory_order_relaxed);
+            counters.requested_bytes.fetch_add(done*n*value_size(), std::memory_order_relaxed);
+            counters.raise_high_water(block_count - available_blocks())
+        )
+        return done;
+    }
+
+    // Returns how many of the blocks were actually freed
+    size_type deallocate_batch(const pointer* ptrs, size_type count, const size_type&) {
+        size_type freed = 0;
+        for (size_type i = 0; i < count; i++)
+            freed += release(ptrs[i]);
+        available.fetch_add(freed, std::memory_order_relaxed);
+        SEGALLOC_COUNT(counters.frees.fetch_add(freed, std::memory_order_relaxed))
+        return freed;
+    }
+};
+
+// block_allocator that can be shared between threads without a lock
+template <class T, size_t block_count, size_t block_size>
+using atomic_block_allocator = block_allocator<T, block_count, block_size, __atomic_bucket_manager<uint8_t>>;
+
+// Buckets of a concurrent_bucket_allocator and the lock for them
+// Outside of the allocator, so all of it's rebinds have the same state type
+template <class Arena>
+struct __concurrent_state {
+    std::mutex lock;
+    Arena      arena;
+    // Unique for every allocator, unlike the address of the state
+    uint64_t   id;
+
+    __concurrent_state(const growth_policy& policy, const arena_backing& backing): arena(policy, backing) {
+        static std::atomic<uint64_t> next_id(1);
+        id = next_id++;
+    }
+};
+
+// concurrent_bucket_allocator with the buckets already converted to __byte_bucket's, see __bucket_allocator
+template<class T, typename... buckets>
+class __concurrent_bucket_allocator {
+//////// TYPEDEFS
+public:
+    typedef T                 value_type;
+    typedef value_type*       pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type&       reference;
+    typedef const value_type& const_reference;
+    typedef std::size_t       size_type;
+    typedef std::ptrdiff_t    difference_type;
+
+    typedef std::true_type    propagate_on_container_copy_assignment;
+    typedef std::true_type    propagate_on_container_move_assignment;
+    typedef std::true_type    propagate_on_container_swap;
+    typedef std::false_type   is_always_equal;
+
+    template <class U>
+    struct rebind {
+        typedef __concurrent_bucket_allocator<U, buckets...> other;
+    };
+
+    // How many blocks a single magazine holds
+    constexpr static size_type magazine_size = 64;
+
+private:
+    typedef __bucket_arena<buckets...> arena_type;
+    typedef typename arena_type::layout layout;
+
+public:
+    // Alignment of every block in Bytes
+    constexpr static size_type block_align = layout::block_align;
+
+    // See bucket_allocator::block_align
+    static_assert(alignof(typename std::conditional<std::is_same<T, void>::value, uint8_t, T>::type) <= block_align,
+        "the buckets don't keep the alignment of T, give them a bucket_traits align or a size that is a multiple of it");
+
+private:
+
+    typedef __concurrent_state<arena_type> shared_state;
+
+    struct magazine {
+        uint8_t*  blocks[magazine_size];
+        size_type count = 0;
+    };
+
+    // Magazines of a single thread for a single allocator
+    // Flushed back to the allocator when the thread exits
+    struct thread_cache {
+        std::weak_ptr<shared_state> owner;
+        magazine                    magazines[sizeof...(buckets)];
+
+        ~thread_cache() {
+            std::shared_ptr<shared_state> state = owner.lock();
+            if (state == nullptr)
+                return;
+            std::lock_guard<std::mutex> guard(state->lock);
+            for (size_type i = 0; i < sizeof...(buckets); i++) {
+                state->arena.deallocate_batch_in(i, magazines[i].blocks, magazines[i].count);
+                magazines[i].count = 0;
+            }
+        }
+    };
+
+    std::shared_ptr<shared_state> state;
+
+    template <class, typename...>
+    friend class __concurrent_bucket_allocator;
+
+    constexpr static size_type value_size() noexcept {
+        return __bucket_manager<T>::value_size();
+    }
+
+    // Returns the calling thread's cache for this allocator
+    thread_cache& local_cache() const {
+        // Fast path for threads that stick to one allocator
+        static thread_local uint64_t      last_id    = 0;
+        static thread_local thread_cache* last_cache = nullptr;
+        static thread_local std::unordered_map<uint64_t, std::unique_ptr<thread_cache>> caches;
+
+        if (last_id == state->id)
+            return *last_cache;
+
+        auto found = caches.find(state->id);
+        if (found == caches.end()) {
+            // Drop caches of allocators that no longer exist
+            for (auto it = caches.begin(); it != caches.end();) {
+                if (it->second->owner.expired())
+                    it = caches.erase(it);
+                else
+                    ++it;
+            }
+            found = caches.emplace(state->id, std::make_unique<thread_cache>()).first;
+            found->second->owner = state;
+        }
+
+        last_id    = state->id;
+        last_cache = found->second.get();
+        return *last_cache;
+    }
+
+    // Fills the magazine up to a half from it's bucket, with a single batch
+    void refill(magazine& mag, size_type bucket_index, size_type n) {
+        std::lock_guard<std::mutex> guard(state->lock);
+        mag.count += state->arena.allocate_batch_in(bucket_index, magazine_size/2 - mag.count, n, mag.blocks + mag.count);
+    }
+
+    // Returns the upper half of the magazine to it's bucket, with a single batch
+    void flush(magazine& mag, size_type bucket_index) {
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->arena.deallocate_batch_in(bucket_index, mag.blocks + magazine_size/2, mag.count - magazine_size/2);
+        mag.count = magazine_size/2;
+    }
+
+public:
+
+    //////// INIT / DEINIT
+
+    __concurrent_bucket_allocator(): state(std::make_shared<shared_state>(growth_policy(), arena_backing())) {}
+
+    // Slabs are only touched under the lock, like the buckets themselves
+    explicit __concurrent_bucket_allocator(const growth_policy& policy, const arena_backing& backing = arena_backing()):
+        state(std::make_shared<shared_state>(policy, backing)) {}
+
+    explicit __concurrent_bucket_allocator(const arena_backing& backing):
+        state(std::make_shared<shared_state>(growth_policy(), backing)) {}
+
+    // Only compiles if the other allocator has the same buckets
+    template <class U, typename... others>
+    __concurrent_bucket_allocator(const __concurrent_bucket_allocator<U, others...>& other) noexcept:
+        state(other.state) {}
+
+    //////// ALLOCATION
+
+    pointer allocate(size_type n) {
+        const size_type bytes = __request_bytes(n, value_size());
+        const size_type bucket_index = layout::size_class(bytes);
+        if (bucket_index == layout::npos)
+            throw std::bad_alloc();
+
+        magazine& mag = local_cache().magazines[bucket_index];
+        if (mag.count == 0)
+            refill(mag, bucket_index, bytes);
+        if (mag.count != 0)
+            return (pointer)mag.blocks[--mag.count];
+
+        // The size class ran out, let the arena pick a bigger block
+        std::lock_guard<std::mutex> guard(state->lock);
+        return (pointer)state->arena.allocate(bytes);
+    }
+
+    void deallocate(pointer p, size_type n) {
+        arena_type& arena = state->arena;
+        // Bucket bounds never change after construction, so no lock is needed to read them
+        size_type bucket_index;
+        if (arena.contains((uint8_t*)p)) {
+            bucket_index = arena.locate_bucket((uint8_t*)p);
+        } else {
+            if (!arena.policy.grow)
+                return;
+            // A slab block always comes from the slabs of the size class of it's request,
+            // and deallocate gets the same size
+            bucket_index = layout::size_class(n*value_size());
+            if (bucket_index == layout::npos)
+                return;
+        }
+
+        magazine& mag = local_cache().magazines[bucket_index];
+        if (mag.count == magazine_size)
+            flush(mag, bucket_index);
+        mag.blocks[mag.count++] = (uint8_t*)p;
+    }
+
+    inline size_type max_size() const noexcept {
+        return layout::max_block/value_size();
+    }
+
+    // Counters of every bucket in layout order, see bucket_stats and SEGALLOC_STATS
+    // The buckets only see the magazines: blocks sitting in a magazine count as in use,
+    // and a refill counts every block with the size of the request that triggered it
+    std::vector<bucket_stats> stats() const {
+        std::lock_guard<std::mutex> guard(state->lock);
+        return state->arena.stats();
+    }
+
+    //////// OPERATORS
+
+    // Members and not friends, so they can see the other allocator's state
+    template <class U, typename... others>
+    bool operator== (const __concurrent_bucket_allocator<U, others...>& r) const noexcept {
+        return (void*)state.get() == (void*)r.state.get();
+    }
+
+    template <class U, typename... others>
+    bool operator!= (const __concurrent_bucket_allocator<U, others...>& r) const noexcept {
+        return !(*this==r);
+    }
+};
+
+// bucket_allocator that can be shared between threads
+// Every thread keeps a magazine (a small stack of free blocks) per bucket and
+// serves allocate/deallocate from it. The shared buckets are locked
+// only to refill an empty magazine or to flush half of a full one
+// Blocks of a bucket's slabs go through it's magazines too, so growth keeps the fast path
+// Copies and rebinds share the same buckets, so it's safe to hand a copy to every thread
+template<class T, typename... buckets>
+using concurrent_bucket_allocator = __concurrent_bucket_allocator<T, typename __to_byte_bucket<T, buckets>::type...>;
+
+}
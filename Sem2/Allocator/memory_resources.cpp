@@ -0,0 +1,70 @@
+#pragma once
+#include <memory_resource>
+#include "block_allocators.cpp"
+#include "concurrent_allocators.cpp"
+
+namespace alc {
+
+// Exposes an allocator of bytes as a std::pmr::memory_resource,
+// so it can back std::pmr containers without templating them on the allocator
+// Alloc - allocator with value_type of uint8_t and a block_align, thread-safe as much as Alloc is
+template <class Alloc>
+class allocator_resource: public std::pmr::memory_resource {
+public:
+    typedef Alloc allocator_type;
+
+private:
+    static_assert(std::is_same<typename Alloc::value_type, uint8_t>::value, "allocator_resource needs an allocator of bytes");
+
+    allocator_type allocator;
+
+protected:
+    // Every block has Alloc::block_align, bigger alignments can't be promised and throw bad_alloc
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (alignment > max_alignment)
+            throw std::bad_alloc();
+        return allocator.allocate(bytes);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t) override {
+        allocator.deallocate((uint8_t*)p, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    // The biggest alignment that allocations can ask for
+    constexpr static std::size_t max_alignment = Alloc::block_align;
+
+    allocator_resource() = default;
+
+    // Passes the arguments to the allocator, e.g. a growth_policy
+    template <class... Args>
+    explicit allocator_resource(Args&&... args): allocator(std::forward<Args>(args)...) {}
+
+    // Memory can't be shared between two resources
+    allocator_resource(const allocator_resource&) = delete;
+    allocator_resource& operator= (const allocator_resource&) = delete;
+
+    allocator_type& get_allocator() noexcept {
+        return allocator;
+    }
+};
+
+// block_size - Byte size of a block
+template <size_t block_count, size_t block_size>
+using unsynchronized_block_resource = allocator_resource<block_allocator<uint8_t, block_count, block_size>>;
+
+template <size_t block_count, size_t block_size>
+using synchronized_block_resource = allocator_resource<atomic_block_allocator<uint8_t, block_count, block_size>>;
+
+// block_size() of every bucket is in Bytes
+template <typename... buckets>
+using unsynchronized_bucket_resource = allocator_resource<bucket_allocator<uint8_t, buckets...>>;
+
+template <typename... buckets>
+using synchronized_bucket_resource = allocator_resource<concurrent_bucket_allocator<uint8_t, buckets...>>;
+
+}
@@ -0,0 +1,265 @@
+#pragma once
+#include <iterator>
+#include <new>
+#include "block_allocators.cpp"
+
+namespace alc {
+
+// Pool of T objects that are referred to by 32-bit handles instead of pointers
+// Objects sit in the blocks of a __bucket_manager, so they never move, and
+// live objects are marked in a bitmap, so iterating over them is a linear scan
+// A handle is the index of the block and it's generation: destroying an object
+// bumps the generation, so old handles to it (or to whatever reused the block) stop working
+// index_bits - how the 32 bits are split, the rest is the generation
+template <class T, unsigned index_bits = 24>
+class object_pool {
+//////// TYPEDEFS
+public:
+    typedef T                 value_type;
+    typedef value_type*       pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type&       reference;
+    typedef const value_type& const_reference;
+    typedef std::size_t       size_type;
+
+    static_assert(index_bits > 0 && index_bits < 32, "handles need both an index and a generation");
+    constexpr static unsigned generation_bits = 32 - index_bits;
+    // A block is retired once it's generation gets here, instead of wrapping around
+    // and making old handles to it work again
+    constexpr static uint32_t max_generation  = (uint32_t(1) << generation_bits) - 1;
+
+    class handle {
+        friend class object_pool;
+        uint32_t value;
+
+        handle(uint32_t index, uint32_t generation) noexcept: value(index | generation << index_bits) {}
+
+    public:
+        // Null handle, doesn't point to anything
+        handle() noexcept: value(uint32_t(-1)) {}
+
+        uint32_t index() const noexcept {
+            return value & ((uint32_t(1) << index_bits) - 1);
+        }
+
+        uint32_t generation() const noexcept {
+            return value >> index_bits;
+        }
+
+        friend bool operator== (const handle& l, const handle& r) noexcept {
+            return l.value == r.value;
+        }
+
+        friend bool operator!= (const handle& l, const handle& r) noexcept {
+            return l.value != r.value;
+        }
+    };
+    static_assert(sizeof(handle) == 4, "handles are 32-bit");
+
+private:
+    typedef typename std::conditional<(generation_bits <= 8), uint8_t,
+            typename std::conditional<(generation_bits <= 16), uint16_t, uint32_t>::type>::type generation_type;
+
+    // Generation of every block, max_generation for retired ones
+    generation_type*          generations;
+    // 1 == the block holds a live object
+    uint64_t*                 live;
+    __bucket_manager<T>       manager;
+    size_type                 live_count;
+
+    // The last index is taken by the null handle
+    static size_type checked_capacity(size_type capacity) {
+        if (capacity >= (size_type(1) << index_bits))
+            throw std::bad_alloc();
+        return capacity;
+    }
+
+    size_type word_count() const noexcept {
+        return (manager.block_count+63)/64;
+    }
+
+    bool is_live(size_type index) const noexcept {
+        return (live[index/64] >> index%64) & 1;
+    }
+
+public:
+    //////// ITERATION
+
+    // Goes over the live objects in the order of their blocks
+    // Keeps the live bits of the current word, so moving on is a ctz, not a scan
+    template <class Pool, class Value>
+    class basic_iterator {
+        friend class object_pool;
+        Pool*     pool;
+        size_type word;
+        // Live bits of the current word that are still ahead, the lowest one is the current object
+        uint64_t  bits;
+
+        basic_iterator(Pool* p, size_type w) noexcept:
+            pool(p), word(w), bits((w < p->word_count()) ? p->live[w] : 0) {
+            skip();
+        }
+
+        // Moves to the next word with a live object, if the current one has none left
+        void skip() noexcept {
+            const size_type words = pool->word_count();
+            while (bits == 0 && word < words) {
+                if (++word < words)
+                    bits = pool->live[word];
+            }
+        }
+
+        size_type index() const noexcept {
+            return word*64 + __builtin_ctzll(bits);
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Value                     value_type;
+        typedef std::ptrdiff_t            difference_type;
+        typedef Value*                    pointer;
+        typedef Value&                    reference;
+
+        reference operator* () const noexcept {
+            return pool->manager.start_ptr[index()];
+        }
+
+        pointer operator-> () const noexcept {
+            return pool->manager.start_ptr + index();
+        }
+
+        basic_iterator& operator++ () noexcept {
+            bits &= bits-1;
+            skip();
+            return *this;
+        }
+
+        basic_iterator operator++ (int) noexcept {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        // Handle of the object the iterator is at
+        handle get_handle() const noexcept {
+            return handle(index(), pool->generations[index()]);
+        }
+
+        friend bool operator== (const basic_iterator& l, const basic_iterator& r) noexcept {
+            return l.word == r.word && l.bits == r.bits;
+        }
+
+        friend bool operator!= (const basic_iterator& l, const basic_iterator& r) noexcept {
+            return !(l==r);
+        }
+    };
+
+    typedef basic_iterator<object_pool, T>             iterator;
+    typedef basic_iterator<const object_pool, const T> const_iterator;
+
+    //////// INIT / DEINIT
+
+    // Throws std::bad_alloc if handles can't index that many objects or there's no memory for them
+    explicit object_pool(size_type capacity):
+        generations(nullptr), live(nullptr),
+        manager((pointer)::operator new(checked_capacity(capacity)*sizeof(T), std::align_val_t(alignof(T))), capacity, sizeof(T)),
+        live_count(0) {
+        generations = (generation_type*)calloc(capacity, sizeof(generation_type));
+        live        = (uint64_t*)calloc(word_count(), sizeof(uint64_t));
+        if (capacity != 0 && (generations == nullptr || live == nullptr)) {
+            free(live);
+            free(generations);
+            ::operator delete(manager.start_ptr, std::align_val_t(alignof(T)));
+            throw std::bad_alloc();
+        }
+    }
+
+    object_pool(const object_pool&) = delete;
+    object_pool& operator= (const object_pool&) = delete;
+
+    ~object_pool() {
+        clear();
+        ::operator delete(manager.start_ptr, std::align_val_t(alignof(T)));
+        free(live);
+        free(generations);
+    }
+
+    //////// OBJECTS
+
+    // Constructs an object in a free block, throws std::bad_alloc if there's none
+    template <class... Args>
+    handle emplace(Args&&... args) {
+        pointer p = manager.allocate(1);
+        try {
+            new (p) T(std::forward<Args>(args)...);
+        } catch (...) {
+            manager.deallocate(p, 1);
+            throw;
+        }
+        size_type index = manager.block_index(p);
+        live[index/64] |= uint64_t(1) << index%64;
+        ++live_count;
+        return handle(index, generations[index]);
+    }
+
+    // Destroys the object, handles that are stale or null are ignored
+    // The block is reused, unless it ran out of generations
+    void destroy(handle h) {
+        pointer p = get(h);
+        if (p == nullptr)
+            return;
+        p->~T();
+        live[h.index()/64] &= ~(uint64_t(1) << h.index()%64);
+        --live_count;
+        if (++generations[h.index()] != max_generation)
+            manager.deallocate(p, 1);
+    }
+
+    // nullptr if the handle is stale or null
+    pointer get(handle h) noexcept {
+        return contains(h) ? manager.start_ptr + h.index() : nullptr;
+    }
+
+    const_pointer get(handle h) const noexcept {
+        return contains(h) ? manager.start_ptr + h.index() : nullptr;
+    }
+
+    bool contains(handle h) const noexcept {
+        return h.index() < manager.block_count && is_live(h.index()) && generations[h.index()] == h.generation();
+    }
+
+    void clear() {
+        for (iterator it = begin(); it != end(); ++it)
+            destroy(it.get_handle());
+    }
+
+    size_type size() const noexcept {
+        return live_count;
+    }
+
+    bool empty() const noexcept {
+        return live_count == 0;
+    }
+
+    size_type capacity() const noexcept {
+        return manager.block_count;
+    }
+
+    iterator begin() noexcept {
+        return iterator(this, 0);
+    }
+
+    iterator end() noexcept {
+        return iterator(this, word_count());
+    }
+
+    const_iterator begin() const noexcept {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const noexcept {
+        return const_iterator(this, word_count());
+    }
+};
+
+}
@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+#include <unistd.h>
+#include "benchmark/benchmark.h"
+
+#include "block_allocators.cpp"
+#include "concurrent_allocators.cpp"
+
+// Allocation patterns of real programs, run on our allocators next to
+// std::allocator, glibc malloc and a std::pmr pool
+// Every benchmark reports:
+// * time/op       - time per element of the pattern
+// * peak_rss      - how much the peak resident set grows over a single run, in a fresh process
+// * fragmentation - share of that growth that wasn't live requested memory at the peak
+//                   (allocator overhead, padding and memory that couldn't be reused)
+
+//////// Allocators
+
+// Straight to glibc, without operator new in between
+template <class T>
+struct malloc_allocator {
+    typedef T value_type;
+
+    malloc_allocator() = default;
+    template <class U>
+    malloc_allocator(const malloc_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        T* p = (T*)malloc(n*sizeof(T));
+        if (p == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void deallocate(T* p, size_t) noexcept {
+        free(p);
+    }
+
+    template <class U>
+    bool operator== (const malloc_allocator<U>&) const noexcept { return true; }
+    template <class U>
+    bool operator!= (const malloc_allocator<U>&) const noexcept { return false; }
+};
+
+// Counts the live requested Bytes, used to find the peak of a pattern
+std::atomic<size_t> live_bytes(0), peak_bytes(0);
+
+template <class T>
+struct counting_allocator {
+    typedef T value_type;
+
+    counting_allocator() = default;
+    template <class U>
+    counting_allocator(const counting_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        size_t live = live_bytes.fetch_add(n*sizeof(T)) + n*sizeof(T);
+        size_t peak = peak_bytes.load();
+        while (peak < live && !peak_bytes.compare_exchange_weak(peak, live)) {}
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        live_bytes.fetch_sub(n*sizeof(T));
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U>
+    bool operator== (const counting_allocator<U>&) const noexcept { return true; }
+    template <class U>
+    bool operator!= (const counting_allocator<U>&) const noexcept { return false; }
+};
+
+//////// Sources
+// A source owns whatever the allocators need and hands out an allocator for every type
+
+template <template <class> class Alloc>
+struct stateless_source {
+    template <class T>
+    using alloc = Alloc<T>;
+
+    template <class T>
+    alloc<T> get() { return alloc<T>(); }
+};
+
+typedef stateless_source<std::allocator>      std_source;
+typedef stateless_source<malloc_allocator>    malloc_source;
+typedef stateless_source<counting_allocator>  counting_source;
+
+template <class Resource>
+struct pmr_source {
+    Resource resource;
+
+    template <class T>
+    using alloc = std::pmr::polymorphic_allocator<T>;
+
+    template <class T>
+    alloc<T> get() { return alloc<T>(&resource); }
+};
+
+typedef pmr_source<std::pmr::unsynchronized_pool_resource> pool_source;
+typedef pmr_source<std::pmr::synchronized_pool_resource>   sync_pool_source;
+
+// Allocators of Bytes, rebound to every type, all of the rebinds share the arena
+template <class Base>
+struct rebind_source {
+    Base base;
+
+    rebind_source(): base(growth()) {}
+
+    // Fixed arenas are sized for the patterns, slabs are only a safety net
+    static alc::growth_policy growth() {
+        alc::growth_policy policy;
+        policy.grow = true;
+        return policy;
+    }
+
+    template <class T>
+    using alloc = typename std::allocator_traits<Base>::template rebind_alloc<T>;
+
+    template <class T>
+    alloc<T> get() { return alloc<T>(base); }
+};
+
+// From list nodes to a grown vector of 1 << 16 ints
+#define SUITE_BUCKETS                                                       \
+    alc::bucket_traits<1 << 16, 16>,  alc::bucket_traits<1 << 16, 32>,      \
+    alc::bucket_traits<1 << 16, 64>,  alc::bucket_traits<1 << 14, 128>,     \
+    alc::bucket_traits<1 << 12, 256>, alc::bucket_traits<1 << 8, 4096>,     \
+    alc::bucket_traits<1 << 4, 1 << 16>, alc::bucket_traits<4, 1 << 18>
+
+typedef rebind_source<alc::bucket_allocator<uint8_t, SUITE_BUCKETS>>            bucket_source;
+typedef rebind_source<alc::concurrent_bucket_allocator<uint8_t, SUITE_BUCKETS>> concurrent_source;
+// Fixed-size blocks only fit the node and object patterns
+typedef rebind_source<alc::block_allocator<uint8_t, 1 << 17, 64>>               block_source;
+typedef rebind_source<alc::atomic_block_allocator<uint8_t, 1 << 17, 64>>        atomic_block_source;
+
+//////// Patterns
+// run() goes over the pattern once for n elements
+
+// push_back into a vector, every growth allocates a bigger buffer and frees the old one
+struct vector_growth {
+    template <class Source>
+    static void run(Source& source, size_t n) {
+        std::vector<int, typename Source::template alloc<int>> vector(source.template get<int>());
+        for (size_t i = 0; i < n; i++)
+            vector.push_back(i);
+        benchmark::DoNotOptimize(vector.data());
+    }
+};
+
+// A queue in a list: a node is freed and another one allocated for every element
+struct list_churn {
+    template <class Source>
+    static void run(Source& source, size_t n) {
+        std::list<uint64_t, typename Source::template alloc<uint64_t>> list(source.template get<uint64_t>());
+        for (size_t i = 0; i < n/2; i++)
+            list.push_back(i);
+        for (size_t i = 0; i < n; i++) {
+            list.pop_front();
+            list.push_back(i);
+        }
+        benchmark::DoNotOptimize(list.back());
+    }
+};
+
+// Random inserts and erases, so nodes are freed all over the heap
+struct map_churn {
+    template <class Source>
+    static void run(Source& source, size_t n) {
+        typedef std::pair<const uint32_t, uint32_t> node;
+        std::map<uint32_t, uint32_t, std::less<uint32_t>, typename Source::template alloc<node>> map(source.template get<node>());
+        std::mt19937 rng(42);
+        for (size_t i = 0; i < n; i++) {
+            map.emplace(rng() % n, i);
+            map.erase(rng() % n);
+        }
+        benchmark::DoNotOptimize(map.size());
+    }
+};
+
+// Objects are freed in the reverse order, like scopes unwinding
+struct lifo_free {
+    template <class Source>
+    static void run(Source& source, size_t n) {
+        auto alloc = source.template get<std::array<uint8_t, 48>>();
+        std::vector<std::array<uint8_t, 48>*> ptrs(n);
+        for (size_t i = 0; i < n; i++) {
+            ptrs[i] = alloc.allocate(1);
+            // Written like a real object, so every page counts in RSS
+            ptrs[i]->fill(uint8_t(i));
+        }
+        for (size_t i = n; i > 0; i--)
+            alloc.deallocate(ptrs[i-1], 1);
+    }
+};
+
+// Objects are freed in a random order, the worst case for keeping memory compact
+struct random_free {
+    template <class Source>
+    static void run(Source& source, size_t n) {
+        auto alloc = source.template get<std::array<uint8_t, 48>>();
+        std::vector<std::array<uint8_t, 48>*> ptrs(n);
+        for (size_t i = 0; i < n; i++) {
+            ptrs[i] = alloc.allocate(1);
+            ptrs[i]->fill(uint8_t(i));
+        }
+        std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(42));
+        for (size_t i = 0; i < n; i++)
+            alloc.deallocate(ptrs[i], 1);
+    }
+};
+
+// One thread allocates messages, another one frees them
+struct producer_consumer {
+    typedef std::array<uint64_t, 6> message;
+
+    template <class Source>
+    static void run(Source& source, size_t n) {
+        // Single-producer single-consumer ring of messages
+        constexpr size_t ring_size = 1024;
+        std::vector<std::atomic<message*>> ring(ring_size);
+        for (std::atomic<message*>& slot : ring)
+            slot.store(nullptr, std::memory_order_relaxed);
+
+        auto alloc = source.template get<message>();
+        std::thread consumer([&ring, alloc, n]() mutable {
+            for (size_t i = 0; i < n; i++) {
+                std::atomic<message*>& slot = ring[i % ring_size];
+                message* m;
+                while ((m = slot.load(std::memory_order_acquire)) == nullptr)
+                    std::this_thread::yield();
+                slot.store(nullptr, std::memory_order_relaxed);
+                alloc.deallocate(m, 1);
+            }
+        });
+        for (size_t i = 0; i < n; i++) {
+            message* m = alloc.allocate(1);
+            (*m)[0] = i;
+            std::atomic<message*>& slot = ring[i % ring_size];
+            while (slot.load(std::memory_order_relaxed) != nullptr)
+                std::this_thread::yield();
+            slot.store(m, std::memory_order_release);
+        }
+        consumer.join();
+    }
+};
+
+//////// Measuring
+
+// Reads a "Key: value kB" line of /proc/self/status, in Bytes
+static size_t proc_status(const char* key) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    const size_t length = strlen(key);
+    while (std::getline(status, line)) {
+        if (line.compare(0, length, key) == 0 && line[length] == ':')
+            return std::stoull(line.substr(length+1))*1024;
+    }
+    return 0;
+}
+
+// Resets VmHWM to the current RSS, false if the kernel doesn't let us
+static bool reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+    clear_refs.close();
+    return !clear_refs.fail();
+}
+
+// Peak RSS growth of running the pattern once, measured in a fresh process (see main),
+// so memory that malloc kept from the previous benchmarks can't hide it
+typedef size_t (*rss_measure)(size_t n);
+
+static std::map<std::string, rss_measure>& rss_measures() {
+    static std::map<std::string, rss_measure> measures;
+    return measures;
+}
+
+template <class Pattern, class Source>
+struct measured {
+    static size_t peak_rss(size_t n) {
+        const size_t baseline = reset_peak_rss() ? proc_status("VmRSS") : proc_status("VmHWM");
+        {
+            Source source;
+            Pattern::run(source, n);
+        }
+        return proc_status("VmHWM") - baseline;
+    }
+
+    static std::string key() {
+        return typeid(measured).name();
+    }
+
+    static const bool registered;
+};
+
+template <class Pattern, class Source>
+const bool measured<Pattern, Source>::registered = (rss_measures()[key()] = peak_rss, true);
+
+// Runs the measure in a child process, 0 if that failed
+static size_t child_peak_rss(const std::string& key, size_t n) {
+    // popen runs a shell, so /proc/self/exe has to be resolved here
+    char exe[4096];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if (length <= 0)
+        return 0;
+    exe[length] = '\0';
+    std::string command = std::string(exe) + " --measure " + key + " " + std::to_string(n);
+    FILE* child = popen(command.c_str(), "r");
+    if (child == nullptr)
+        return 0;
+    size_t growth = 0;
+    if (fscanf(child, "%zu", &growth) != 1)
+        growth = 0;
+    pclose(child);
+    return growth;
+}
+
+template <class Pattern, class Source>
+static void BM_Pattern(benchmark::State& state) {
+    const size_t n = state.range(0);
+    (void)measured<Pattern, Source>::registered;
+
+    {
+        Source source;
+        for (auto _ : state)
+            Pattern::run(source, n);
+    }
+
+    // Live requested Bytes at the peak, the same for every allocator
+    live_bytes = 0;
+    peak_bytes = 0;
+    {
+        counting_source counting;
+        Pattern::run(counting, n);
+    }
+    const size_t requested = peak_bytes;
+    const size_t growth    = child_peak_rss(measured<Pattern, Source>::key(), n);
+
+    state.SetItemsProcessed(state.iterations()*n);
+    state.counters["time/op"] = benchmark::Counter(state.iterations()*n, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    if (growth != 0) {
+        state.counters["peak_rss"]      = benchmark::Counter(growth, benchmark::Counter::kDefaults, benchmark::Counter::kIs1024);
+        state.counters["fragmentation"] = std::max(0.0, 1.0 - (double)requested/growth);
+    }
+}
+
+#define SUITE_PATTERN(pattern, source, n) \
+    BENCHMARK_TEMPLATE(BM_Pattern, pattern, source)->Arg(n)->Unit(benchmark::kMicrosecond)
+
+// Every element count is big enough for the pattern to take a few MiB
+#define SUITE_SINGLE_THREADED(pattern, n)         \
+    SUITE_PATTERN(pattern, std_source, n);        \
+    SUITE_PATTERN(pattern, malloc_source, n);     \
+    SUITE_PATTERN(pattern, pool_source, n);       \
+    SUITE_PATTERN(pattern, bucket_source, n)
+
+SUITE_SINGLE_THREADED(vector_growth, 1 << 16);
+SUITE_SINGLE_THREADED(list_churn, 1 << 16);
+SUITE_PATTERN(list_churn, block_source, 1 << 16);
+SUITE_SINGLE_THREADED(map_churn, 1 << 16);
+SUITE_PATTERN(map_churn, block_source, 1 << 16);
+SUITE_SINGLE_THREADED(lifo_free, 1 << 16);
+SUITE_PATTERN(lifo_free, block_source, 1 << 16);
+SUITE_SINGLE_THREADED(random_free, 1 << 16);
+SUITE_PATTERN(random_free, block_source, 1 << 16);
+
+SUITE_PATTERN(producer_consumer, std_source, 1 << 16)->UseRealTime();
+SUITE_PATTERN(producer_consumer, malloc_source, 1 << 16)->UseRealTime();
+SUITE_PATTERN(producer_consumer, sync_pool_source, 1 << 16)->UseRealTime();
+SUITE_PATTERN(producer_consumer, concurrent_source, 1 << 16)->UseRealTime();
+SUITE_PATTERN(producer_consumer, atomic_block_source, 1 << 16)->UseRealTime();
+
+// suite --measure <key> <n> - prints the peak RSS growth of a single pattern run
+int main(int argc, char** argv) {
+    if (argc == 4 && std::string(argv[1]) == "--measure") {
+        auto found = rss_measures().find(argv[2]);
+        if (found == rss_measures().end())
+            return 1;
+        printf("%zu\n", found->second(std::stoull(argv[3])));
+        return 0;
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,3 @@
+clear
+g++ -O2 -DNDEBUG -o suite suite.cpp -std=c++17 -lbenchmark -lpthread && ./suite "$@"
+rm ./suite
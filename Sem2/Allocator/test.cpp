@@ -0,0 +1,829 @@
+#include <algorithm>
+#include <forward_list>
+#include <list>
+#include <map>
+#include <numeric>
+#include <unordered_map>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#define SEGALLOC_STATS 1
+#include "block_allocators.cpp"
+#include "concurrent_allocators.cpp"
+#include "memory_resources.cpp"
+#include "trace.cpp"
+#include "object_pool.cpp"
+
+TEST(BUCKET_MANAGER, FREELIST) {
+    uint64_t buffer[40];
+    alc::__bucket_manager<uint64_t> manager(buffer, 20, 2*sizeof(uint64_t));
+    ASSERT_TRUE(manager.freelist);
+
+    uint64_t* ptrs[20];
+    for (int i = 0; i < 20; i++)
+        ptrs[i] = manager.allocate(2);
+    for (int i = 0; i < 20; i++)
+        ASSERT_EQ(ptrs[i], buffer + 2*i);
+    ASSERT_THROW(manager.allocate(1), std::bad_alloc);
+
+    // Last freed is the first given out
+    manager.deallocate(ptrs[5], 2);
+    manager.deallocate(ptrs[7], 2);
+    ASSERT_EQ(manager.allocate(2), ptrs[7]);
+    ASSERT_EQ(manager.allocate(2), ptrs[5]);
+}
+
+#ifndef NDEBUG
+TEST(BUCKET_MANAGER, FREELIST_MISUSE) {
+    uint64_t buffer[8];
+    alc::__bucket_manager<uint64_t> manager(buffer, 4, 2*sizeof(uint64_t));
+    // Free-list mode without the table, like a build without SEGALLOC_DFREE_CHECK
+    free(manager.table);
+    manager.table = nullptr;
+
+    uint64_t* p = manager.allocate(2);
+    ASSERT_DEATH(manager.deallocate(p + 1, 2), "");
+    manager.deallocate(p, 2);
+    ASSERT_DEATH(manager.deallocate(p, 2), "");
+}
+#endif
+
+TEST(BUCKET_MANAGER, BITMAP) {
+    uint8_t buffer[13];
+    alc::__bucket_manager<uint8_t> manager(buffer, 13, 1);
+    ASSERT_FALSE(manager.freelist);
+
+    for (int i = 0; i < 13; i++)
+        ASSERT_EQ(manager.allocate(1), buffer + i);
+    ASSERT_THROW(manager.allocate(1), std::bad_alloc);
+
+    manager.deallocate(buffer + 9, 1);
+    manager.deallocate(buffer + 9, 1);
+    ASSERT_EQ(manager.available, 1);
+    ASSERT_EQ(manager.allocate(1), buffer + 9);
+}
+
+TEST(BUCKET_MANAGER, BATCH) {
+    // Free-list mode: the free-list first, then a contiguous run
+    uint64_t buffer[20];
+    alc::__bucket_manager<uint64_t> manager(buffer, 20, sizeof(uint64_t));
+    manager.allocate(1);
+    manager.allocate(1);
+    manager.deallocate(buffer, 1);
+
+    uint64_t* ptrs[20];
+    ASSERT_EQ(manager.allocate_batch(5, 1, ptrs), 5);
+    ASSERT_EQ(ptrs[0], buffer);
+    for (int i = 1; i < 5; i++)
+        ASSERT_EQ(ptrs[i], buffer + i+1);
+    ASSERT_EQ(manager.allocate_batch(20, 1, ptrs + 5), 14);
+    ASSERT_TRUE(manager.full());
+
+    // Double frees are skipped
+    uint64_t* twice[3] = {buffer + 3, buffer + 3, buffer + 7};
+    ASSERT_EQ(manager.deallocate_batch(twice, 3, 1), 2);
+    ASSERT_EQ(manager.available, 2);
+
+    // Bitmap mode: whole bytes, then single bits
+    uint8_t bytes[21];
+    alc::__bucket_manager<uint8_t> bitmap(bytes, 21, 1);
+    bitmap.allocate(1);
+    uint8_t* taken[21];
+    ASSERT_EQ(bitmap.allocate_batch(21, 1, taken), 20);
+    std::sort(taken, taken + 20);
+    for (int i = 0; i < 20; i++)
+        ASSERT_EQ(taken[i], bytes + i+1);
+    ASSERT_EQ(bitmap.deallocate_batch(taken, 20, 1), 20);
+    ASSERT_EQ(bitmap.available, 20);
+}
+
+TEST(BUCKET_ALLOCATOR, SIZE_CLASSES) {
+    typedef alc::__bucket_layout<
+        alc::bucket_traits<8, 4>,
+        alc::bucket_traits<2, 16>,
+        alc::bucket_traits<4, 1>,
+        alc::bucket_traits<3, 4>
+    > layout;
+    // Sorted at compile time, equal buckets keep their order
+    static_assert(layout::sorted.sizes[0] == 16 && layout::sorted.counts[0] == 2, "");
+    static_assert(layout::sorted.sizes[1] == 4  && layout::sorted.counts[1] == 8, "");
+    static_assert(layout::sorted.sizes[2] == 4  && layout::sorted.counts[2] == 3, "");
+    static_assert(layout::sorted.sizes[3] == 1  && layout::sorted.counts[3] == 4, "");
+
+    static_assert(layout::size_class(1)  == 3, "");
+    static_assert(layout::size_class(2)  == 2, "");
+    static_assert(layout::size_class(4)  == 2, "");
+    static_assert(layout::size_class(5)  == 0, "");
+    static_assert(layout::size_class(16) == 0, "");
+    static_assert(layout::size_class(17) == layout::npos, "");
+
+    // Full buckets fall back to the bigger ones
+    alc::bucket_allocator<int,
+        alc::bucket_traits<8, 4>,
+        alc::bucket_traits<2, 16>,
+        alc::bucket_traits<4, 1>,
+        alc::bucket_traits<3, 4>
+    > allocator;
+    for (int i = 0; i < 4+3+8+2; i++)
+        allocator.allocate(1);
+    ASSERT_THROW(allocator.allocate(1), std::bad_alloc);
+}
+
+TEST(BUCKET_ALLOCATOR, SHARED_ARENA) {
+    typedef alc::bucket_allocator<int,
+        alc::bucket_traits<1024, 16>,
+        alc::bucket_traits<16, 1024>
+    > allocator_t;
+    allocator_t allocator;
+
+    // Containers rebind the allocator to their nodes, but keep using the same buckets
+    std::list<int, allocator_t> list(allocator);
+    std::map<int, int, std::less<int>, allocator_t::rebind<std::pair<const int, int>>::other> map(allocator);
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, allocator_t::rebind<std::pair<const int, int>>::other> hashmap(allocator);
+    for (int i = 0; i < 100; i++) {
+        list.push_back(i);
+        map[i] = i;
+        hashmap[i] = i;
+    }
+    ASSERT_TRUE(list.get_allocator() == allocator);
+    ASSERT_TRUE(map.get_allocator() == allocator);
+    ASSERT_TRUE(hashmap.get_allocator() == allocator);
+    ASSERT_TRUE(allocator_t() != allocator);
+
+    // The nodes hold pointers, the 64-Byte blocks of ints are aligned enough for them
+    ASSERT_GE(allocator_t::block_align, alignof(void*));
+    for (const int& val : list)
+        ASSERT_EQ((uintptr_t)&val % alignof(int), 0);
+    for (const auto& kv : map)
+        ASSERT_EQ((uintptr_t)&kv % alignof(void*), 0);
+    for (const auto& kv : hashmap)
+        ASSERT_EQ((uintptr_t)&kv % alignof(void*), 0);
+    struct node {
+        node* prev;
+        node* next;
+        int   value;
+    };
+    allocator_t::rebind<node>::other nodes(allocator);
+    for (int i = 0; i < 20; i++)
+        ASSERT_EQ((uintptr_t)nodes.allocate(1) % alignof(node), 0);
+
+    // Rebinding to the same type, or there and back, gives the original type
+    typedef allocator_t::rebind<node>::other node_allocator_t;
+    ASSERT_TRUE((std::is_same<allocator_t::rebind<int>::other, allocator_t>::value));
+    ASSERT_TRUE((std::is_same<node_allocator_t::rebind<int>::other, allocator_t>::value));
+    ASSERT_TRUE((std::is_same<node_allocator_t::rebind<node>::other, node_allocator_t>::value));
+    ASSERT_TRUE((std::is_same<std::allocator_traits<allocator_t>::rebind_alloc<int>, allocator_t>::value));
+
+    // Copies share the buckets too
+    std::list<int, allocator_t> copy(list);
+    ASSERT_TRUE(copy.get_allocator() == list.get_allocator());
+    ASSERT_TRUE(std::equal(list.begin(), list.end(), copy.begin(), copy.end()));
+}
+
+TEST(BUCKET_ALLOCATOR, OVERFLOW) {
+    // Byte sizes of these requests wrap around to a few Bytes
+    const size_t huge = SIZE_MAX/8 + 2;
+    std::vector<uint64_t*> out(2);
+
+    alc::bucket_allocator<uint64_t, alc::bucket_traits<64, 16>> buckets;
+    ASSERT_THROW((void)buckets.allocate(huge), std::bad_alloc);
+    ASSERT_THROW(buckets.allocate_batch(2, huge, out.data()), std::bad_alloc);
+
+    alc::block_allocator<uint64_t, 64, 16> blocks;
+    ASSERT_THROW((void)blocks.allocate(huge), std::bad_alloc);
+    ASSERT_THROW(blocks.allocate_batch(2, huge, out.data()), std::bad_alloc);
+
+    alc::concurrent_bucket_allocator<uint64_t, alc::bucket_traits<64, 16>> concurrent;
+    ASSERT_THROW((void)concurrent.allocate(huge), std::bad_alloc);
+
+    alc::growth_policy policy;
+    policy.grow = true;
+    alc::monotonic_allocator<uint64_t, 1024> monotonic(policy);
+    ASSERT_THROW((void)monotonic.allocate(huge), std::bad_alloc);
+
+    ASSERT_EQ(buckets.stats()[0].in_use, 0);
+    ASSERT_EQ(blocks.stats()[0].in_use, 0);
+}
+
+TEST(BUCKET_ALLOCATOR, BATCH) {
+    alc::bucket_allocator<uint64_t,
+        alc::bucket_traits<8, 1>,
+        alc::bucket_traits<4, 2>
+    > allocator;
+
+    // 8 small blocks, then the big ones
+    uint64_t* ptrs[12];
+    allocator.allocate_batch(10, 1, ptrs);
+    std::sort(ptrs, ptrs + 10);
+    ASSERT_EQ(std::adjacent_find(ptrs, ptrs + 10), ptrs + 10);
+
+    // All or nothing
+    ASSERT_THROW(allocator.allocate_batch(3, 1, ptrs + 10), std::bad_alloc);
+    ASSERT_EQ(allocator.max_size(), 2);
+    allocator.allocate_batch(2, 2, ptrs + 10);
+    ASSERT_EQ(allocator.max_size(), 0);
+
+    allocator.deallocate_batch(ptrs, 12, 0);
+    ASSERT_EQ(allocator.max_size(), 2);
+    allocator.allocate_batch(12, 1, ptrs);
+
+    // Growing allocators chain slabs for the rest of the batch
+    alc::growth_policy policy;
+    policy.grow = true;
+    alc::block_allocator<uint64_t, 4, 2> growing(policy);
+    std::vector<uint64_t*> blocks(50);
+    growing.allocate_batch(50, 2, blocks.data());
+    std::sort(blocks.begin(), blocks.end());
+    ASSERT_EQ(std::adjacent_find(blocks.begin(), blocks.end()), blocks.end());
+    growing.deallocate_batch(blocks.data(), 50, 2);
+    ASSERT_EQ(growing.stats()[0].in_use, 0);
+}
+
+TEST(BLOCK_ALLOCATOR, SHARED_ARENA) {
+    typedef alc::block_allocator<int, 256, 16> allocator_t;
+    allocator_t allocator;
+
+    std::list<int, allocator_t> list(allocator);
+    std::map<int, int, std::less<int>, allocator_t::rebind<std::pair<const int, int>>::other> map(allocator);
+    for (int i = 0; i < 100; i++) {
+        list.push_back(i);
+        map[i] = i;
+    }
+    ASSERT_TRUE(map.get_allocator() == allocator);
+    // 200 of the 256 blocks are taken
+    ASSERT_THROW(for (int i = 0; i < 57; i++) list.push_back(i), std::bad_alloc);
+}
+
+TEST(BUCKET_ALLOCATOR, GROWTH) {
+    alc::growth_policy policy;
+    policy.grow       = true;
+    policy.hysteresis = 0;
+    alc::bucket_allocator<uint64_t,
+        alc::bucket_traits<4, 1>,
+        alc::bucket_traits<2, 4>
+    > allocator(policy);
+
+    // 4 + 2 blocks in the buffer, then slabs of 8 and 16 blocks for the small bucket
+    std::vector<uint64_t*> ptrs;
+    for (int i = 0; i < 4+2+8+16; i++)
+        ptrs.push_back(allocator.allocate(1));
+    for (uint64_t* p : ptrs)
+        *p = (uint64_t)p;
+    for (uint64_t* p : ptrs)
+        ASSERT_EQ(*p, (uint64_t)p);
+    ASSERT_EQ(allocator.max_size(), 4);
+
+    // Bigger than any bucket
+    ASSERT_THROW(allocator.allocate(5), std::bad_alloc);
+
+    for (uint64_t* p : ptrs)
+        allocator.deallocate(p, 1);
+    ptrs.clear();
+
+    // Default policy keeps the old behaviour
+    alc::bucket_allocator<uint64_t, alc::bucket_traits<4, 1>> fixed;
+    for (int i = 0; i < 4; i++)
+        fixed.allocate(1);
+    ASSERT_THROW(fixed.allocate(1), std::bad_alloc);
+}
+
+TEST(BUCKET_ALLOCATOR, ALIGNMENT) {
+    // Every small block gets a cache line of it's own, even with slabs
+    alc::growth_policy policy;
+    policy.grow = true;
+    alc::bucket_allocator<uint8_t,
+        alc::cache_line_bucket<4, 8>,
+        alc::bucket_traits<4, 3>
+    > lines(policy);
+    std::vector<uint8_t*> ptrs;
+    for (int i = 0; i < 20; i++)
+        ptrs.push_back(lines.allocate(8));
+    for (uint8_t* p : ptrs)
+        ASSERT_EQ((uintptr_t)p % alc::cache_line_size, 0);
+    std::sort(ptrs.begin(), ptrs.end());
+    for (size_t i = 1; i < ptrs.size(); i++)
+        ASSERT_GE(ptrs[i] - ptrs[i-1], alc::cache_line_size);
+
+    // Over-aligned types
+    struct alignas(256) wide {
+        char data[8];
+    };
+    alc::bucket_allocator<wide, alc::bucket_traits<4, 1>, alc::bucket_traits<2, 2>> buckets;
+    alc::block_allocator<wide, 4, 1> blocks;
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQ((uintptr_t)buckets.allocate(1) % alignof(wide), 0);
+        ASSERT_EQ((uintptr_t)blocks.allocate(1) % alignof(wide), 0);
+    }
+    ASSERT_EQ((uintptr_t)buckets.allocate(2) % alignof(wide), 0);
+}
+
+TEST(BUCKET_ALLOCATOR, ALIGNED_REBIND) {
+    struct alignas(16) node {
+        node* next;
+        int   value;
+    };
+
+    // 32- and 48-Byte blocks of ints keep 16-Byte alignment, so the node can share them
+    alc::growth_policy policy;
+    policy.grow = true;
+    typedef alc::bucket_allocator<int, alc::bucket_traits<8, 8>, alc::bucket_traits<4, 12>> allocator_t;
+    typedef allocator_t::rebind<node>::other node_allocator_t;
+    allocator_t allocator(policy);
+    node_allocator_t nodes(allocator);
+    ASSERT_TRUE(nodes == allocator);
+    ASSERT_EQ(node_allocator_t::block_align, 16);
+
+    // Both buckets, then the slabs
+    for (int i = 0; i < 40; i++) {
+        node* p = nodes.allocate(1 + i%3);
+        ASSERT_EQ((uintptr_t)p % alignof(node), 0);
+        p->value = i;
+    }
+
+    // 28-Byte blocks are only 4-aligned, rebinding to the node doesn't compile
+    typedef alc::bucket_allocator<int, alc::bucket_traits<8, 7>> odd_allocator_t;
+    ASSERT_EQ(odd_allocator_t::block_align, alignof(int));
+
+    // Rebound block_allocators know the Byte size of the blocks they share
+    // 32-Byte blocks of ints fit a list node with the node inside
+    typedef alc::block_allocator<int, 64, 8> block_allocator_t;
+    typedef block_allocator_t::rebind<node>::other block_node_allocator_t;
+    ASSERT_EQ(block_node_allocator_t::block_align, 32);
+    ASSERT_TRUE((std::is_same<block_node_allocator_t::rebind<int>::other, block_allocator_t>::value));
+    block_allocator_t blocks;
+    std::forward_list<node, block_node_allocator_t> list(blocks);
+    for (int i = 0; i < 20; i++)
+        list.push_front(node{nullptr, i});
+    for (const node& val : list)
+        ASSERT_EQ((uintptr_t)&val % alignof(node), 0);
+
+    // 20-Byte blocks of ints are only 4-aligned, rebinding to the node doesn't compile
+    ASSERT_EQ((alc::block_allocator<int, 64, 5>::rebind<char>::other::block_align), alignof(int));
+}
+
+TEST(BUCKET_ALLOCATOR, STATS) {
+    alc::bucket_allocator<uint8_t,
+        alc::bucket_traits<2, 16>,
+        alc::bucket_traits<4, 8>
+    > allocator;
+    uint8_t* small[4];
+    size_t   sizes[4] = {8, 6, 5, 8};
+    for (int i = 0; i < 4; i++)
+        small[i] = allocator.allocate(sizes[i]);
+    // Small bucket is full, falls back to the big one
+    allocator.allocate(3);
+    allocator.allocate(16);
+    ASSERT_THROW(allocator.allocate(16), std::bad_alloc);
+    allocator.deallocate(small[1], 6);
+
+    std::vector<alc::bucket_stats> stats = allocator.stats();
+    ASSERT_EQ(stats.size(), 2);
+
+    ASSERT_EQ(stats[0].block_size, 16);
+    ASSERT_EQ(stats[0].allocations, 2);
+    ASSERT_EQ(stats[0].requested_bytes, 3+16);
+    ASSERT_EQ(stats[0].failures, 1);
+    ASSERT_EQ(stats[0].in_use, 2);
+
+    ASSERT_EQ(stats[1].block_size, 8);
+    ASSERT_EQ(stats[1].allocations, 4);
+    ASSERT_EQ(stats[1].frees, 1);
+    ASSERT_EQ(stats[1].in_use, 3);
+    ASSERT_EQ(stats[1].high_water, 4);
+    ASSERT_EQ(stats[1].fallbacks, 1);
+    ASSERT_DOUBLE_EQ(stats[1].fragmentation(), 1.0 - 27.0/32.0);
+
+    std::string json = alc::stats_json(stats);
+    ASSERT_NE(json.find("\"block_size\": 16, \"block_count\": 2, \"in_use\": 2"), std::string::npos);
+    ASSERT_NE(json.find("\"fallbacks\": 1"), std::string::npos);
+}
+
+TEST(SLAB_CHAIN, EMPTY_COUNT) {
+    alc::growth_policy policy;
+    policy.hysteresis = 1;
+    alc::__slab_chain<alc::__bucket_manager<uint8_t>> chain;
+    uint8_t* p = chain.grow(4, 8, 8, alc::arena_backing());
+    chain.deallocate(p, 8, policy);
+    ASSERT_EQ(chain.empty, 1);
+
+    // A double free into the empty slab doesn't count it twice, so it's kept
+    chain.deallocate(p, 8, policy);
+    ASSERT_EQ(chain.empty, 1);
+    ASSERT_NE(chain.head, nullptr);
+    ASSERT_EQ(chain.allocate(8), p);
+    ASSERT_EQ(chain.empty, 0);
+}
+
+TEST(BLOCK_ALLOCATOR, GROWTH) {
+    alc::growth_policy policy;
+    policy.grow = true;
+    alc::block_allocator<uint64_t, 4, 2> allocator(policy);
+
+    std::vector<uint64_t*> ptrs;
+    for (int i = 0; i < 100; i++)
+        ptrs.push_back(allocator.allocate(2));
+    std::sort(ptrs.begin(), ptrs.end());
+    ASSERT_EQ(std::adjacent_find(ptrs.begin(), ptrs.end()), ptrs.end());
+    for (uint64_t* p : ptrs)
+        allocator.deallocate(p, 2);
+}
+
+TEST(MONOTONIC_ALLOCATOR, RESET) {
+    alc::monotonic_allocator<uint8_t, 256> bytes;
+    uint8_t* first = bytes.allocate(1);
+    // Rebinds share the arena and keep their alignment
+    alc::monotonic_allocator<uint64_t, 256> words(bytes);
+    uint64_t* word = words.allocate(2);
+    ASSERT_EQ((uintptr_t)word % alignof(uint64_t), 0);
+    ASSERT_EQ((uint8_t*)word, first + alignof(uint64_t));
+    words.deallocate(word, 2);
+    ASSERT_EQ(words.allocate(1), word + 2);
+    ASSERT_THROW(words.allocate(32), std::bad_alloc);
+
+    bytes.reset();
+    ASSERT_EQ(bytes.allocate(1), first);
+
+    // A whole phase in one arena
+    alc::growth_policy policy;
+    policy.grow = true;
+    alc::monotonic_allocator<int, 1024> allocator(policy);
+    for (int phase = 0; phase < 3; phase++) {
+        {
+            std::list<int, alc::monotonic_allocator<int, 1024>> list(allocator);
+            std::vector<int, alc::monotonic_allocator<int, 1024>> vector(allocator);
+            for (int i = 0; i < 1000; i++) {
+                list.push_back(i);
+                vector.push_back(i);
+            }
+            ASSERT_EQ(std::accumulate(list.begin(), list.end(), 0), 999*1000/2);
+            ASSERT_EQ(std::accumulate(vector.begin(), vector.end(), 0), 999*1000/2);
+        }
+        allocator.reset();
+    }
+}
+
+TEST(OBJECT_POOL, HANDLES) {
+    alc::object_pool<std::string> pool(100);
+    std::vector<alc::object_pool<std::string>::handle> handles;
+    for (int i = 0; i < 100; i++)
+        handles.push_back(pool.emplace(std::to_string(i)));
+    ASSERT_THROW(pool.emplace("full"), std::bad_alloc);
+    ASSERT_EQ(*pool.get(handles[42]), "42");
+
+    // Stale handles stop working, even once the block is reused
+    pool.destroy(handles[42]);
+    ASSERT_EQ(pool.get(handles[42]), nullptr);
+    alc::object_pool<std::string>::handle reused = pool.emplace("reused");
+    ASSERT_EQ(reused.index(), handles[42].index());
+    ASSERT_NE(reused, handles[42]);
+    ASSERT_EQ(pool.get(handles[42]), nullptr);
+    pool.destroy(handles[42]);
+    ASSERT_EQ(*pool.get(reused), "reused");
+    ASSERT_EQ(pool.get(alc::object_pool<std::string>::handle()), nullptr);
+
+    // Iteration goes over the live objects in block order
+    // handles[42] is stale, so "reused" stays
+    for (int i = 0; i < 100; i += 2)
+        pool.destroy(handles[i]);
+    ASSERT_EQ(pool.size(), 51);
+    size_t visited = 0;
+    for (auto it = pool.begin(); it != pool.end(); ++it, ++visited)
+        ASSERT_EQ(pool.get(it.get_handle()), &*it);
+    ASSERT_EQ(visited, 51);
+    ASSERT_EQ(*pool.begin(), "1");
+
+    // A block that ran out of generations is retired, so they don't wrap around
+    // 4 bits of generation: the block can hold 15 objects, one after another
+    typedef alc::object_pool<int, 28> small_pool_t;
+    small_pool_t small(1);
+    const small_pool_t::handle stale = small.emplace(-1);
+    small.destroy(stale);
+    for (int i = 1; i < 15; i++) {
+        small_pool_t::handle h = small.emplace(i);
+        ASSERT_EQ(h.index(), stale.index());
+        ASSERT_EQ(h.generation(), i);
+        ASSERT_EQ(small.get(stale), nullptr);
+        small.destroy(h);
+    }
+    ASSERT_THROW(small.emplace(15), std::bad_alloc);
+    ASSERT_EQ(small.get(stale), nullptr);
+    ASSERT_TRUE(small.empty());
+}
+
+TEST(ARENA_BACKING, MAPPED) {
+    alc::arena_backing backing;
+    backing.source    = alc::arena_backing::mapped;
+    backing.hugepages = true;
+    backing.populate  = true;
+
+    alc::bucket_allocator<uint64_t,
+        alc::bucket_traits<1024, 1>,
+        alc::bucket_traits<1024, 8>
+    > allocator(backing);
+    std::list<uint64_t, decltype(allocator)> list(allocator);
+    for (int i = 0; i < 1000; i++)
+        list.push_back(i);
+    ASSERT_EQ(std::accumulate(list.begin(), list.end(), 0), 999*1000/2);
+
+    // Slabs come from the same source
+    alc::growth_policy policy;
+    policy.grow = true;
+    alc::block_allocator<uint64_t, 16, 1> block(policy, backing);
+    std::vector<uint64_t*> ptrs;
+    for (int i = 0; i < 100; i++)
+        *ptrs.emplace_back(block.allocate(1)) = i;
+    for (int i = 0; i < 100; i++)
+        ASSERT_EQ(*ptrs[i], i);
+}
+
+TEST(ALLOCATION_TRACE, REPLAY) {
+    auto trace = std::make_shared<alc::allocation_trace>();
+    {
+        typedef alc::traced_allocator<std::allocator<int>> traced;
+        std::list<int, traced> list{traced(trace)};
+        for (int i = 0; i < 100; i++)
+            list.push_back(i);
+        for (int i = 0; i < 50; i++)
+            list.pop_front();
+        std::vector<int, traced> vector(10, 0, traced(trace));
+    }
+    std::vector<alc::trace_event> events = trace->events();
+
+    const std::string path = "/tmp/segalloc_test.trace";
+    ASSERT_TRUE(alc::allocation_trace::save(path, events));
+    std::vector<alc::trace_event> loaded;
+    ASSERT_TRUE(alc::allocation_trace::load(path, loaded));
+    remove(path.c_str());
+    ASSERT_EQ(loaded.size(), events.size());
+    ASSERT_EQ(memcmp(loaded.data(), events.data(), events.size()*sizeof(alc::trace_event)), 0);
+
+    // 100 list nodes + 1 vector buffer, every one freed
+    ASSERT_EQ(std::count_if(events.begin(), events.end(), [](const alc::trace_event& e) { return e.is_free(); }), 101);
+
+    // Counts fitted to the peaks never run out
+    alc::bucket_config config = alc::fit_bucket_counts(events, {64});
+    ASSERT_EQ(config.size(), 1);
+    ASSERT_EQ(config[0].count, 100);
+    ASSERT_EQ(alc::replay_trace(events, config).failures, 0);
+
+    config[0].count = 90;
+    ASSERT_EQ(alc::replay_trace(events, config).failures, 10);
+
+    // The buffer size is the one the arena really maps, aligned buckets included
+    const alc::growth_policy policy;
+    const alc::arena_backing backing;
+    alc::__bucket_arena<alc::__byte_bucket<3, 64, 256>, alc::__byte_bucket<100, 8>> arena(policy, backing);
+    ASSERT_EQ(alc::bucket_config_bytes({{3, 64, 256}, {100, 8}}), arena.data_size);
+    // 128-Byte pages for the unaligned ones
+    ASSERT_EQ(alc::bucket_config_bytes({{3, 64}, {100, 8}}), 2*128 + 7*128);
+
+    // Sizes of 4 GiB and more are kept as they are
+    const size_t huge = (size_t(5) << 30) + 3;
+    int block;
+    trace->record_allocate(&block, huge);
+    trace->record_deallocate(&block, huge);
+    events = trace->events();
+    ASSERT_EQ(events[events.size()-2].size, huge);
+    ASSERT_EQ(events.back().size, huge);
+    ASSERT_EQ(alc::replay_trace(events, config).failures, 11);
+}
+
+TEST(ATOMIC_BUCKET_MANAGER, EXHAUSTION) {
+    uint64_t buffer[130];
+    alc::__atomic_bucket_manager<uint64_t> manager(buffer, 130, sizeof(uint64_t));
+
+    for (int i = 0; i < 130; i++)
+        ASSERT_EQ(manager.allocate(1), buffer + i);
+    ASSERT_TRUE(manager.full());
+    ASSERT_THROW(manager.allocate(1), std::bad_alloc);
+
+    // Double free is ignored
+    manager.deallocate(buffer + 100, 1);
+    manager.deallocate(buffer + 100, 1);
+    ASSERT_EQ(manager.available, 1);
+    ASSERT_EQ(manager.allocate(1), buffer + 100);
+
+    // An allocation that got between a free's bit and it's counter
+    manager.available.fetch_sub(1);
+    ASSERT_EQ(manager.available, size_t(-1));
+    ASSERT_TRUE(manager.full());
+    ASSERT_EQ(manager.max_size(), 0);
+    ASSERT_EQ(manager.stats().in_use, 130);
+}
+
+TEST(ATOMIC_BUCKET_MANAGER, BATCH) {
+    uint64_t buffer[130];
+    alc::__atomic_bucket_manager<uint64_t> manager(buffer, 130, sizeof(uint64_t));
+
+    uint64_t* ptrs[130];
+    ASSERT_EQ(manager.allocate_batch(70, 1, ptrs), 70);
+    for (int i = 0; i < 70; i++)
+        ASSERT_EQ(ptrs[i], buffer + i);
+    ASSERT_EQ(manager.allocate_batch(100, 1, ptrs + 70), 60);
+    ASSERT_TRUE(manager.full());
+
+    ASSERT_EQ(manager.deallocate_batch(ptrs, 130, 1), 130);
+    ASSERT_EQ(manager.available, 130);
+}
+
+TEST(ATOMIC_BUCKET_MANAGER, STRESS) {
+    const size_t threads_count = 8;
+    const size_t per_thread    = 500;
+    const size_t rounds        = 200;
+    // Slightly less blocks than all threads could hold at once, so allocations fail sometimes
+    alc::atomic_block_allocator<uint64_t, threads_count*per_thread - 100, 2> allocator;
+
+    std::atomic<size_t> failures(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threads_count; t++) {
+        threads.emplace_back([&allocator, &failures, t] {
+            std::vector<uint64_t*> ptrs;
+            for (size_t r = 0; r < rounds; r++) {
+                for (size_t i = 0; i < per_thread; i++) {
+                    try {
+                        uint64_t* p = allocator.allocate(2);
+                        p[0] = p[1] = t;
+                        ptrs.push_back(p);
+                    } catch (std::bad_alloc&) {
+                        ++failures;
+                    }
+                }
+                // Nobody else should have been given our blocks
+                for (uint64_t* p : ptrs) {
+                    if (p[0] != t || p[1] != t)
+                        ++failures;
+                    allocator.deallocate(p, 2);
+                }
+                ptrs.clear();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // Every block should be available again
+    std::vector<uint64_t*> ptrs;
+    for (size_t i = 0; i < threads_count*per_thread - 100; i++)
+        ptrs.push_back(allocator.allocate(2));
+    ASSERT_THROW(allocator.allocate(2), std::bad_alloc);
+    std::sort(ptrs.begin(), ptrs.end());
+    ASSERT_EQ(std::adjacent_find(ptrs.begin(), ptrs.end()), ptrs.end());
+}
+
+TEST(CONCURRENT_BUCKET_ALLOCATOR, STRESS) {
+    typedef alc::concurrent_bucket_allocator<uint64_t,
+        alc::bucket_traits<4096, 1>,
+        alc::bucket_traits<4096, 4>
+    > allocator_t;
+    allocator_t allocator;
+
+    std::atomic<size_t> corrupted(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 8; t++) {
+        threads.emplace_back([allocator, &corrupted, t]() mutable {
+            std::vector<uint64_t*> ptrs;
+            for (size_t r = 0; r < 500; r++) {
+                for (size_t i = 0; i < 50; i++) {
+                    uint64_t* p = allocator.allocate(1 + i%4);
+                    std::fill(p, p + 1 + i%4, t);
+                    ptrs.push_back(p);
+                }
+                for (size_t i = 0; i < ptrs.size(); i++) {
+                    corrupted += std::count(ptrs[i], ptrs[i] + 1 + i%4, t) != ptrdiff_t(1 + i%4);
+                    allocator.deallocate(ptrs[i], 1 + i%4);
+                }
+                ptrs.clear();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    ASSERT_EQ(corrupted, 0);
+
+    // Magazines of the finished threads went back to the buckets
+    for (const alc::bucket_stats& bucket : allocator.stats())
+        ASSERT_EQ(bucket.in_use, 0);
+}
+
+TEST(CONCURRENT_BUCKET_ALLOCATOR, SHARED_ARENA) {
+    typedef alc::concurrent_bucket_allocator<int,
+        alc::bucket_traits<1024, 16>,
+        alc::bucket_traits<16, 1024>
+    > allocator_t;
+    typedef allocator_t::rebind<std::pair<const int, int>>::other map_allocator_t;
+    ASSERT_TRUE((std::is_same<allocator_t::rebind<int>::other, allocator_t>::value));
+    ASSERT_TRUE((std::is_same<map_allocator_t::rebind<int>::other, allocator_t>::value));
+    allocator_t allocator;
+
+    // Node containers convert the allocator to their node types and back, every rebind shares the state
+    std::list<int, allocator_t> list(allocator);
+    std::map<int, int, std::less<int>, map_allocator_t> map(allocator);
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, map_allocator_t> hashmap(allocator);
+    for (int i = 0; i < 100; i++) {
+        list.push_back(i);
+        map[i] = i;
+        hashmap[i] = i;
+    }
+    ASSERT_TRUE(list.get_allocator() == allocator);
+    ASSERT_TRUE(map.get_allocator() == allocator);
+    ASSERT_TRUE(hashmap.get_allocator() == allocator);
+    ASSERT_TRUE(allocator_t(map.get_allocator()) == allocator);
+    ASSERT_TRUE(allocator_t() != allocator);
+    ASSERT_EQ(std::accumulate(list.begin(), list.end(), 0), 99*100/2);
+
+    std::thread worker([&] {
+        std::list<int, allocator_t> local(list.begin(), list.end(), allocator);
+        ASSERT_TRUE(std::equal(list.begin(), list.end(), local.begin(), local.end()));
+    });
+    worker.join();
+}
+
+TEST(CONCURRENT_BUCKET_ALLOCATOR, GROWTH) {
+    typedef alc::concurrent_bucket_allocator<uint64_t,
+        alc::bucket_traits<16, 1>,
+        alc::bucket_traits<16, 4>
+    > allocator_t;
+    alc::growth_policy policy;
+    policy.grow = true;
+    allocator_t allocator(policy);
+
+    // Every thread needs many times more blocks than the buckets have, the rest comes from the slabs
+    std::atomic<size_t> corrupted(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++) {
+        threads.emplace_back([allocator, &corrupted, t]() mutable {
+            std::vector<uint64_t*> ptrs;
+            for (size_t r = 0; r < 50; r++) {
+                for (size_t i = 0; i < 200; i++) {
+                    uint64_t* p = allocator.allocate(1 + 3*(i%2));
+                    std::fill(p, p + 1 + 3*(i%2), t);
+                    ptrs.push_back(p);
+                }
+                for (size_t i = 0; i < ptrs.size(); i++) {
+                    corrupted += std::count(ptrs[i], ptrs[i] + 1 + 3*(i%2), t) != ptrdiff_t(1 + 3*(i%2));
+                    allocator.deallocate(ptrs[i], 1 + 3*(i%2));
+                }
+                ptrs.clear();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    ASSERT_EQ(corrupted, 0);
+
+    // Slab blocks cached by the magazines went back to their slabs too
+    std::vector<alc::bucket_stats> stats = allocator.stats();
+    ASSERT_EQ(stats.size(), 2);
+    for (const alc::bucket_stats& bucket : stats) {
+        ASSERT_GT(bucket.block_count, 16);
+        ASSERT_EQ(bucket.in_use, 0);
+    }
+}
+
+TEST(MEMORY_RESOURCE, PMR_CONTAINERS) {
+    alc::unsynchronized_bucket_resource<
+        alc::bucket_traits<256, 32>,
+        alc::bucket_traits<16, 1024>
+    > resource;
+
+    std::pmr::list<int>   list(&resource);
+    std::pmr::vector<int> vector(&resource);
+    for (int i = 0; i < 100; i++) {
+        list.push_back(i);
+        vector.push_back(i);
+    }
+    ASSERT_TRUE(std::equal(list.begin(), list.end(), vector.begin(), vector.end()));
+    // Every node is taken from the resource, so it runs out eventually
+    ASSERT_THROW(while (true) list.push_back(0), std::bad_alloc);
+}
+
+TEST(MEMORY_RESOURCE, ALIGNMENT) {
+    // 24-Byte blocks are 8-aligned, 32-Byte ones are 32-aligned as far as the buffer allows
+    typedef alc::unsynchronized_bucket_resource<
+        alc::bucket_traits<64, 24>,
+        alc::bucket_traits<64, 32>
+    > resource_t;
+    ASSERT_EQ(resource_t::max_alignment, 8);
+    resource_t resource;
+
+    // The answer only depends on the alignment, whichever block would come back
+    for (int i = 0; i < 100; i++) {
+        void* p = resource.allocate(1 + i%32, 8);
+        ASSERT_EQ((uintptr_t)p % 8, 0);
+        ASSERT_THROW((void)resource.allocate(1 + i%32, 16), std::bad_alloc);
+        resource.deallocate(p, 1 + i%32, 8);
+    }
+
+    typedef alc::unsynchronized_block_resource<16, 48>                        block_resource_t;
+    typedef alc::synchronized_bucket_resource<alc::bucket_traits<4, 4096>>   page_resource_t;
+    ASSERT_EQ(block_resource_t::max_alignment, 16);
+    ASSERT_EQ(page_resource_t::max_alignment, alignof(std::max_align_t));
+    alc::unsynchronized_bucket_resource<alc::bucket_traits<4, 4096, 4096>> pages;
+    ASSERT_EQ((uintptr_t)pages.allocate(100, 4096) % 4096, 0);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
\ No newline at end of file
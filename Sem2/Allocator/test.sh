@@ -0,0 +1,3 @@
+clear
+g++ -o test test.cpp -std=c++17 -lgtest -lpthread && ./test
+rm ./test
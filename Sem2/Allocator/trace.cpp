@@ -0,0 +1,322 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "block_allocators.cpp"
+
+namespace alc {
+
+// A single allocate or deallocate, as recorded by allocation_trace
+struct trace_event {
+    constexpr static uint32_t free_flag = 1;
+
+    // Nanoseconds since the start of the recording
+    uint64_t time;
+    // Byte size of the request
+    uint64_t size;
+    // Number of the allocation
+    uint32_t id;
+    // free_flag for a deallocate
+    uint32_t flags;
+
+    bool is_free() const noexcept {
+        return flags & free_flag;
+    }
+
+    uint32_t allocation() const noexcept {
+        return id;
+    }
+};
+static_assert(sizeof(trace_event) == 24, "trace_event is written to the file as is");
+
+// Records every allocate and deallocate of a running workload
+// Lifetimes come out of the events: a deallocate has the number of it's allocation
+// File format: "SEGTRAC2", uint64_t event count, the events in native byte order
+class allocation_trace {
+    typedef std::chrono::steady_clock clock;
+
+    std::mutex                           lock;
+    clock::time_point                    start;
+    std::vector<trace_event>             log;
+    // Allocation number of every live pointer
+    std::unordered_map<const void*, uint32_t> live;
+    uint32_t                             next_id = 0;
+
+    uint64_t now() const noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+public:
+    allocation_trace(): start(clock::now()) {}
+
+    allocation_trace(const allocation_trace&) = delete;
+    allocation_trace& operator= (const allocation_trace&) = delete;
+
+    // Throws std::length_error once the allocation numbers ran out, instead of reusing them
+    void record_allocate(const void* p, size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (next_id == UINT32_MAX)
+            throw std::length_error("allocation_trace: too many allocations");
+        live[p] = next_id;
+        log.push_back({now(), bytes, next_id++, 0});
+    }
+
+    // Pointers that weren't recorded are ignored
+    void record_deallocate(const void* p, size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = live.find(p);
+        if (found == live.end())
+            return;
+        log.push_back({now(), bytes, found->second, trace_event::free_flag});
+        live.erase(found);
+    }
+
+    // Copy of the events recorded so far
+    std::vector<trace_event> events() {
+        std::lock_guard<std::mutex> guard(lock);
+        return log;
+    }
+
+    bool save(const std::string& path) {
+        return save(path, events());
+    }
+
+    static bool save(const std::string& path, const std::vector<trace_event>& events) {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        uint64_t count = events.size();
+        bool ok = fwrite("SEGTRAC2", 1, 8, file) == 8
+               && fwrite(&count, sizeof(count), 1, file) == 1
+               && fwrite(events.data(), sizeof(trace_event), count, file) == count;
+        return (fclose(file) == 0) && ok;
+    }
+
+    static bool load(const std::string& path, std::vector<trace_event>& events) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr)
+            return false;
+        char     magic[8];
+        uint64_t count = 0;
+        bool ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, "SEGTRAC2", 8) == 0
+               && fread(&count, sizeof(count), 1, file) == 1;
+        if (ok) {
+            events.resize(count);
+            ok = fread(events.data(), sizeof(trace_event), count, file) == count;
+        }
+        fclose(file);
+        return ok;
+    }
+};
+
+// Allocator adapter that records everything going through Alloc into an allocation_trace
+// Copies and rebinds record into the same trace
+template <class Alloc>
+class traced_allocator {
+    template <class> friend class traced_allocator;
+    typedef std::allocator_traits<Alloc> traits;
+
+    Alloc                             inner;
+    std::shared_ptr<allocation_trace> trace;
+
+//////// TYPEDEFS
+public:
+    typedef typename traits::value_type      value_type;
+    typedef typename traits::pointer         pointer;
+    typedef typename traits::const_pointer   const_pointer;
+    typedef value_type&                      reference;
+    typedef const value_type&                const_reference;
+    typedef typename traits::size_type       size_type;
+    typedef typename traits::difference_type difference_type;
+
+    typedef std::true_type                   propagate_on_container_copy_assignment;
+    typedef std::true_type                   propagate_on_container_move_assignment;
+    typedef std::true_type                   propagate_on_container_swap;
+    typedef std::false_type                  is_always_equal;
+
+    template <class U>
+    struct rebind {
+        typedef traced_allocator<typename traits::template rebind_alloc<U>> other;
+    };
+
+    //////// INIT / DEINIT
+
+    explicit traced_allocator(const std::shared_ptr<allocation_trace>& to, const Alloc& alloc = Alloc()):
+        inner(alloc), trace(to) {}
+
+    template <class Other>
+    traced_allocator(const traced_allocator<Other>& other): inner(other.inner), trace(other.trace) {}
+
+    //////// ALLOCATION
+
+    pointer allocate(size_type n) {
+        pointer p = inner.allocate(n);
+        trace->record_allocate(p, n*sizeof(value_type));
+        return p;
+    }
+
+    void deallocate(pointer p, size_type n) {
+        trace->record_deallocate(p, n*sizeof(value_type));
+        inner.deallocate(p, n);
+    }
+
+    size_type max_size() const {
+        return traits::max_size(inner);
+    }
+
+    const std::shared_ptr<allocation_trace>& get_trace() const noexcept {
+        return trace;
+    }
+
+    //////// OPERATORS
+
+    template <class Other>
+    bool operator== (const traced_allocator<Other>& r) const noexcept {
+        return inner == r.inner && trace == r.trace;
+    }
+
+    template <class Other>
+    bool operator!= (const traced_allocator<Other>& r) const noexcept {
+        return !(*this==r);
+    }
+};
+
+// Run-time version of bucket_traits, in Bytes
+struct bucket_spec {
+    size_t count;
+    size_t size;
+    size_t align = 1;
+};
+
+typedef std::vector<bucket_spec> bucket_config;
+
+// What bucket_allocator's buffer would take for the config, the same as __bucket_arena maps
+inline size_t bucket_config_bytes(const bucket_config& config) {
+    std::vector<size_t> bucket_bytes;
+    size_t max_align = 1;
+    for (const bucket_spec& b : config) {
+        bucket_bytes.push_back(b.count*b.size);
+        max_align = std::max(max_align, b.align);
+    }
+    const unsigned page_shift = __bucket_page_shift(bucket_bytes.data(), bucket_bytes.size(), max_align);
+    return __bucket_buffer_size(bucket_bytes.data(), bucket_bytes.size(), page_shift);
+}
+
+struct replay_result {
+    // Allocations that bucket_allocator would answer with std::bad_alloc
+    size_t failures    = 0;
+    // Most block Bytes given out at once
+    size_t peak_bytes  = 0;
+    // Size of the buffer, see bucket_config_bytes
+    size_t arena_bytes = 0;
+    size_t events      = 0;
+    double seconds     = 0;
+
+    double events_per_second() const noexcept {
+        return (seconds == 0) ? 0.0 : events/seconds;
+    }
+};
+
+// Replays a trace on bucket managers laid out like bucket_allocator's:
+// the closest bucket first, then the bigger ones
+inline replay_result replay_trace(const std::vector<trace_event>& events, bucket_config config) {
+    typedef __bucket_manager<uint8_t> manager;
+
+    std::stable_sort(config.begin(), config.end(), [](const bucket_spec& l, const bucket_spec& r) {
+        return l.size > r.size;
+    });
+    size_t total = 0;
+    for (const bucket_spec& b : config)
+        total += b.count*b.size;
+
+    uint8_t* data = (uint8_t*)malloc(std::max<size_t>(total, 1));
+    std::vector<manager> managers;
+    managers.reserve(config.size());
+    for (size_t i = 0, offset = 0; i < config.size(); offset += config[i].count*config[i].size, i++)
+        managers.emplace_back(data + offset, config[i].count, config[i].size);
+
+    // Block and bucket of every allocation, nullptr if it failed
+    std::vector<std::pair<uint8_t*, int>> blocks;
+    replay_result result;
+    result.events      = events.size();
+    result.arena_bytes = bucket_config_bytes(config);
+    size_t in_use = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (const trace_event& e : events) {
+        if (e.is_free()) {
+            if (e.allocation() >= blocks.size() || blocks[e.allocation()].first == nullptr)
+                continue;
+            int bucket = blocks[e.allocation()].second;
+            managers[bucket].deallocate(blocks[e.allocation()].first, e.size);
+            in_use -= managers[bucket].block_size;
+            continue;
+        }
+
+        if (blocks.size() <= e.allocation())
+            blocks.resize(e.allocation()+1, {nullptr, -1});
+        int bucket = (int)managers.size()-1;
+        while (bucket >= 0 && (managers[bucket].block_size < e.size || managers[bucket].full()))
+            --bucket;
+        if (bucket < 0) {
+            ++result.failures;
+            continue;
+        }
+        blocks[e.allocation()] = {managers[bucket].allocate(std::max<size_t>(e.size, 1)), bucket};
+        in_use += managers[bucket].block_size;
+        result.peak_bytes = std::max(result.peak_bytes, in_use);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    managers.clear();
+    free(data);
+    return result;
+}
+
+// Fits counts to a set of block sizes: every size class gets as many blocks
+// as the trace ever had live in it, so the replay never runs out
+inline bucket_config fit_bucket_counts(const std::vector<trace_event>& events, std::vector<size_t> sizes) {
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    std::vector<size_t> live(sizes.size(), 0), peak(sizes.size(), 0);
+    // Size class of every allocation
+    std::vector<size_t> classes;
+    for (const trace_event& e : events) {
+        if (e.is_free()) {
+            if (e.allocation() < classes.size())
+                --live[classes[e.allocation()]];
+            continue;
+        }
+        size_t cls = std::lower_bound(sizes.begin(), sizes.end(), e.size) - sizes.begin();
+        // A request bigger than every size
+        if (cls == sizes.size())
+            return {};
+        if (classes.size() <= e.allocation())
+            classes.resize(e.allocation()+1);
+        classes[e.allocation()] = cls;
+        peak[cls] = std::max(peak[cls], ++live[cls]);
+    }
+
+    bucket_config config;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (peak[i] != 0)
+            config.push_back({peak[i], sizes[i]});
+    }
+    return config;
+}
+
+// Declaration of a bucket_allocator<uint8_t, ...> with the config
+inline std::string bucket_config_string(const bucket_config& config) {
+    std::string result = "alc::bucket_allocator<uint8_t";
+    for (const bucket_spec& b : config)
+        result += ",\n    alc::bucket_traits<" + std::to_string(b.count) + ", " + std::to_string(b.size)
+                + ((b.align != 1) ? ", " + std::to_string(b.align) : std::string()) + ">";
+    return result + "\n>";
+}
+
+}
@@ -0,0 +1,204 @@
+#include <array>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "trace.cpp"
+
+// Picks bucket_traits for a bucket_allocator out of an allocation trace
+// tune <trace>           - replays the trace against candidate configs and prints the best one
+// tune --record <trace>  - records a sample workload (std::map, std::list and std::vector churn)
+
+//////// Candidate block sizes
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to-1)/to*to;
+}
+
+static size_t next_pow2(size_t n) {
+    size_t p = 8;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+// 4 classes per power of two, like most size-class mallocs
+static size_t next_quarter_pow2(size_t n) {
+    if (n <= 16)
+        return round_up(std::max<size_t>(n, 1), 8);
+    size_t p = 16;
+    while (p*2 < n)
+        p <<= 1;
+    return round_up(n, p/4);
+}
+
+struct candidate {
+    const char* name;
+    size_t    (*size_class)(size_t);
+};
+
+static const candidate candidates[] = {
+    {"exact",        [](size_t n) { return std::max<size_t>(n, 1); }},
+    {"align 8",      [](size_t n) { return round_up(std::max<size_t>(n, 1), 8); }},
+    {"align 16",     [](size_t n) { return round_up(std::max<size_t>(n, 1), 16); }},
+    {"align 64",     [](size_t n) { return round_up(std::max<size_t>(n, 1), 64); }},
+    {"quarter pow2", next_quarter_pow2},
+    {"pow2",         next_pow2},
+};
+
+// bucket_allocator can only index that many buckets
+constexpr size_t max_buckets = 65535;
+
+//////// Replay through malloc, as a baseline
+
+static double replay_malloc(const std::vector<alc::trace_event>& events) {
+    std::vector<void*> blocks;
+    auto begin = std::chrono::steady_clock::now();
+    for (const alc::trace_event& e : events) {
+        if (e.is_free()) {
+            if (e.allocation() < blocks.size()) {
+                free(blocks[e.allocation()]);
+                blocks[e.allocation()] = nullptr;
+            }
+            continue;
+        }
+        if (blocks.size() <= e.allocation())
+            blocks.resize(e.allocation()+1, nullptr);
+        blocks[e.allocation()] = malloc(std::max<size_t>(e.size, 1));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    // Whatever the trace never freed
+    for (void* p : blocks)
+        free(p);
+    return seconds;
+}
+
+//////// Sample workload
+
+static int record(const char* path) {
+    auto trace = std::make_shared<alc::allocation_trace>();
+    std::mt19937 rng(42);
+    {
+        typedef alc::traced_allocator<std::allocator<std::pair<const int, uint64_t>>> map_alloc;
+        typedef alc::traced_allocator<std::allocator<std::array<char, 40>>>           list_alloc;
+        typedef alc::traced_allocator<std::allocator<int>>                            vector_alloc;
+
+        std::map<int, uint64_t, std::less<int>, map_alloc> map{map_alloc(trace)};
+        std::list<std::array<char, 40>, list_alloc>        list{list_alloc(trace)};
+        for (int round = 0; round < 1000; round++) {
+            std::vector<int, vector_alloc> scratch{vector_alloc(trace)};
+            for (int i = 0; i < 64; i++) {
+                scratch.push_back(i);
+                map[rng() % 4096] = i;
+                list.emplace_back();
+            }
+            for (int i = 0; i < 48; i++) {
+                map.erase(rng() % 4096);
+                list.pop_front();
+            }
+        }
+    }
+
+    std::vector<alc::trace_event> events = trace->events();
+    if (!alc::allocation_trace::save(path, events)) {
+        fprintf(stderr, "can't write %s\n", path);
+        return 1;
+    }
+    printf("recorded %zu events into %s\n", events.size(), path);
+    return 0;
+}
+
+//////// Tuning
+
+static void print_summary(const std::vector<alc::trace_event>& events) {
+    // Lifetime in nanoseconds, live bytes at the peak
+    std::vector<uint64_t> start;
+    std::vector<uint64_t> size;
+    size_t allocations = 0, frees = 0, live = 0, peak = 0;
+    double lifetime = 0;
+    for (const alc::trace_event& e : events) {
+        if (e.is_free()) {
+            if (e.allocation() >= start.size())
+                continue;
+            ++frees;
+            lifetime += e.time - start[e.allocation()];
+            live     -= size[e.allocation()];
+            continue;
+        }
+        if (start.size() <= e.allocation()) {
+            start.resize(e.allocation()+1);
+            size.resize(e.allocation()+1);
+        }
+        start[e.allocation()] = e.time;
+        size[e.allocation()]  = e.size;
+        ++allocations;
+        live += e.size;
+        peak  = std::max(peak, live);
+    }
+    printf("events:          %zu\n", events.size());
+    printf("allocations:     %zu (%zu freed)\n", allocations, frees);
+    printf("peak live bytes: %zu\n", peak);
+    printf("mean lifetime:   %.0f ns\n\n", (frees == 0) ? 0.0 : lifetime/frees);
+}
+
+static int tune(const char* path) {
+    std::vector<alc::trace_event> events;
+    if (!alc::allocation_trace::load(path, events)) {
+        fprintf(stderr, "can't read %s\n", path);
+        return 1;
+    }
+    print_summary(events);
+
+    std::vector<size_t> sizes;
+    for (const alc::trace_event& e : events) {
+        if (!e.is_free())
+            sizes.push_back(e.size);
+    }
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    const double malloc_seconds = replay_malloc(events);
+    printf("%-14s %8s %12s %12s %9s %12s\n", "candidate", "buckets", "arena bytes", "peak bytes", "bad_alloc", "Mevents/s");
+    printf("%-14s %8s %12s %12s %9s %12.1f\n", "malloc", "-", "-", "-", "-", events.size()/malloc_seconds/1e6);
+
+    const candidate*     best = nullptr;
+    alc::bucket_config   best_config;
+    alc::replay_result   best_result;
+    for (const candidate& c : candidates) {
+        std::vector<size_t> classes;
+        for (size_t s : sizes)
+            classes.push_back(c.size_class(s));
+        alc::bucket_config config = alc::fit_bucket_counts(events, classes);
+        if (config.empty() || config.size() > max_buckets)
+            continue;
+
+        // The first replay pays for the page faults of the buffer
+        alc::replay_trace(events, config);
+        alc::replay_result result = alc::replay_trace(events, config);
+        printf("%-14s %8zu %12zu %12zu %9zu %12.1f\n", c.name, config.size(), result.arena_bytes,
+               result.peak_bytes, result.failures, result.events_per_second()/1e6);
+        if (result.failures == 0 && (best == nullptr || result.arena_bytes < best_result.arena_bytes)) {
+            best        = &c;
+            best_config = config;
+            best_result = result;
+        }
+    }
+
+    if (best == nullptr) {
+        printf("\nno candidate replays without bad_alloc\n");
+        return 1;
+    }
+    printf("\nbest: %s, %zu bytes\n%s\n", best->name, best_result.arena_bytes, alc::bucket_config_string(best_config).c_str());
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && std::string(argv[1]) == "--record")
+        return record(argv[2]);
+    if (argc == 2)
+        return tune(argv[1]);
+    fprintf(stderr, "usage: %s <trace> | --record <trace>\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,3 @@
+clear
+g++ -O2 -DNDEBUG -o tune tune.cpp -std=c++17 && ./tune "$@"
+rm ./tune
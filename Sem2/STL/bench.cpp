@@ -0,0 +1,507 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <numeric>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchmark/benchmark.h"
+
+#include "circular_buffer.cpp"
+#include "concurrent_buffers.cpp"
+#include "mirrored_allocator.cpp"
+#include "circular_buffer_io.cpp"
+#include "stl_algorithms.cpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef stl::circular_buffer<uint64_t, stl::cb_exact_capacity> exact_buffer;
+typedef stl::circular_buffer<uint64_t, stl::cb_pow2_capacity>  pow2_buffer;
+
+//////// circular_buffer: exact capacity vs power of two
+
+// Queue that goes around the buffer, every element is pushed to the back and popped from the front
+template <class Buffer>
+static void BM_PushPop(benchmark::State& state) {
+    Buffer buffer(1024);
+    for (uint64_t i = 0; i < 512; i++)
+        buffer.push_back(i);
+
+    uint64_t i = 0;
+    for (auto _ : state) {
+        for (int j = 0; j < 1024; j++) {
+            buffer.write_back(i++);
+            benchmark::DoNotOptimize(buffer.front());
+            buffer.pop_front();
+        }
+    }
+    state.SetItemsProcessed(state.iterations()*1024);
+}
+BENCHMARK_TEMPLATE(BM_PushPop, exact_buffer);
+BENCHMARK_TEMPLATE(BM_PushPop, pow2_buffer);
+
+// Reads at random indices of a full buffer that wraps around
+template <class Buffer>
+static void BM_RandomAccess(benchmark::State& state) {
+    Buffer buffer(1024);
+    for (uint64_t i = 0; i < 1024 + 300; i++)
+        buffer.write_back(i);
+    std::vector<uint32_t> indices(4096);
+    std::mt19937 rng(42);
+    for (uint32_t& ind : indices)
+        ind = rng() % 1024;
+
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        for (uint32_t ind : indices)
+            sum += buffer[ind];
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations()*indices.size());
+}
+BENCHMARK_TEMPLATE(BM_RandomAccess, exact_buffer);
+BENCHMARK_TEMPLATE(BM_RandomAccess, pow2_buffer);
+
+// Iterator arithmetic: every element is read as begin()[i]
+template <class Buffer>
+static void BM_IteratorIndex(benchmark::State& state) {
+    Buffer buffer(1024);
+    for (uint64_t i = 0; i < 1024 + 300; i++)
+        buffer.write_back(i);
+
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        auto it = buffer.begin();
+        for (size_t i = 0; i < 1024; i++)
+            sum += it[i];
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations()*1024);
+}
+BENCHMARK_TEMPLATE(BM_IteratorIndex, exact_buffer);
+BENCHMARK_TEMPLATE(BM_IteratorIndex, pow2_buffer);
+
+//////// circular_buffer vs std::deque: whole-range algorithms
+
+// Both hold the same 4096 elements, the buffer's wrap around the end
+template <class Container>
+static Container filled() {
+    Container container;
+    if constexpr (std::is_same<Container, exact_buffer>::value) {
+        container.set_capacity(4096);
+        for (uint64_t i = 0; i < 4096 + 1000; i++)
+            container.write_back(i);
+    } else {
+        for (uint64_t i = 1000; i < 4096 + 1000; i++)
+            container.push_back(i);
+    }
+    return container;
+}
+
+// std::accumulate through the iterators, or over the pieces of a segmented range
+template <class Container, bool Segmented>
+static void BM_Sum(benchmark::State& state) {
+    const Container container = filled<Container>();
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        if constexpr (Segmented) {
+            stl::for_each_segment(container.begin(), container.end(), [&](auto begin, auto end) {
+                sum = std::accumulate(begin, end, sum);
+            });
+        } else {
+            sum = std::accumulate(container.begin(), container.end(), sum);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations()*container.size());
+}
+BENCHMARK_TEMPLATE(BM_Sum, std::deque<uint64_t>, false);
+BENCHMARK_TEMPLATE(BM_Sum, exact_buffer, false);
+BENCHMARK_TEMPLATE(BM_Sum, exact_buffer, true);
+
+// stl::find_not that has to go through the whole range, segmented for the buffer
+template <class Container>
+static void BM_FindNot(benchmark::State& state) {
+    Container container = filled<Container>();
+    const typename Container::value_type seven = 7;
+    std::fill(container.begin(), container.end(), seven);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(stl::find_not(container.begin(), container.end(), seven));
+    state.SetItemsProcessed(state.iterations()*container.size());
+}
+BENCHMARK_TEMPLATE(BM_FindNot, std::deque<uint64_t>);
+BENCHMARK_TEMPLATE(BM_FindNot, exact_buffer);
+
+// std::sort of shuffled elements through the random access iterators
+template <class Container>
+static void BM_Sort(benchmark::State& state) {
+    Container container = filled<Container>();
+    std::mt19937 gen(42);
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::shuffle(container.begin(), container.end(), gen);
+        state.ResumeTiming();
+        std::sort(container.begin(), container.end());
+    }
+    state.SetItemsProcessed(state.iterations()*container.size());
+}
+BENCHMARK_TEMPLATE(BM_Sort, std::deque<uint64_t>);
+BENCHMARK_TEMPLATE(BM_Sort, exact_buffer);
+
+//////// circular_buffer: copies of elements
+
+// Heap allocations of the strings, every copy of a long string is one
+static size_t string_allocations = 0;
+
+template <class T>
+struct counted_allocator: std::allocator<T> {
+    template <class U>
+    struct rebind {
+        typedef counted_allocator<U> other;
+    };
+
+    counted_allocator() = default;
+    template <class U>
+    counted_allocator(const counted_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        ++string_allocations;
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+typedef std::basic_string<char, std::char_traits<char>, counted_allocator<char>> counted_string;
+
+// Pushes 1024 long strings into a buffer that grows from nothing
+// Every way makes one string per element, anything above one allocation per element is a copy
+// range(0): 0 - push_back of a copy, 1 - push_back of a moved string, 2 - emplace_back
+static void BM_PushStrings(benchmark::State& state) {
+    const counted_string source(64, 'x');
+    string_allocations = 0;
+    for (auto _ : state) {
+        stl::circular_buffer<counted_string> buffer;
+        for (int i = 0; i < 1024; i++) {
+            if (state.range(0) == 0) {
+                buffer.push_back(source);
+            } else if (state.range(0) == 1) {
+                counted_string val(64, 'x');
+                buffer.push_back(std::move(val));
+            } else {
+                buffer.emplace_back(64, 'x');
+            }
+        }
+        benchmark::DoNotOptimize(buffer.back());
+    }
+    state.SetItemsProcessed(state.iterations()*1024);
+    state.counters["allocs/element"] = (double)string_allocations/(state.iterations()*1024);
+}
+BENCHMARK(BM_PushStrings)->ArgName("copy/move/emplace")->DenseRange(0, 2);
+
+//////// circular_buffer: bulk copies
+
+// Log ingestion: 4 KiB chunks go in and out of a 64 KiB byte ring, so every few chunks wrap around
+// range(0): 0 - element at a time, 1 - push_back(first, last) and pop_front_into, 2 - write_back(data, count)
+static void BM_Ingest(benchmark::State& state) {
+    const size_t chunk = 4096;
+    stl::circular_buffer<uint8_t> buffer(1 << 16);
+    std::vector<uint8_t> in(chunk, 'x'), out(chunk);
+    // Never aligned with the end of the buffer
+    for (int i = 0; i < 1000; i++)
+        buffer.push_back('x');
+
+    for (auto _ : state) {
+        if (state.range(0) == 0) {
+            for (uint8_t byte : in)
+                buffer.push_back(byte);
+            for (size_t i = 0; i < chunk; i++) {
+                out[i] = buffer.front();
+                buffer.pop_front();
+            }
+        } else {
+            if (state.range(0) == 1)
+                buffer.push_back(in.data(), in.data() + chunk);
+            else
+                buffer.write_back(in.data(), chunk);
+            buffer.pop_front_into(out.data(), chunk);
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations()*chunk);
+}
+BENCHMARK(BM_Ingest)->ArgName("element/range/write")->DenseRange(0, 2);
+
+//////// circular_buffer: heap vs mirrored memory
+
+typedef stl::circular_buffer<char>                                                     heap_ring;
+typedef stl::circular_buffer<char, stl::cb_exact_capacity, stl::mirrored_allocator<char>> mirrored_ring;
+
+// A parser that needs the data in one piece: 3000 Bytes of lines come in,
+// the whole window is scanned for line ends through linearize() and consumed
+template <class Ring>
+static void BM_Parse(benchmark::State& state) {
+    Ring ring(1 << 16);
+    std::string chunk;
+    while (chunk.size() < 3000)
+        chunk += "key=value" + std::to_string(chunk.size()) + "\n";
+
+    for (auto _ : state) {
+        ring.write_back(chunk.data(), chunk.size());
+        const char* data = ring.linearize();
+        benchmark::DoNotOptimize(std::count(data, data + ring.size(), '\n'));
+        ring.pop_front_into(chunk.data(), ring.size());
+    }
+    state.SetBytesProcessed(state.iterations()*chunk.size());
+}
+BENCHMARK_TEMPLATE(BM_Parse, heap_ring);
+BENCHMARK_TEMPLATE(BM_Parse, mirrored_ring);
+
+//////// circular_buffer: staging for file descriptors
+
+enum drain_method { through_iterator, through_writev };
+
+// The ring stages 4 KiB of bytes for a file: they're written to /dev/null
+// through a copy out with the iterators, or straight from the ring's pieces with writev
+template <drain_method Method>
+static void BM_Drain(benchmark::State& state) {
+    const int fd = ::open("/dev/null", O_WRONLY);
+    stl::circular_buffer<char> ring(10000);
+    std::array<char, 4096> chunk, staging;
+    chunk.fill('x');
+
+    for (auto _ : state) {
+        ring.write_back(chunk.data(), chunk.size());
+        if constexpr (Method == through_iterator) {
+            std::copy(ring.begin(), ring.end(), staging.begin());
+            benchmark::DoNotOptimize(::write(fd, staging.data(), ring.size()));
+            ring.pop_front(ring.size());
+        } else {
+            benchmark::DoNotOptimize(stl::cb_write(fd, ring));
+        }
+    }
+    state.SetBytesProcessed(state.iterations()*chunk.size());
+    ::close(fd);
+}
+BENCHMARK_TEMPLATE(BM_Drain, through_iterator);
+BENCHMARK_TEMPLATE(BM_Drain, through_writev);
+
+// stl::circular_buffer behind a mutex, the usual way to hand it to another thread
+template <class T>
+class locked_circular_buffer {
+    std::mutex             lock;
+    stl::circular_buffer<T> buffer;
+
+public:
+    explicit locked_circular_buffer(size_t capacity): buffer(capacity) {}
+
+    bool try_push(const T& val) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (buffer.full())
+            return false;
+        buffer.write_back(val);
+        return true;
+    }
+
+    bool try_pop(T& val) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (buffer.empty())
+            return false;
+        val = buffer.front();
+        buffer.pop_front();
+        return true;
+    }
+
+    template <class InputIterator>
+    size_t try_push(InputIterator first, InputIterator last) {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t count = 0;
+        for (; first != last && !buffer.full(); ++first, ++count)
+            buffer.write_back(*first);
+        return count;
+    }
+
+    template <class OutputIterator>
+    size_t try_pop(OutputIterator out, size_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t count = 0;
+        for (; count < n && !buffer.empty(); ++count, ++out) {
+            *out = buffer.front();
+            buffer.pop_front();
+        }
+        return count;
+    }
+};
+
+typedef stl::spsc_circular_buffer<uint64_t> spsc_buffer;
+typedef stl::mpmc_circular_buffer<uint64_t> mpmc_buffer;
+typedef locked_circular_buffer<uint64_t>    locked_buffer;
+
+// Waiting threads give the core away, the box may have less cores than threads
+static void backoff() {
+    std::this_thread::yield();
+}
+
+//////// SPSC: lock-free vs mutex
+
+// A producer thread hands 1 << 16 elements over to the consumer, range(0) elements at a time
+template <class Queue>
+static void BM_Throughput(benchmark::State& state) {
+    const size_t count = 1 << 16;
+    const size_t batch = state.range(0);
+    Queue queue(1024);
+    std::vector<uint64_t> out(batch);
+
+    for (auto _ : state) {
+        std::thread producer([&] {
+            std::vector<uint64_t> in(batch);
+            for (size_t sent = 0; sent < count;) {
+                size_t pushed;
+                if (batch == 1) {
+                    pushed = queue.try_push(uint64_t(sent));
+                } else {
+                    for (size_t i = 0; i < batch; i++)
+                        in[i] = sent + i;
+                    pushed = queue.try_push(in.begin(), in.begin() + std::min(batch, count - sent));
+                }
+                if (pushed == 0)
+                    backoff();
+                sent += pushed;
+            }
+        });
+
+        uint64_t sum = 0;
+        for (size_t received = 0; received < count;) {
+            size_t popped;
+            if (batch == 1)
+                popped = queue.try_pop(out[0]);
+            else
+                popped = queue.try_pop(out.begin(), batch);
+            if (popped == 0)
+                backoff();
+            for (size_t i = 0; i < popped; i++)
+                sum += out[i];
+            received += popped;
+        }
+        producer.join();
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations()*count);
+}
+BENCHMARK_TEMPLATE(BM_Throughput, spsc_buffer)->ArgName("batch")->Arg(1)->Arg(64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Throughput, locked_buffer)->ArgName("batch")->Arg(1)->Arg(64)->UseRealTime();
+
+// Round trip of a single element: sent to an echo thread and back
+template <class Queue>
+static void BM_PingPong(benchmark::State& state) {
+    Queue ping(64), pong(64);
+    std::atomic<bool> done(false);
+    std::thread echo([&] {
+        uint64_t val;
+        while (!done.load(std::memory_order_relaxed)) {
+            if (!ping.try_pop(val)) {
+                backoff();
+                continue;
+            }
+            while (!pong.try_push(val))
+                backoff();
+        }
+    });
+
+    uint64_t val = 0;
+    for (auto _ : state) {
+        while (!ping.try_push(val))
+            backoff();
+        while (!pong.try_pop(val))
+            backoff();
+        ++val;
+    }
+    done = true;
+    echo.join();
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_PingPong, spsc_buffer)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_PingPong, locked_buffer)->UseRealTime();
+
+//////// MPMC: fan-in and fan-out
+
+// Spinning on try_push/try_pop, like the SPSC benchmarks
+struct spinning {
+    template <class Queue>
+    static void push(Queue& queue, uint64_t val) {
+        while (!queue.try_push(val))
+            backoff();
+    }
+
+    template <class Queue>
+    static uint64_t pop(Queue& queue) {
+        uint64_t val;
+        while (!queue.try_pop(val))
+            backoff();
+        return val;
+    }
+};
+
+// The blocking calls of mpmc_circular_buffer: spin, then sleep
+struct blocking {
+    template <class Queue>
+    static void push(Queue& queue, uint64_t val) {
+        queue.push(val);
+    }
+
+    template <class Queue>
+    static uint64_t pop(Queue& queue) {
+        return queue.pop();
+    }
+};
+
+// range(0) producers hand 1 << 16 elements over to range(1) consumers
+template <class Queue, class Wait>
+static void BM_FanInOut(benchmark::State& state) {
+    const size_t count     = 1 << 16;
+    const size_t producers = state.range(0);
+    const size_t consumers = state.range(1);
+    Queue queue(1024);
+
+    for (auto _ : state) {
+        std::atomic<size_t> sent(0), received(0);
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; p++) {
+            threads.emplace_back([&] {
+                for (size_t i; (i = sent.fetch_add(1, std::memory_order_relaxed)) < count;)
+                    Wait::push(queue, i);
+            });
+        }
+        for (size_t c = 0; c < consumers; c++) {
+            threads.emplace_back([&] {
+                uint64_t sum = 0;
+                while (received.fetch_add(1, std::memory_order_relaxed) < count)
+                    sum += Wait::pop(queue);
+                benchmark::DoNotOptimize(sum);
+            });
+        }
+        for (std::thread& t : threads)
+            t.join();
+    }
+    state.SetItemsProcessed(state.iterations()*count);
+}
+
+// Up to a thread per core: same amount of producers and consumers,
+// then all of the cores but one pushing into a single consumer and the other way around
+static void fan_args(benchmark::internal::Benchmark* b) {
+    const int64_t cores = std::max(2u, std::thread::hardware_concurrency());
+    b->ArgNames({"producers", "consumers"});
+    for (int64_t n = 1; n <= cores/2; n *= 2)
+        b->Args({n, n});
+    if (cores > 2) {
+        b->Args({cores-1, 1});
+        b->Args({1, cores-1});
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_FanInOut, mpmc_buffer, spinning)->Apply(fan_args)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FanInOut, mpmc_buffer, blocking)->Apply(fan_args)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_FanInOut, locked_buffer, spinning)->Apply(fan_args)->UseRealTime();
+
+BENCHMARK_MAIN();
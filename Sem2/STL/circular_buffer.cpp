@@ -1,7 +1,12 @@
+#pragma once
 #include <iterator>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 #include <memory>
+#include <type_traits>
+#include <utility>
+#include "segmented.cpp"
 
 #define CIRCULAR_BUFFER_DEBUG 1
 
@@ -14,143 +19,402 @@ namespace stl {
 namespace cb_meta {
     template <class Alloc>
     struct cb_nonconst_traits {
-        typedef typename Alloc::value_type      value_type;
-        typedef typename Alloc::size_type       size_type;
-        typedef typename Alloc::pointer         pointer;
-        typedef value_type&                     reference;
-        typedef typename Alloc::difference_type difference_type;
+        typedef std::allocator_traits<Alloc>    traits;
+        typedef typename traits::value_type      value_type;
+        typedef typename traits::size_type       size_type;
+        typedef typename traits::pointer         pointer;
+        typedef value_type&                      reference;
+        typedef typename traits::difference_type difference_type;
     };
 
     template <class Alloc>
     struct cb_const_traits {
-        typedef typename Alloc::value_type      value_type;
-        typedef typename Alloc::size_type       size_type;
-        typedef typename Alloc::const_pointer   pointer;
-        typedef const    value_type&            reference;
-        typedef typename Alloc::difference_type difference_type;
+        typedef std::allocator_traits<Alloc>    traits;
+        typedef typename traits::value_type      value_type;
+        typedef typename traits::size_type       size_type;
+        typedef typename traits::const_pointer   pointer;
+        typedef const    value_type&             reference;
+        typedef typename traits::difference_type difference_type;
     };
+
+    // Only lets iterators through, so that push_back(first, last) doesn't catch push_back(count, value)-like calls
+    template <class Iterator>
+    using if_iterator = typename std::iterator_traits<Iterator>::iterator_category;
+
+    // Ranges that can be copied into the buffer with memcpy: pointers to trivially copyable T
+    template <class Iterator, class T>
+    constexpr bool is_memcpy_range = std::is_pointer<Iterator>::value
+        && std::is_same<typename std::remove_cv<typename std::remove_pointer<Iterator>::type>::type, T>::value
+        && std::is_trivially_copyable<T>::value;
+
+    // Allocators whose memory past the end mirrors the start, like stl::mirrored_allocator
+    template <class Alloc, class = void>
+    struct is_mirrored: std::false_type {};
+
+    template <class Alloc>
+    struct is_mirrored<Alloc, std::void_t<typename Alloc::is_mirrored>>: Alloc::is_mirrored {};
+};
+
+//////// CAPACITY POLICIES
+// Decide what capacity the buffer really gets and how positions map to slots
+// A position is the front's position plus the index of an element
+
+// Keeps the capacity that was asked for
+// The front's position stays within [0, capacity), so a position is always
+// less than 2*capacity and wraps around with a compare
+struct cb_exact_capacity {
+    typedef std::size_t size_type;
+
+    static constexpr size_type round(const size_type sz) noexcept {
+        return sz;
+    }
+
+    // Slot of a position in [0, 2*capacity)
+    static constexpr size_type slot(const size_type pos, const size_type cap) noexcept {
+        return (pos >= cap) ? (pos - cap) : pos;
+    }
+
+    // The front's position after it moved to pos
+    static constexpr size_type wrap(const size_type pos, const size_type cap) noexcept {
+        return slot(pos, cap);
+    }
 };
 
-template <class T>
+// Rounds the capacity up to a power of two
+// The front's position runs freely and every position is masked into a slot,
+// so wrapping around is a single AND, without a branch
+struct cb_pow2_capacity {
+    typedef std::size_t size_type;
+
+    static constexpr size_type round(const size_type sz) noexcept {
+        size_type cap = (sz == 0) ? 0 : 1;
+        while (cap < sz)
+            cap <<= 1;
+        return cap;
+    }
+
+    static constexpr size_type slot(const size_type pos, const size_type cap) noexcept {
+        return pos & (cap-1);
+    }
+
+    static constexpr size_type wrap(const size_type pos, const size_type) noexcept {
+        return pos;
+    }
+};
+
+// The storage comes from Alloc, through std::allocator_traits, so a buffer can live
+// in an alc::block_allocator, a std::pmr resource or any other arena
+// With a mirrored allocator the buffer is mapped twice in a row, so the elements
+// always lie in one piece, and so does any other window that wraps around
+template <class T, class Capacity = cb_exact_capacity, class Alloc = std::allocator<T>>
 class circular_buffer {
 public:
-    typedef T                                   value_type;
-    typedef std::allocator<value_type>          alloc_type;
-    typedef typename alloc_type::size_type      size_type;
-    typedef typename alloc_type::pointer        pointer;
-    typedef typename alloc_type::const_pointer  const_pointer;
-    typedef value_type&                         reference;
-    typedef const value_type&                   const_reference;
+    typedef T                                        value_type;
+    typedef Alloc                                    alloc_type;
+    typedef Alloc                                    allocator_type;
+    typedef std::allocator_traits<alloc_type>        alloc_traits;
+    typedef typename alloc_traits::size_type         size_type;
+    typedef typename alloc_traits::difference_type   difference_type;
+    typedef typename alloc_traits::pointer           pointer;
+    typedef typename alloc_traits::const_pointer     const_pointer;
+    typedef value_type&                              reference;
+    typedef const value_type&                        const_reference;
+    typedef Capacity                                 capacity_policy;
+
+    // Whether b_buf[i + capacity()] is b_buf[i]
+    static constexpr bool mirrored = cb_meta::is_mirrored<alloc_type>::value;
+
+    static_assert(std::is_same<typename alloc_traits::value_type, value_type>::value, "the allocator has to allocate T");
 
 private:
+    // Where the internal buffer comes from
+    alloc_type b_alloc;
     // The start of the internal buffer
-    pointer b_begin;
-    // The one-past-end address for the end of the internal buffer
-    // i.e. the first address after the end of the buffer
-    pointer b_end;
-    // The leftmost element in the buffer (i.e. points to the last written)
-    // So, for example, if we want to write to front, we need to decrement it first,
-    // or else we'll overwrite the last written value
-    pointer b_left;
-    // The one-past-end address for the rightmost element in the internal buffer
-    // Basically, it is always at the next cell we'll be interacting with
-    // So, for example, when we want to write to the back, we just write to that address
-    pointer b_right;
+    pointer b_buf;
     // The size of the internal buffer
+    size_type b_cap;
+    // The position of the leftmost element in the buffer
+    // To write to the front, it's moved one slot back first
+    // Stays within [0, b_cap) or runs freely, see the capacity policies
+    size_type b_head;
+    // The amount of elements in the buffer
+    // The element past the rightmost one is at b_head + b_size, that's where writes to the back go
     size_type b_size;
 
-    //////// POINTER ARITHMETIC
+    //////// POSITION ARITHMETIC
 
-    // Inccrements the pointer within the boundaries of CB
-    pointer incptr(pointer& p) const noexcept {
-        if (++p == b_end)
-            p = b_begin;
-        return p;
+    // Slot of the element that is ind elements away from the leftmost one
+    size_type slot(const size_type ind) const noexcept {
+        return Capacity::slot(b_head + ind, b_cap);
     }
 
-    // Decrements the pointer within the boundaries of CB
-    pointer decptr(pointer& p) const noexcept {
-        if (p == b_begin)
-            p = b_end;
-        return --p;
+    pointer elem(const size_type ind) const noexcept {
+        return b_buf + slot(ind);
     }
 
-    // Offsets the pointer within the boundaries of CB
-    pointer addptr(pointer& p, const size_type ofs) const noexcept {
-        return p + (
-            (p + ofs >= b_end)
-            ? (ofs - b_end + b_begin)
-            : (ofs)
-        );
+    // Moves the front forward by one element
+    void inchead() noexcept {
+        b_head = Capacity::wrap(b_head + 1, b_cap);
     }
 
-    // Offsets the pointer within the boundaries of CB
-    pointer subptr(pointer p, const size_type ofs) const noexcept {
-        return p - (
-            (p - ofs < b_begin)
-            ? (ofs - b_begin + b_end)
-            : (ofs)
-        );
+    // Moves the front back by one element
+    void dechead() noexcept {
+        b_head = Capacity::wrap(b_head + b_cap - 1, b_cap);
     }
 
     //////// INTERNAL MEMORY MANAGEMENT
 
+    // Constructs an element in a free slot
+    template <class... Args>
+    void constructptr(pointer ptr, Args&&... args) {
+        alloc_traits::construct(b_alloc, std::addressof(*ptr), std::forward<Args>(args)...);
+    }
+
     void deleteptr(pointer ptr) {
-        ptr->~value_type();
+        alloc_traits::destroy(b_alloc, std::addressof(*ptr));
+    }
+
+    pointer allocate_buf(const size_type sz) {
+        return (sz == 0) ? pointer() : alloc_traits::allocate(b_alloc, sz);
     }
 
-    void moveptr(pointer from, pointer to) {
-        *to = *std::move(from);
+    void deallocate_buf() {
+        if (b_buf != pointer())
+            alloc_traits::deallocate(b_alloc, b_buf, b_cap);
+    }
+
+    // Capacity for at least sz elements, the policy's and the allocator's both
+    static size_type fit_capacity(const size_type sz) {
+        size_type cap = Capacity::round(sz);
+        if constexpr (mirrored) {
+            while (cap != alloc_type::round(cap))
+                cap = Capacity::round(alloc_type::round(cap));
+        }
+        return cap;
+    }
+
+    // How many of count slots that start at the slot from go before the end of the buffer
+    // A mirrored buffer goes on past it's end, so it's all of them
+    size_type first_segment(const size_type from, const size_type count) const noexcept {
+        if constexpr (mirrored)
+            return count;
+        return (count < b_cap - from) ? count : (b_cap - from);
+    }
+
+    // Calls f(pointer, count) for the up to two contiguous pieces of count slots
+    // that start at the slot from: up to the end of the buffer, then from it's start
+    // A mirrored buffer goes on past it's end, so there's always one piece
+    template <class F>
+    void for_segments(const size_type from, const size_type count, F f) const {
+        const size_type first = first_segment(from, count);
+        if (first != 0)
+            f(b_buf + from, first);
+        if (first < count)
+            f(b_buf, count - first);
+    }
+
+    // Makes room for n more elements, growing at least twice
+    void reserve_back(const size_type n) {
+        if (b_size + n <= b_cap)
+            return;
+        reallocate_buf(fit_capacity((b_size + n > b_size*2) ? (b_size + n) : (b_size*2)));
+    }
+
+    // Moves the elements into newbuff, starting at the slot to, and destroys the originals
+    // Trivially copyable elements are copied in at most two memcpys, the rest are
+    // moved, or copied if their move may throw, so that a throw leaves the buffer as it was
+    void relocate(pointer newbuff, const size_type to) {
+        if (empty())
+            return;
+        if constexpr (std::is_trivially_copyable<value_type>::value) {
+            pointer dst = newbuff + to;
+            for_segments(slot(0), b_size, [&](pointer src, const size_type count) {
+                memcpy(std::addressof(*dst), std::addressof(*src), count*sizeof(value_type));
+                dst += count;
+            });
+        } else {
+            size_type i = 0;
+            try {
+                for (; i < b_size; i++)
+                    constructptr(newbuff + to + i, std::move_if_noexcept(*elem(i)));
+            } catch (...) {
+                while (i > 0)
+                    deleteptr(newbuff + to + --i);
+                throw;
+            }
+            for (i = 0; i < b_size; i++)
+                deleteptr(elem(i));
+        }
+    }
+
+    // Grows the buffer twice and constructs an element at the front or at the back
+    // The element is constructed before the others are moved, so args may refer to them
+    template <class... Args>
+    reference grow_emplace(const bool front, Args&&... args) {
+        const size_type cap = fit_capacity((b_size == 0) ? 1 : b_size*2);
+        pointer newbuff = allocate_buf(cap);
+        pointer val     = newbuff + (front ? 0 : b_size);
+        try {
+            constructptr(val, std::forward<Args>(args)...);
+            try {
+                relocate(newbuff, front ? 1 : 0);
+            } catch (...) {
+                deleteptr(val);
+                throw;
+            }
+        } catch (...) {
+            alloc_traits::deallocate(b_alloc, newbuff, cap);
+            throw;
+        }
+
+        deallocate_buf();
+        b_buf  = newbuff;
+        b_cap  = cap;
+        b_head = 0;
+        ++b_size;
+        return *val;
+    }
+
+    // Writes to the back, overwriting the front if full
+    template <class V>
+    void write_back_value(V&& val) {
+        if (capacity() == 0)
+            return;
+        // Synopsis: writes past the back, in a full buffer that's where the front is
+        if (full()) {
+            *elem(0) = std::forward<V>(val);
+            inchead();
+        } else {
+            constructptr(elem(b_size), std::forward<V>(val));
+            ++b_size;
+        }
+    }
+
+    // Writes to the front, overwriting the back if full
+    template <class V>
+    void write_front_value(V&& val) {
+        if (capacity() == 0)
+            return;
+        // Synopsis: moves the front back, then writes to it
+        // In a full buffer that's where the back is
+        if (full()) {
+            *elem(b_size - 1) = std::forward<V>(val);
+            dechead();
+        } else {
+            constructptr(elem(b_cap - 1), std::forward<V>(val));
+            dechead();
+            ++b_size;
+        }
     }
 
 public:
 
     //////// INITIALIZERS
 
-    explicit circular_buffer():
-        b_begin(nullptr), b_end(nullptr), b_left(nullptr), b_right(nullptr), b_size(0) {}
-    
-    explicit circular_buffer(const size_type sz) {
-        b_begin = (pointer)malloc(sz*sizeof(value_type));
-        b_end   = b_begin + sz;
-        b_left  = b_begin;
-        b_right = b_left;
-        b_size  = 0;
-    }
+    explicit circular_buffer(const alloc_type& alloc = alloc_type()):
+        b_alloc(alloc), b_buf(), b_cap(0), b_head(0), b_size(0) {}
+
+    explicit circular_buffer(const size_type sz, const alloc_type& alloc = alloc_type()):
+        b_alloc(alloc), b_buf(allocate_buf(fit_capacity(sz))),
+        b_cap(fit_capacity(sz)), b_head(0), b_size(0) {}
 
     template <class InputIterator>
-    circular_buffer(InputIterator first, InputIterator last) {
+    circular_buffer(InputIterator first, InputIterator last, const alloc_type& alloc = alloc_type()):
+        circular_buffer(alloc) {
         assign(first, last);
     }
 
+    circular_buffer(const circular_buffer& other, const alloc_type& alloc):
+        circular_buffer(other.capacity(), alloc) {
+        for (size_type i = 0; i < other.size(); i++)
+            write_back(other[i]);
+    }
+
+    circular_buffer(const circular_buffer& other):
+        circular_buffer(other, alloc_traits::select_on_container_copy_construction(other.b_alloc)) {}
+
+    circular_buffer(circular_buffer&& other) noexcept:
+        b_alloc(other.b_alloc), b_buf(other.b_buf), b_cap(other.b_cap), b_head(other.b_head), b_size(other.b_size) {
+        other.b_buf  = pointer();
+        other.b_cap  = 0;
+        other.b_head = 0;
+        other.b_size = 0;
+    }
+
     template <class InputIterator>
-    void assign(InputIterator first, InputIterator last);
+    void assign(InputIterator first, InputIterator last) {
+        clear();
+        for (; first != last; ++first)
+            push_back(*first);
+    }
 
     ~circular_buffer() {
-        if (!empty()) {
-            do {
-                deleteptr(b_left);
-                b_left = incptr(b_left);
+        clear();
+        deallocate_buf();
+    }
+
+    // The copy takes the other's allocator only if the allocator asks for that
+    circular_buffer& operator= (const circular_buffer& other) {
+        if (this != &other) {
+            circular_buffer copy(other, alloc_traits::propagate_on_container_copy_assignment::value ? other.b_alloc : b_alloc);
+            swap_buf(copy);
+        }
+        return *this;
+    }
+
+    // Takes the other's buffer if the allocator moves with it or the allocators are equal,
+    // otherwise has to move the elements one by one into a buffer of it's own
+    circular_buffer& operator= (circular_buffer&& other) noexcept(
+        alloc_traits::propagate_on_container_move_assignment::value || alloc_traits::is_always_equal::value) {
+        if (alloc_traits::propagate_on_container_move_assignment::value || b_alloc == other.b_alloc) {
+            circular_buffer moved(std::move(other));
+            swap_buf(moved);
+        } else {
+            circular_buffer moved(other.capacity(), b_alloc);
+            for (size_type i = 0; i < other.size(); i++)
+                moved.write_back(std::move(other[i]));
+            swap_buf(moved);
+        }
+        return *this;
+    }
 
-            } while (b_left != b_right);
+    // Swapping buffers with unequal allocators that don't propagate is undefined, like in std containers
+    void swap(circular_buffer& other) noexcept {
+        if (alloc_traits::propagate_on_container_swap::value) {
+            swap_buf(other);
+        } else {
+            assert(b_alloc == other.b_alloc);
+            swap_elements(other);
         }
+    }
 
-        free(b_begin);
+    alloc_type get_allocator() const noexcept {
+        return b_alloc;
     }
 
-    circular_buffer& operator= (const circular_buffer&& other) {
-        set_capacity(other.capacity());
-        for (auto elem : other)
-            push_back(elem);
+private:
+    void swap_elements(circular_buffer& other) noexcept {
+        std::swap(b_buf,  other.b_buf);
+        std::swap(b_cap,  other.b_cap);
+        std::swap(b_head, other.b_head);
+        std::swap(b_size, other.b_size);
     }
 
+    // Swaps everything, the allocators too
+    void swap_buf(circular_buffer& other) noexcept {
+        using std::swap;
+        swap(b_alloc, other.b_alloc);
+        swap_elements(other);
+    }
+
+public:
+
 
     //////// ITERATOR
 
     template <class cbType, class Traits>
     class cb_iterator {
     public:
-        typedef std::allocator<cbType> alloc;
         typedef typename Traits::value_type      value_type;
         typedef typename Traits::size_type       size_type;
         typedef typename Traits::pointer         pointer;
@@ -159,77 +423,42 @@ public:
 
         using iterator_category = std::random_access_iterator_tag;
     private:
-        // The pointer to which the iterator is pointing to
-        pointer i_ptr;
-        // How offset the iterator is from the start of the circular buffer
-        // Mostly for differentiating between start and end in full buffers
+        // The circular buffer that is iterated over
+        cbType* i_buf;
+        // How offset the iterator is from the leftmost element of the circular buffer
+        // Also differentiates between start and end in full buffers
         difference_type i_offs;
-        // The start of the cb's internal buffer
-        pointer b_begin;
-        // The one-past-end address for the end of cb's internal buffer
-        // i.e. the first address after the end of the buffer
-        pointer b_end;
-        // The pointer to the leftmost element in the buffer
-        // (used for pointer difference and comparasion)
-        pointer b_left;
-
-        //////// POINTER ARITHMETIC
-
-        // Inccrements the pointer within the boundaries of CB
-        void incptr(pointer& p) const noexcept {
-            if (++p == b_end)
-                p = b_begin;
-        }
-
-        // Decrements the pointer within the boundaries of CB
-        void decptr(pointer& p) const noexcept {
-            if (p == b_begin)
-                p = b_end;
-            --p;
-        }
-
-        // Offsets the pointer within the boundaries of CB
-        pointer addptr(pointer p, const size_type ofs) const noexcept {
-            return p + (
-                (p + ofs >= b_end)
-                ? (ofs - b_end + b_begin)
-                : (ofs)
-            );
-        }
-
-        // Offsets the pointer within the boundaries of CB
-        pointer subptr(pointer p, const size_type ofs) const noexcept {
-            return p - (
-                (p - ofs < b_begin)
-                ? (ofs - b_begin + b_end)
-                : (ofs)
-            );
-        }
 
         // How offset the iterator is from the leftmost element in the CB
         difference_type offset() const noexcept {
             return i_offs;
         }
 
+        pointer elem(const difference_type ind) const noexcept {
+            return i_buf->elem(ind);
+        }
+
     public:
 
         //////// INITIALIZERS
 
-        cb_iterator(const pointer& ptr, const difference_type& offs, const pointer& begin, const pointer& end, const pointer& left):
-            i_ptr(ptr), i_offs(offs), b_begin(begin), b_end(end), b_left(left) {}
-        
-        cb_iterator(const cb_iterator& it):
-            i_ptr(it.i_ptr), i_offs(it.i_offs), b_begin(it.b_begin), b_end(it.b_end), b_left(it.b_left) {}
-        
+        cb_iterator() noexcept: i_buf(nullptr), i_offs(0) {}
+
+        cb_iterator(cbType* buf, const difference_type offs) noexcept:
+            i_buf(buf), i_offs(offs) {}
+
+        cb_iterator(const cb_iterator& it) = default;
+        cb_iterator& operator= (const cb_iterator& it) = default;
+
 
         //////// VALUE STUFF
 
         constexpr reference operator* () const noexcept {
-            return *i_ptr;
+            return *elem(i_offs);
         }
 
         constexpr pointer operator-> () const noexcept {
-            return i_ptr;
+            return elem(i_offs);
         }
 
 
@@ -261,59 +490,53 @@ public:
 
         // Prefix
         cb_iterator& operator++ () noexcept {
-            incptr(i_ptr);
             ++i_offs;
             return *this;
         }
         cb_iterator& operator-- () noexcept {
-            decptr(i_ptr);
             --i_offs;
             return *this;
         }
 
         // Postfix
         cb_iterator operator++ (int) noexcept {
-            iterator temp(*this);
+            cb_iterator temp(*this);
             ++*this;
             return temp;
         }
         cb_iterator operator-- (int) noexcept {
-            iterator temp(*this);
+            cb_iterator temp(*this);
             --*this;
             return temp;
         }
 
         // Difference type arithmetics
         cb_iterator& operator += (const difference_type diff) noexcept {
-            if (diff > 0)
-                addptr(i_ptr, diff);
-            else
-                subptr(i_ptr, diff);
             i_offs += diff;
             return *this;
         }
         cb_iterator& operator -= (const difference_type diff) noexcept {
-            if (diff < 0)
-                addptr(i_ptr, diff);
-            else
-                subptr(i_ptr, diff);
             i_offs -= diff;
             return *this;
         }
 
         cb_iterator operator + (const difference_type diff) const noexcept {
-            iterator temp(*this);
+            cb_iterator temp(*this);
             temp += diff;
             return temp;
         }
         cb_iterator operator - (const difference_type diff) const noexcept {
-            iterator temp(*this);
+            cb_iterator temp(*this);
             temp -= diff;
             return temp;
         }
 
+        friend cb_iterator operator + (const difference_type diff, const cb_iterator& it) noexcept {
+            return it + diff;
+        }
+
         cb_iterator operator + (const cb_iterator other) const noexcept {
-            iterator temp(*this);
+            cb_iterator temp(*this);
             temp += other.offset();
             return temp;
         }
@@ -322,32 +545,49 @@ public:
             return offset() - other.offset();
         }
 
-        reference operator[] (const size_type ind) noexcept {
-            pointer temp(i_ptr);
-            addptr(temp, ind);
-            return *temp;
+        reference operator[] (const difference_type ind) const noexcept {
+            return *elem(i_offs + ind);
+        }
+
+
+        //////// SEGMENTED ITERATION
+
+        // The up to two contiguous pieces of the elements in [*this, last), see segmented.cpp
+        segment_list<pointer, 2> segments(const cb_iterator& last) const noexcept {
+            segment_list<pointer, 2> list;
+            i_buf->for_segments(i_buf->slot(i_offs), last.i_offs - i_offs, [&](pointer p, const size_type count) {
+                list.piece[list.count++] = std::make_pair(p, p + count);
+            });
+            return list;
         }
     };
 
-    typedef cb_iterator<value_type, cb_meta::cb_nonconst_traits<alloc_type>> iterator;
-    typedef cb_iterator<value_type, cb_meta::cb_const_traits<alloc_type>>    const_iterator;
+    typedef cb_iterator<circular_buffer,       cb_meta::cb_nonconst_traits<alloc_type>> iterator;
+    typedef cb_iterator<const circular_buffer, cb_meta::cb_const_traits<alloc_type>>    const_iterator;
     typedef std::reverse_iterator<iterator>       reverse_iterator;
     typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
     //////// ITERATOR FUNCTIONS
 
     iterator begin() noexcept {
-        return iterator(b_left, 0, b_begin, b_end, b_left);
+        return iterator(this, 0);
     }
     iterator end()   noexcept {
-        return iterator(b_right, b_size, b_begin, b_end, b_left);
+        return iterator(this, b_size);
+    }
+
+    const_iterator begin() const noexcept {
+        return cbegin();
+    }
+    const_iterator end()   const noexcept {
+        return cend();
     }
 
     const_iterator cbegin() const noexcept {
-        return const_iterator(b_left, 0, b_begin, b_end, b_left);
+        return const_iterator(this, 0);
     }
     const_iterator cend()   const noexcept {
-        return const_iterator(b_right, b_size, b_begin, b_end, b_left);
+        return const_iterator(this, b_size);
     }
 
     reverse_iterator rbegin() noexcept {
@@ -367,45 +607,55 @@ public:
     //////// ELEMENT ACCESS
     reference at(const size_type ind) {
         assert(ind < size());
-        return *addptr(b_left, ind);
+        return *elem(ind);
+    }
+    const_reference at(const size_type ind) const {
+        assert(ind < size());
+        return *elem(ind);
     }
     reference inline operator[] (const size_type ind) {
         return at(ind);
     }
+    const_reference inline operator[] (const size_type ind) const {
+        return at(ind);
+    }
 
+    // Indexes from the back
     reference rat(const size_type ind) {
         assert(ind < size());
-        return *decptr(b_right, ind);
+        return *elem(b_size - 1 - ind);
     }
 
     reference front() {
         assert(!empty());
-        return *b_left;
+        return *elem(0);
     }
 
     reference back() {
         assert(!empty());
-        pointer temp(b_right);
-        decptr(temp);
-        return *(temp);
+        return *elem(b_size - 1);
     }
 
     //////// CAPACITY
 
-    inline bool empty() {
+    inline bool empty() const noexcept {
         return b_size == 0;
     }
 
-    inline bool full() {
+    inline bool full() const noexcept {
         return size() == capacity();
     }
 
-    inline size_type size() {
+    inline size_type size() const noexcept {
         return b_size;
     }
 
-    inline size_type capacity() {
-        return b_end - b_begin;
+    inline size_type capacity() const noexcept {
+        return b_cap;
+    }
+
+    inline size_type max_size() const noexcept {
+        return alloc_traits::max_size(b_alloc);
     }
 
 private:
@@ -413,113 +663,288 @@ private:
     // Requires that sz is GREATER OR EQUAL than b_size
     // Thus, deleting of excess elements should be handled before calling it
     void reallocate_buf(const size_type sz) {
-        pointer newbuff = (pointer)malloc(sz*sizeof(value_type));
-
-        pointer copyptr = b_left;
-        for (size_type i = 0; i < size(); i++) {
-            moveptr(copyptr, &newbuff[i]);
-            incptr(copyptr);
+        pointer newbuff = allocate_buf(sz);
+        try {
+            relocate(newbuff, 0);
+        } catch (...) {
+            if (newbuff != pointer())
+                alloc_traits::deallocate(b_alloc, newbuff, sz);
+            throw;
         }
 
-        free(b_begin);
-        b_begin = newbuff;
-        b_end   = b_begin + sz;
-        b_left  = b_begin;
-        b_right = (full()) ? (b_left) : (b_left  + size());
+        deallocate_buf();
+        b_buf  = newbuff;
+        b_cap  = sz;
+        b_head = 0;
     }
 
 public:
+    // Sets the capacity to at least sz (see the capacity policies and mirrored_allocator)
+    // Elements that don't fit are removed from the back
     void set_capacity(const size_type sz) {
-        for (auto i = sz; i < size(); i++) {
+        const size_type cap = fit_capacity(sz);
+        while (size() > cap)
             pop_back();
-        }
-        reallocate_buf(sz);
+        reallocate_buf(cap);
     }
+    // Elements that don't fit are removed from the front
     void rset_capacity(const size_type sz) {
-        for (auto i = sz; i < size(); i++) {
+        const size_type cap = fit_capacity(sz);
+        while (size() > cap)
             pop_front();
-        }
-        reallocate_buf(sz);
+        reallocate_buf(cap);
     }
 
     //////// BUFFER MODIFICATION
 
     void pop_front() {
         assert(!empty());
-        deleteptr(b_left);
-        incptr(b_left);
+        deleteptr(elem(0));
+        inchead();
         --b_size;
     }
 
     void pop_back() {
         assert(!empty());
-        decptr(b_right);
-        deleteptr(b_right);
+        deleteptr(elem(b_size - 1));
         --b_size;
     }
-    // Adds to the front of the circular buffer
+
+    // Removes n elements from the front
+    void pop_front(const size_type n) {
+        assert(n <= size());
+        if constexpr (std::is_trivially_destructible<value_type>::value) {
+            b_head  = Capacity::wrap(b_head + n, b_cap);
+            b_size -= n;
+        } else {
+            for (size_type i = 0; i < n; i++)
+                pop_front();
+        }
+    }
+
+    void clear() {
+        while (!empty())
+            pop_back();
+    }
+
+    // Constructs an element at the front of the circular buffer
     // RESIZES IF NEEDED
-    void push_front(const value_type val) {
+    template <class... Args>
+    reference emplace_front(Args&&... args) {
         if (full())
-            set_capacity((b_size == 0) ? 1 : b_size*2);
-        write_front(val);
+            return grow_emplace(true, std::forward<Args>(args)...);
+        constructptr(elem(b_cap - 1), std::forward<Args>(args)...);
+        dechead();
+        ++b_size;
+        return *elem(0);
     }
-    // Adds to the back of the circular buffer
+    // Constructs an element at the back of the circular buffer
     // RESIZES IF NEEDED
-    void push_back(const value_type val) {
+    template <class... Args>
+    reference emplace_back(Args&&... args) {
         if (full())
-            set_capacity((b_size == 0) ? 1 : b_size*2);
-        write_back(val);
+            return grow_emplace(false, std::forward<Args>(args)...);
+        constructptr(elem(b_size), std::forward<Args>(args)...);
+        ++b_size;
+        return *elem(b_size - 1);
     }
 
-    // Adds to the front of the circular buffer and
-    // DOESN'T RESIZE, WILL OVERWRITE IF FULL
-    void write_front(const value_type val) {
-        decptr(b_left);
-        // Synopsis: decrements b_left, then writes to it
-        if (full()) {
-            if (empty())
-                return;
-            *b_left = val;
-            b_right = b_left;
-        } else {
-            *b_left = val;
-            ++b_size;
-        } 
+    // Adds to the front of the circular buffer
+    // RESIZES IF NEEDED
+    void push_front(const value_type& val) {
+        emplace_front(val);
+    }
+    void push_front(value_type&& val) {
+        emplace_front(std::move(val));
+    }
+    // Adds to the back of the circular buffer
+    // RESIZES IF NEEDED
+    void push_back(const value_type& val) {
+        emplace_back(val);
+    }
+    void push_back(value_type&& val) {
+        emplace_back(std::move(val));
     }
+
     // Adds to the front of the circular buffer and
-    // DOESN'T RESIZE, WILL OVERWRITE IF FULL
-    void write_back(const value_type val) {
-        // Synopsis: write to b_right, then increment it
-        if (full()) {
-            if (empty())
+    // DOESN'T RESIZE, WILL OVERWRITE THE BACK IF FULL
+    void write_front(const value_type& val) {
+        write_front_value(val);
+    }
+    void write_front(value_type&& val) {
+        write_front_value(std::move(val));
+    }
+    // Adds to the back of the circular buffer and
+    // DOESN'T RESIZE, WILL OVERWRITE THE FRONT IF FULL
+    void write_back(const value_type& val) {
+        write_back_value(val);
+    }
+    void write_back(value_type&& val) {
+        write_back_value(std::move(val));
+    }
+
+    //////// BULK MODIFICATION
+    // Work on at most two contiguous pieces of the buffer instead of one element at a time,
+    // trivially copyable elements are copied with memcpy
+
+    // Adds the range to the back of the circular buffer
+    // RESIZES IF NEEDED
+    template <class InputIterator, class = cb_meta::if_iterator<InputIterator>>
+    void push_back(InputIterator first, InputIterator last) {
+        typedef typename std::iterator_traits<InputIterator>::iterator_category category;
+        if constexpr (!std::is_base_of<std::forward_iterator_tag, category>::value) {
+            // The length isn't known before the range is read
+            for (; first != last; ++first)
+                emplace_back(*first);
+        } else {
+            const size_type n = std::distance(first, last);
+            if (n == 0)
                 return;
-            *b_right = val;
-            incptr(b_right);
-            b_left = b_right;
+            reserve_back(n);
+            if constexpr (cb_meta::is_memcpy_range<InputIterator, value_type>) {
+                for_segments(slot(b_size), n, [&](pointer p, const size_type count) {
+                    memcpy(std::addressof(*p), first, count*sizeof(value_type));
+                    first += count;
+                });
+                b_size += n;
+            } else {
+                // b_size grows with every element, so a throw keeps the ones already constructed
+                for_segments(slot(b_size), n, [&](pointer p, const size_type count) {
+                    for (size_type i = 0; i < count; i++, ++first) {
+                        constructptr(p + i, *first);
+                        ++b_size;
+                    }
+                });
+            }
+        }
+    }
+
+    // Adds count elements to the back of the circular buffer and
+    // DOESN'T RESIZE, WILL OVERWRITE THE FRONT IF FULL
+    // If there are more than the capacity, only the last ones are kept
+    void write_back(const value_type* data, size_type count) {
+        if (capacity() == 0)
+            return;
+        if (count > b_cap) {
+            data += count - b_cap;
+            count = b_cap;
+        }
+        const size_type added       = (count < b_cap - b_size) ? count : (b_cap - b_size);
+        const size_type overwritten = count - added;
+        // Past the back, then over the front
+        if constexpr (std::is_trivially_copyable<value_type>::value) {
+            for_segments(slot(b_size), count, [&](pointer p, const size_type n) {
+                memcpy(std::addressof(*p), data, n*sizeof(value_type));
+                data += n;
+            });
+            b_size += added;
         } else {
-            *b_right = val;
-            incptr(b_right);
-            ++b_size;
-        } 
+            // Free slots get new elements, b_size grows with every one in case a constructor throws
+            for_segments(slot(b_size), added, [&](pointer p, const size_type n) {
+                for (size_type i = 0; i < n; i++, ++data) {
+                    constructptr(p + i, *data);
+                    ++b_size;
+                }
+            });
+            // Elements at the front are assigned over
+            for_segments(slot(0), overwritten, [&](pointer p, const size_type n) {
+                for (size_type i = 0; i < n; i++, ++data)
+                    p[i] = *data;
+            });
+        }
+        b_head = Capacity::wrap(b_head + overwritten, b_cap);
+    }
+
+    // Moves up to n front elements out into the output iterator and removes them
+    // Returns how many were moved out
+    template <class OutputIterator>
+    size_type pop_front_into(OutputIterator out, size_type n) {
+        if (n > b_size)
+            n = b_size;
+        if constexpr (cb_meta::is_memcpy_range<OutputIterator, value_type>) {
+            for_segments(slot(0), n, [&](pointer p, const size_type count) {
+                memcpy(out, std::addressof(*p), count*sizeof(value_type));
+                out += count;
+            });
+            b_head  = Capacity::wrap(b_head + n, b_cap);
+            b_size -= n;
+        } else {
+            // Every element is removed right after it's moved, in case the next move throws
+            for_segments(slot(0), n, [&](pointer p, const size_type count) {
+                for (size_type i = 0; i < count; i++, ++out) {
+                    *out = std::move(p[i]);
+                    deleteptr(p + i);
+                    inchead();
+                    --b_size;
+                }
+            });
+        }
+        return n;
+    }
+
+    //////// CONTIGUOUS PIECES
+    // The elements and the free slots, as at most two pieces of plain memory each,
+    // for memcpy, readv/writev (see circular_buffer_io.cpp) and other pointer loops
+    // The second piece is empty if the first one doesn't reach the end of the buffer,
+    // and always is with a mirrored allocator
+
+    typedef std::pair<pointer, size_type>       array_range;
+    typedef std::pair<const_pointer, size_type> const_array_range;
+
+    // The elements from the front up to the end of the buffer
+    array_range array_one() noexcept {
+        return array_range(b_buf + slot(0), first_segment(slot(0), b_size));
+    }
+    const_array_range array_one() const noexcept {
+        return const_array_range(b_buf + slot(0), first_segment(slot(0), b_size));
+    }
+    // The rest of the elements, from the start of the buffer
+    array_range array_two() noexcept {
+        return array_range(b_buf, b_size - first_segment(slot(0), b_size));
+    }
+    const_array_range array_two() const noexcept {
+        return const_array_range(b_buf, b_size - first_segment(slot(0), b_size));
+    }
+
+    // The free slots past the back up to the end of the buffer
+    array_range free_array_one() noexcept {
+        return array_range(b_buf + slot(b_size), first_segment(slot(b_size), b_cap - b_size));
+    }
+    // The rest of the free slots, from the start of the buffer
+    array_range free_array_two() noexcept {
+        return array_range(b_buf, b_cap - b_size - first_segment(slot(b_size), b_cap - b_size));
+    }
+
+    // Makes the first n free slots past the back elements, once they were written
+    // through free_array_one() and free_array_two()
+    // Nothing is constructed, so T has to be fine as plain bytes
+    void commit_back(const size_type n) noexcept {
+        static_assert(std::is_trivially_copyable<value_type>::value, "only trivially copyable elements can be written as memory");
+        assert(n <= capacity() - size());
+        b_size += n;
     }
 
     //////// OTHER STUFF
 
-    inline bool linear() {
-        return (b_left < b_right);
+    // Whether the elements lie in the buffer in one piece, in their order
+    // Always true for a mirrored buffer
+    inline bool linear() const noexcept {
+        return mirrored || empty() || slot(0) + size() <= capacity();
     }
 
+    // Moves the elements so that they lie in one piece, returns the first one
+    // Free for a mirrored buffer, the elements past the end are read through the mirror
     pointer linearize() {
-        reallocate_buf(capacity());
-        return b_begin;
+        if (!linear())
+            reallocate_buf(capacity());
+        return elem(0);
     }
 
     //////// DEBUG
     #if CIRCULAR_BUFFER_DEBUG
     // Prints the memory representation of the circular buffer
     void print_mem() {
-        for (pointer p = b_begin; p < b_end; p++) {
+        for (pointer p = b_buf; p != b_buf + b_cap; p++) {
             std::cout << *p << ' ';
         }
         std::cout << std::endl;
@@ -527,4 +952,4 @@ public:
     #endif
 };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "circular_buffer.cpp"
+
+namespace stl {
+
+// Moves bytes between a file descriptor and a circular_buffer without copying
+// them element by element: the buffer's pieces go to readv/writev as they are
+// POSIX only, the elements have to be trivially copyable
+
+// Reads from fd into the free slots past the back, up to the capacity
+// Returns what readv does: the amount of elements added, 0 at the end of the file
+// or if the buffer is full, -1 with errno set on an error
+// Partially read elements are lost, so the element size should divide what fd delivers
+template <class T, class Capacity, class Alloc>
+ssize_t cb_read(const int fd, circular_buffer<T, Capacity, Alloc>& buffer) {
+    const auto one = buffer.free_array_one();
+    const auto two = buffer.free_array_two();
+    iovec iov[2] = {
+        {static_cast<void*>(one.first), one.second*sizeof(T)},
+        {static_cast<void*>(two.first), two.second*sizeof(T)},
+    };
+    const ssize_t got = ::readv(fd, iov, (two.second != 0) ? 2 : 1);
+    if (got <= 0)
+        return got;
+    buffer.commit_back(got/sizeof(T));
+    return got/sizeof(T);
+}
+
+// Writes the elements from the front to fd and removes what was written
+// Returns what writev does: the amount of elements removed, -1 with errno set on an error
+// An element that was only partially written stays in the buffer, it's bytes are written again
+template <class T, class Capacity, class Alloc>
+ssize_t cb_write(const int fd, circular_buffer<T, Capacity, Alloc>& buffer) {
+    static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable elements can be written as memory");
+    const auto one = buffer.array_one();
+    const auto two = buffer.array_two();
+    iovec iov[2] = {
+        {static_cast<void*>(one.first), one.second*sizeof(T)},
+        {static_cast<void*>(two.first), two.second*sizeof(T)},
+    };
+    const ssize_t put = ::writev(fd, iov, (two.second != 0) ? 2 : 1);
+    if (put <= 0)
+        return put;
+    buffer.pop_front(put/sizeof(T));
+    return put/sizeof(T);
+}
+
+}
@@ -0,0 +1,475 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace stl {
+
+// Cache line of x86-64 and most ARM cores
+// Fields written by different threads go to different lines, so they don't bounce between cores
+constexpr std::size_t cache_line_size = 64;
+
+// Lock-free circular buffer for exactly one producer thread and one consumer thread
+// The producer only writes b_tail, the consumer only writes b_head, and each of
+// them keeps a cached copy of the other's index, so the shared line is only read
+// when the cached copy says the buffer is full (or empty)
+// Doesn't grow: pushes into a full buffer and pops from an empty one fail
+template <class T>
+class spsc_circular_buffer {
+public:
+    typedef T                 value_type;
+    typedef std::size_t       size_type;
+    typedef std::ptrdiff_t    difference_type;
+    typedef value_type*       pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type&       reference;
+    typedef const value_type& const_reference;
+
+private:
+    // Never change after the construction, read by both threads
+    // The start of the internal buffer
+    pointer   b_begin;
+    // Amount of slots, one more than the capacity, so that head == tail only when empty
+    size_type b_slots;
+
+    // Consumer's line
+    // The slot of the frontmost element, written by the consumer
+    alignas(cache_line_size) std::atomic<size_type> b_head;
+    // The last b_tail the consumer has seen, there are at least that many elements
+    size_type c_tail;
+
+    // Producer's line
+    // The slot the next element goes to, written by the producer
+    alignas(cache_line_size) std::atomic<size_type> b_tail;
+    // The last b_head the producer has seen, there is at least that much free space
+    size_type p_head;
+
+    //////// INDEX ARITHMETIC
+
+    // Increments the slot index within the boundaries of the buffer
+    size_type next(const size_type i) const noexcept {
+        return (i+1 == b_slots) ? 0 : i+1;
+    }
+
+    // Offsets the slot index within the boundaries of the buffer
+    size_type advance(const size_type i, const size_type ofs) const noexcept {
+        return (i + ofs >= b_slots) ? (i + ofs - b_slots) : (i + ofs);
+    }
+
+    // Amount of elements between the head and the tail
+    size_type distance(const size_type head, const size_type tail) const noexcept {
+        return (tail >= head) ? (tail - head) : (tail + b_slots - head);
+    }
+
+public:
+
+    //////// INITIALIZERS
+
+    explicit spsc_circular_buffer(const size_type capacity):
+        b_begin((pointer)::operator new((capacity+1)*sizeof(value_type), std::align_val_t(alignof(value_type)))),
+        b_slots(capacity+1), b_head(0), c_tail(0), b_tail(0), p_head(0) {}
+
+    spsc_circular_buffer(const spsc_circular_buffer&) = delete;
+    spsc_circular_buffer& operator= (const spsc_circular_buffer&) = delete;
+
+    // Both threads have to be done with the buffer by now
+    ~spsc_circular_buffer() {
+        for (size_type i = b_head.load(); i != b_tail.load(); i = next(i))
+            b_begin[i].~value_type();
+        ::operator delete(b_begin, std::align_val_t(alignof(value_type)));
+    }
+
+    //////// PRODUCER
+
+    // Constructs an element at the back, false if the buffer is full
+    template <class... Args>
+    bool try_emplace(Args&&... args) {
+        const size_type tail = b_tail.load(std::memory_order_relaxed);
+        const size_type next_tail = next(tail);
+        if (next_tail == p_head) {
+            p_head = b_head.load(std::memory_order_acquire);
+            if (next_tail == p_head)
+                return false;
+        }
+        new (b_begin + tail) value_type(std::forward<Args>(args)...);
+        b_tail.store(next_tail, std::memory_order_release);
+        return true;
+    }
+
+    bool try_push(const value_type& val) {
+        return try_emplace(val);
+    }
+
+    bool try_push(value_type&& val) {
+        return try_emplace(std::move(val));
+    }
+
+    // Pushes elements from the range until it ends or the buffer fills up
+    // Returns how many were pushed, they are published with a single store
+    template <class InputIterator>
+    size_type try_push(InputIterator first, InputIterator last) {
+        // The length of an input range isn't known, so the head is always refreshed,
+        // that's one load of the consumer's line for the whole range
+        const size_type tail  = b_tail.load(std::memory_order_relaxed);
+        p_head = b_head.load(std::memory_order_acquire);
+        const size_type space = distance(next(tail), p_head);
+
+        size_type count = 0;
+        try {
+            for (size_type i = tail; count < space && first != last; ++first, ++count, i = next(i))
+                new (b_begin + i) value_type(*first);
+        } catch (...) {
+            // The elements constructed so far stay pushed
+            b_tail.store(advance(tail, count), std::memory_order_release);
+            throw;
+        }
+        if (count != 0)
+            b_tail.store(advance(tail, count), std::memory_order_release);
+        return count;
+    }
+
+    //////// CONSUMER
+
+    // Moves the front element out into val, false if the buffer is empty
+    bool try_pop(value_type& val) {
+        const size_type head = b_head.load(std::memory_order_relaxed);
+        if (head == c_tail) {
+            c_tail = b_tail.load(std::memory_order_acquire);
+            if (head == c_tail)
+                return false;
+        }
+        val = std::move(b_begin[head]);
+        b_begin[head].~value_type();
+        b_head.store(next(head), std::memory_order_release);
+        return true;
+    }
+
+    // Moves up to n front elements out into the output iterator
+    // Returns how many were popped, the space is handed back with a single store
+    template <class OutputIterator>
+    size_type try_pop(OutputIterator out, const size_type n) {
+        const size_type head = b_head.load(std::memory_order_relaxed);
+        size_type ready = distance(head, c_tail);
+        if (ready < n) {
+            c_tail = b_tail.load(std::memory_order_acquire);
+            ready  = distance(head, c_tail);
+        }
+
+        const size_type count = (ready < n) ? ready : n;
+        for (size_type i = 0, slot = head; i < count; i++, slot = next(slot)) {
+            *out = std::move(b_begin[slot]);
+            ++out;
+            b_begin[slot].~value_type();
+        }
+        if (count != 0)
+            b_head.store(advance(head, count), std::memory_order_release);
+        return count;
+    }
+
+    //////// CAPACITY
+    // Exact only when the other thread isn't working with the buffer
+
+    size_type size() const noexcept {
+        const size_type head = b_head.load(std::memory_order_acquire);
+        return distance(head, b_tail.load(std::memory_order_acquire));
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    bool full() const noexcept {
+        return size() == capacity();
+    }
+
+    size_type capacity() const noexcept {
+        return b_slots - 1;
+    }
+};
+
+//////// BLOCKING
+
+// Tells the CPU that the thread is spinning, so the sibling hyperthread gets the core
+inline void cpu_relax() noexcept {
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+    #elif defined(__aarch64__)
+    asm volatile("yield");
+    #endif
+}
+
+// Place for threads to sleep until the buffer changes
+// Wakers only touch the mutex when somebody sleeps, so a busy buffer never makes a syscall,
+// and only fence when somebody is in a blocking call, so the non-blocking calls stay fence-free
+class __buffer_waiter {
+    std::mutex              lock;
+    std::condition_variable cv;
+    // Threads inside wait(), spinning or sleeping
+    std::atomic<unsigned>   waiters;
+    std::atomic<unsigned>   sleepers;
+
+    // A wake() that races with a thread entering wait() can miss it (see wake()),
+    // so a sleeper checks the buffer again after this long instead of hanging
+    constexpr static std::chrono::milliseconds recheck{1};
+
+    template <class Attempt, class Ready>
+    void wait_registered(Attempt& attempt, Ready& ready) {
+        for (int i = 0; i < 64; i++) {
+            if (attempt())
+                return;
+            cpu_relax();
+        }
+        for (;;) {
+            if (attempt())
+                return;
+            std::unique_lock<std::mutex> guard(lock);
+            sleepers.fetch_add(1);
+            // Pairs with the fence in wake(): either the waker sees the sleeper,
+            // or ready() sees what the waker has published
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready())
+                cv.wait_for(guard, recheck);
+            sleepers.fetch_sub(1);
+        }
+    }
+
+public:
+    __buffer_waiter(): waiters(0), sleepers(0) {}
+
+    // Calls attempt() until it succeeds, sleeping while ready() says it would fail
+    // Spins a bit first, a parked thread takes microseconds to wake up
+    // attempt() runs outside of the lock, it may wake the waiters of the other side
+    template <class Attempt, class Ready>
+    void wait(Attempt attempt, Ready ready) {
+        waiters.fetch_add(1);
+        wait_registered(attempt, ready);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Called after publishing a change
+    // With nobody in wait() it's a single relaxed load. A thread that is entering wait()
+    // right now may not be seen yet, then it's the recheck that picks the change up
+    void wake() {
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) == 0)
+            return;
+        // A sleeper between ready() and cv.wait holds the lock, so it can't miss this
+        std::lock_guard<std::mutex> guard(lock);
+        cv.notify_all();
+    }
+};
+
+// Bounded lock-free circular buffer for any number of producers and consumers
+// Every slot has a sequence number that says whose turn it is: a producer at
+// position pos owns the slot when the sequence is pos, a consumer when it is pos+1
+// Producers and consumers only contend on their own position counter with a CAS,
+// a slot is handed over with a single release store
+// The capacity is rounded up to a power of two, positions are masked into slots
+template <class T>
+class mpmc_circular_buffer {
+    static_assert(std::is_nothrow_move_constructible<T>::value, "elements are moved into claimed slots");
+    static_assert(std::is_nothrow_destructible<T>::value, "elements are destroyed in claimed slots");
+
+public:
+    typedef T                 value_type;
+    typedef std::size_t       size_type;
+    typedef std::ptrdiff_t    difference_type;
+    typedef value_type*       pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type&       reference;
+    typedef const value_type& const_reference;
+
+private:
+    struct slot {
+        std::atomic<size_type> sequence;
+        alignas(value_type) unsigned char storage[sizeof(value_type)];
+
+        pointer value() noexcept {
+            return reinterpret_cast<pointer>(storage);
+        }
+    };
+
+    // Never change after the construction
+    slot*     b_slots;
+    // Slot count minus one
+    size_type b_mask;
+
+    // The position of the next push, only ever grows
+    alignas(cache_line_size) std::atomic<size_type> b_tail;
+    // The position of the next pop, only ever grows
+    alignas(cache_line_size) std::atomic<size_type> b_head;
+
+    // Sleeping producers and consumers of the blocking calls
+    alignas(cache_line_size) __buffer_waiter not_full;
+    __buffer_waiter not_empty;
+
+    static size_type round_up(const size_type capacity) noexcept {
+        size_type slots = 1;
+        while (slots < capacity)
+            slots <<= 1;
+        return slots;
+    }
+
+    // Takes the slot of the next push, nullptr if the buffer is full
+    slot* claim_tail(size_type& pos) noexcept {
+        pos = b_tail.load(std::memory_order_relaxed);
+        for (;;) {
+            slot* s = b_slots + (pos & b_mask);
+            const difference_type diff = (difference_type)s->sequence.load(std::memory_order_acquire) - (difference_type)pos;
+            if (diff == 0) {
+                if (b_tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    return s;
+            } else if (diff < 0) {
+                // The consumer of the last lap hasn't freed the slot yet
+                return nullptr;
+            } else {
+                // Another producer got it first
+                pos = b_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Takes the slot of the next pop, nullptr if the buffer is empty
+    slot* claim_head(size_type& pos) noexcept {
+        pos = b_head.load(std::memory_order_relaxed);
+        for (;;) {
+            slot* s = b_slots + (pos & b_mask);
+            const difference_type diff = (difference_type)s->sequence.load(std::memory_order_acquire) - (difference_type)(pos+1);
+            if (diff == 0) {
+                if (b_head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    return s;
+            } else if (diff < 0) {
+                // The producer hasn't filled the slot yet
+                return nullptr;
+            } else {
+                pos = b_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+public:
+
+    //////// INITIALIZERS
+
+    explicit mpmc_circular_buffer(const size_type capacity):
+        b_slots((slot*)::operator new(round_up(capacity)*sizeof(slot), std::align_val_t(alignof(slot)))),
+        b_mask(round_up(capacity)-1), b_tail(0), b_head(0) {
+        for (size_type i = 0; i <= b_mask; i++)
+            new (&b_slots[i].sequence) std::atomic<size_type>(i);
+    }
+
+    mpmc_circular_buffer(const mpmc_circular_buffer&) = delete;
+    mpmc_circular_buffer& operator= (const mpmc_circular_buffer&) = delete;
+
+    // All of the threads have to be done with the buffer by now
+    ~mpmc_circular_buffer() {
+        for (size_type pos = b_head.load(); pos != b_tail.load(); pos++)
+            b_slots[pos & b_mask].value()->~value_type();
+        ::operator delete(b_slots, std::align_val_t(alignof(slot)));
+    }
+
+    //////// NON-BLOCKING
+
+    // Constructs an element at the back, false if the buffer is full
+    // A claimed position can't be given back, so a constructor that may throw
+    // runs before the claim, and the arguments are used up even if the buffer is full
+    template <class... Args>
+    bool try_emplace(Args&&... args) {
+        if constexpr (!std::is_nothrow_constructible<value_type, Args&&...>::value) {
+            value_type val(std::forward<Args>(args)...);
+            return try_emplace(std::move(val));
+        } else {
+            size_type pos;
+            slot* s = claim_tail(pos);
+            if (s == nullptr)
+                return false;
+            new (s->value()) value_type(std::forward<Args>(args)...);
+            s->sequence.store(pos+1, std::memory_order_release);
+            not_empty.wake();
+            return true;
+        }
+    }
+
+    bool try_push(const value_type& val) {
+        return try_emplace(val);
+    }
+
+    bool try_push(value_type&& val) {
+        return try_emplace(std::move(val));
+    }
+
+    // Moves the front element out into val, false if the buffer is empty
+    bool try_pop(value_type& val) {
+        size_type pos;
+        slot* s = claim_head(pos);
+        if (s == nullptr)
+            return false;
+        val = std::move(*s->value());
+        s->value()->~value_type();
+        // Free for the producer of the next lap
+        s->sequence.store(pos + b_mask+1, std::memory_order_release);
+        not_full.wake();
+        return true;
+    }
+
+    //////// BLOCKING
+    // Spin, then sleep until the buffer has space (or elements)
+
+    template <class... Args>
+    void emplace(Args&&... args) {
+        push(value_type(std::forward<Args>(args)...));
+    }
+
+    void push(const value_type& val) {
+        push(value_type(val));
+    }
+
+    void push(value_type&& val) {
+        // A failed try_push doesn't touch val, the move only happens into a claimed slot
+        not_full.wait([&] { return try_push(std::move(val)); }, [&] { return !full(); });
+    }
+
+    void pop(value_type& val) {
+        not_empty.wait([&] { return try_pop(val); }, [&] { return !empty(); });
+    }
+
+    value_type pop() {
+        value_type val;
+        pop(val);
+        return val;
+    }
+
+    //////// CAPACITY
+    // Only a snapshot while other threads are working with the buffer
+
+    size_type size() const noexcept {
+        const size_type head = b_head.load(std::memory_order_acquire);
+        const size_type tail = b_tail.load(std::memory_order_acquire);
+        // Positions are read one after another, the head may have passed the tail read before it
+        return (tail > head) ? (tail - head) : 0;
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    bool full() const noexcept {
+        return size() >= capacity();
+    }
+
+    size_type capacity() const noexcept {
+        return b_mask+1;
+    }
+};
+
+}
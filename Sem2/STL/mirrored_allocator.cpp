@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace stl {
+
+// Allocator of "magic rings": the memory of n elements is a memfd that is mapped
+// twice, back to back, so p[i + n] is the same memory as p[i]
+// A circular_buffer on it sees every window of up to capacity() elements as one
+// contiguous piece, even if it wraps around the end of the buffer
+// n has to be a whole amount of pages, see round()
+// Linux only, throws std::bad_alloc if any of the mappings fails
+template <class T>
+class mirrored_allocator {
+public:
+    typedef T              value_type;
+    typedef std::size_t    size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::true_type is_always_equal;
+    // Tells circular_buffer that the memory past the end mirrors the start
+    typedef std::true_type is_mirrored;
+
+    mirrored_allocator() = default;
+    template <class U>
+    mirrored_allocator(const mirrored_allocator<U>&) noexcept {}
+
+    static size_type page_size() noexcept {
+        static const size_type size = ::sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    // The least amount of elements, not less than n, that takes whole pages
+    static size_type round(const size_type n) noexcept {
+        size_type unit = page_size();
+        size_type size = sizeof(T);
+        // unit/gcd(page, sizeof(T)) elements make a whole amount of pages
+        while (unit % 2 == 0 && size % 2 == 0) {
+            unit /= 2;
+            size /= 2;
+        }
+        return (n + unit-1)/unit*unit;
+    }
+
+    T* allocate(const size_type n) {
+        // The elements are seen at two addresses, so they have to be plain bytes
+        static_assert(std::is_trivially_copyable<T>::value, "mirrored memory only holds trivially copyable types");
+        if (n == 0 || n != round(n))
+            throw std::bad_alloc();
+        const size_type bytes = n*sizeof(T);
+
+        const int fd = ::memfd_create("circular_buffer", MFD_CLOEXEC);
+        if (fd < 0)
+            throw std::bad_alloc();
+        if (::ftruncate(fd, bytes) != 0) {
+            ::close(fd);
+            throw std::bad_alloc();
+        }
+
+        // Reserves both halves, so nothing else gets mapped in between, then puts the file over them
+        uint8_t* base = (uint8_t*)::mmap(nullptr, 2*bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            ::close(fd);
+            throw std::bad_alloc();
+        }
+        const bool mapped =
+            ::mmap(base,         bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+            ::mmap(base + bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+        // The mappings keep the file alive
+        ::close(fd);
+        if (!mapped) {
+            ::munmap(base, 2*bytes);
+            throw std::bad_alloc();
+        }
+        return (T*)base;
+    }
+
+    void deallocate(T* p, const size_type n) noexcept {
+        ::munmap(p, 2*n*sizeof(T));
+    }
+
+    template <class U>
+    bool operator== (const mirrored_allocator<U>&) const noexcept { return true; }
+    template <class U>
+    bool operator!= (const mirrored_allocator<U>&) const noexcept { return false; }
+};
+
+}
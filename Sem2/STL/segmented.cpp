@@ -0,0 +1,86 @@
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace stl {
+
+//////// SEGMENTED ITERATION
+// An iterator whose range lies in memory in a few contiguous pieces hands them out
+// with it.segments(last), in the range's order, and algorithms run plain pointer loops
+// over them, which the compiler can unroll and vectorize, instead of going element by element
+// The iterator to the i-th element of the range is still first + i
+
+// Up to N pieces of a range, every one is [first, second)
+template <class Pointer, std::size_t N>
+struct segment_list {
+    std::pair<Pointer, Pointer> piece[N];
+    std::size_t count = 0;
+
+    constexpr const std::pair<Pointer, Pointer>* begin() const noexcept {
+        return piece;
+    }
+    constexpr const std::pair<Pointer, Pointer>* end() const noexcept {
+        return piece + count;
+    }
+};
+
+template <class Iterator, class = void>
+struct is_segmented_iterator: std::false_type {};
+
+template <class Iterator>
+struct is_segmented_iterator<Iterator, std::void_t<decltype(std::declval<const Iterator&>().segments(std::declval<const Iterator&>()))>>:
+    std::true_type {};
+
+// Calls f(begin, end) for every piece of [first, last) in order: with pointers
+// for a segmented iterator, with the iterators themselves otherwise
+template <class Iterator, class F>
+constexpr void for_each_segment(Iterator first, Iterator last, F f) {
+    if constexpr (is_segmented_iterator<Iterator>::value) {
+        for (const auto& piece : first.segments(last))
+            f(piece.first, piece.second);
+    } else {
+        f(first, last);
+    }
+}
+
+// Calls f(begin, end) for the pieces of [first, last) in order, f returns where it
+// stopped in the piece, and stops at the first piece where that isn't the end
+// Returns the iterator to where f stopped, or last
+template <class Iterator, class F>
+constexpr Iterator find_in_segments(Iterator first, Iterator last, F f) {
+    if constexpr (is_segmented_iterator<Iterator>::value) {
+        typename std::iterator_traits<Iterator>::difference_type passed = 0;
+        for (const auto& piece : first.segments(last)) {
+            const auto found = f(piece.first, piece.second);
+            if (found != piece.second)
+                return first + (passed + (found - piece.first));
+            passed += piece.second - piece.first;
+        }
+        return last;
+    } else {
+        return f(first, last);
+    }
+}
+
+// Like find_in_segments, but goes through the pieces from the last one
+template <class Iterator, class F>
+constexpr Iterator rfind_in_segments(Iterator first, Iterator last, F f) {
+    if constexpr (is_segmented_iterator<Iterator>::value) {
+        const auto pieces = first.segments(last);
+        typename std::iterator_traits<Iterator>::difference_type passed = last - first;
+        for (std::size_t i = pieces.count; i > 0; i--) {
+            const auto& piece = pieces.piece[i-1];
+            passed -= piece.second - piece.first;
+            const auto found = f(piece.first, piece.second);
+            if (found != piece.second)
+                return first + (passed + (found - piece.first));
+        }
+        return last;
+    } else {
+        return f(first, last);
+    }
+}
+
+}
@@ -1,103 +1,121 @@
+#pragma once
+#include <memory>
+#include "segmented.cpp"
+
 namespace stl {
 
+// The loops run over the contiguous pieces of segmented ranges, like a circular_buffer's
+// (see segmented.cpp), and over the whole range with it's own iterators otherwise
+
+// The first element in [first, last) that satisfies the predicate, or last
+template <class InputIterator, class Predicate>
+constexpr InputIterator find_if(InputIterator first, InputIterator last, Predicate pred) {
+    return find_in_segments(first, last, [&](auto begin, auto end) {
+        while (begin != end) {
+            if (pred(*begin))
+                break;
+            ++begin;
+        }
+        return begin;
+    });
+}
+
 template <class InputIterator, class Predicate>
 constexpr bool all_of(InputIterator first, InputIterator last, Predicate pred) {
-    while (first != last) {
-        if (!pred(*first))
-            return false;
-        ++first;
-    }
-    return true;
+    return stl::find_if(first, last, [&](const auto& val) { return !pred(val); }) == last;
 }
 
 template <class InputIterator, class Predicate>
 constexpr bool any_of(InputIterator first, InputIterator last, Predicate pred) {
-    while (first != last) {
-        if (pred(*first))
-            return true;
-        ++first;
-    }
-    return false;
+    return stl::find_if(first, last, pred) != last;
 }
 
 template <class InputIterator, class Predicate>
 constexpr bool none_of(InputIterator first, InputIterator last, Predicate pred) {
-    while (first != last) {
-        if (pred(*first))
-            return false;
-        ++first;
-    }
-    return true;
+    return stl::find_if(first, last, pred) == last;
 }
 
 template <class InputIterator, class Predicate>
 constexpr bool one_of(InputIterator first, InputIterator last, Predicate pred) {
     int count = 0;
-    while (first != last) {
-        count += pred(*first);
-        ++first;
-    }
+    for_each_segment(first, last, [&](auto begin, auto end) {
+        for (; begin != end; ++begin)
+            count += pred(*begin) ? 1 : 0;
+    });
     return (count == 1);
 }
 
-template <class InputIterator, class Predicate>
-constexpr bool is_sorted(InputIterator first, InputIterator last, Predicate pred) {
-    InputIterator second = first;
+// Whether pred(a, b) holds for every two neighbouring elements a and b
+template <class ForwardIterator, class Predicate>
+constexpr bool is_sorted(ForwardIterator first, ForwardIterator last, Predicate pred) {
+    if (first == last)
+        return true;
+    ForwardIterator second = first;
     ++second;
-    while (second != last) {
-        if (!pred(*first, *second))
-            return false;
-        ++first;
-        ++second;
+    if constexpr (is_segmented_iterator<ForwardIterator>::value) {
+        // The pieces are pointers into the range's memory, so the left neighbour stays where it is
+        // Every piece but the first checks it's first element against the end of the previous one
+        const auto* prev = std::addressof(*first);
+        return find_in_segments(second, last, [&](auto begin, auto end) {
+            for (; begin != end; ++begin) {
+                if (!pred(*prev, *begin))
+                    break;
+                prev = begin;
+            }
+            return begin;
+        }) == last;
+    } else {
+        // Finds the first element that doesn't go after it's left neighbour
+        for (; second != last; ++first, ++second) {
+            if (!pred(*first, *second))
+                return false;
+        }
+        return true;
     }
-    return true;
 }
 
+// Whether the elements that satisfy the predicate and the ones that don't
+// are two parts of the range, one after another, in either order
 template <class InputIterator, class Predicate>
 constexpr bool is_partitioned(InputIterator first, InputIterator last, Predicate pred) {
-    InputIterator ans;
-    bool firstVal = pred(*first);
-    bool hasChanged = false;
-    ++first;
-    while (first != last) {
-        bool currVal = pred(*first);
-        if (currVal == firstVal && hasChanged)
-            return false;
-        if (currVal != firstVal)
-            hasChanged = true;
-    }
-    return true;
+    if (first == last)
+        return true;
+    const bool firstVal = pred(*first);
+    first = stl::find_if(first, last, [&](const auto& val) { return pred(val) != firstVal; });
+    return stl::find_if(first, last, [&](const auto& val) { return pred(val) == firstVal; }) == last;
 }
 
 template <class InputIterator, class T>
 constexpr InputIterator find_not(InputIterator first, InputIterator last, const T& value) {
-    while (first != last) {
-        if (!(*first == value))
-            break;
-        ++first;
-    }
-    return first;
+    return stl::find_if(first, last, [&](const auto& val) { return !(val == value); });
 }
 
-template<class BidirectionalIterator, class T>
+// The last element in [first, last) that is equal to value, or last
+template <class BidirectionalIterator, class T>
 constexpr BidirectionalIterator find_backward(BidirectionalIterator first, BidirectionalIterator last, const T& value) {
-    while (last != first) {
-        if (*last == value)
-            break;
-        --last;
-    }
-    return last;
+    return rfind_in_segments(first, last, [&](auto begin, auto end) {
+        auto it = end;
+        while (it != begin) {
+            --it;
+            if (*it == value)
+                return it;
+        }
+        return end;
+    });
 }
 
+// Whether pred(a, b) holds for every element a and it's mirror b from the other end
 template <class BidirectionalIterator, class Predicate>
 constexpr bool is_palindrome(BidirectionalIterator first, BidirectionalIterator last, Predicate pred) {
-    while (first > last) {
-        if (pred(*first, *last))
+    while (first != last) {
+        --last;
+        if (first == last)
+            break;
+        if (!pred(*first, *last))
             return false;
         ++first;
-        --last;
     }
     return true;
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,685 @@
+#include <algorithm>
+#include <array>
+#include <list>
+#include <memory_resource>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "circular_buffer.cpp"
+#include "concurrent_buffers.cpp"
+#include "mirrored_allocator.cpp"
+#include "circular_buffer_io.cpp"
+#include "stl_algorithms.cpp"
+#include <unistd.h>
+
+// Pushes to both ends over the wrap-around, checks the order through every kind of access
+template <class Capacity>
+static void check_push_pop() {
+    stl::circular_buffer<int, Capacity> buffer(4);
+    for (int i = 0; i < 3; i++)
+        buffer.push_back(i);
+    buffer.pop_front();
+    buffer.pop_front();
+    // 2 is in the last slot, the rest wrap around
+    buffer.push_back(3);
+    buffer.push_front(1);
+    buffer.push_back(4);
+    ASSERT_EQ(buffer.size(), 4);
+    ASSERT_FALSE(buffer.linear());
+
+    const std::vector<int> expected = {1, 2, 3, 4};
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), expected.begin(), expected.end()));
+    ASSERT_TRUE(std::equal(buffer.rbegin(), buffer.rend(), expected.rbegin(), expected.rend()));
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQ(buffer[i], expected[i]);
+        ASSERT_EQ(buffer.rat(i), expected[3-i]);
+        ASSERT_EQ(buffer.begin()[i], expected[i]);
+        ASSERT_EQ(*(buffer.end() - (4-i)), expected[i]);
+    }
+    ASSERT_EQ(buffer.front(), 1);
+    ASSERT_EQ(buffer.back(), 4);
+
+    // Full, so writes overwrite the other end
+    buffer.write_back(5);
+    ASSERT_EQ(buffer.front(), 2);
+    buffer.write_front(0);
+    ASSERT_EQ(buffer.back(), 4);
+
+    // Grows
+    buffer.push_back(6);
+    ASSERT_EQ(buffer.capacity(), 8);
+    ASSERT_TRUE(buffer.linear());
+    const std::vector<int> grown = {0, 2, 3, 4, 6};
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), grown.begin(), grown.end()));
+
+    std::sort(buffer.rbegin(), buffer.rend());
+    ASSERT_TRUE(std::is_sorted(buffer.rbegin(), buffer.rend()));
+}
+
+TEST(CIRCULAR_BUFFER, PUSH_POP) {
+    check_push_pop<stl::cb_exact_capacity>();
+    check_push_pop<stl::cb_pow2_capacity>();
+}
+
+TEST(CIRCULAR_BUFFER, POW2_CAPACITY) {
+    stl::circular_buffer<int, stl::cb_pow2_capacity> buffer(5);
+    ASSERT_EQ(buffer.capacity(), 8);
+    buffer.set_capacity(9);
+    ASSERT_EQ(buffer.capacity(), 16);
+
+    // The front runs freely through many laps of the buffer
+    for (int i = 0; i < 1000; i++) {
+        buffer.push_back(i);
+        if (buffer.size() > 10)
+            buffer.pop_front();
+    }
+    ASSERT_EQ(buffer.capacity(), 16);
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(buffer[i], 990 + i);
+
+    // Shrinking drops the back
+    buffer.set_capacity(3);
+    ASSERT_EQ(buffer.capacity(), 4);
+    ASSERT_EQ(buffer.size(), 4);
+    ASSERT_EQ(buffer.back(), 993);
+
+    stl::circular_buffer<int, stl::cb_pow2_capacity> copy(buffer);
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), copy.begin(), copy.end()));
+}
+
+// Counts the elements it has given out, copies share the count
+template <class T>
+struct counting_allocator {
+    typedef T value_type;
+
+    std::shared_ptr<size_t> live;
+
+    counting_allocator(): live(std::make_shared<size_t>(0)) {}
+    template <class U>
+    counting_allocator(const counting_allocator<U>& other) noexcept: live(other.live) {}
+
+    T* allocate(size_t n) {
+        *live += n;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        *live -= n;
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U>
+    bool operator== (const counting_allocator<U>& r) const noexcept { return live == r.live; }
+    template <class U>
+    bool operator!= (const counting_allocator<U>& r) const noexcept { return live != r.live; }
+};
+
+TEST(CIRCULAR_BUFFER, ALLOCATOR) {
+    typedef stl::circular_buffer<int, stl::cb_exact_capacity, counting_allocator<int>> buffer_t;
+    counting_allocator<int> alloc;
+    {
+        buffer_t buffer(4, alloc);
+        ASSERT_EQ(*alloc.live, 4);
+        for (int i = 0; i < 10; i++)
+            buffer.push_back(i);
+        ASSERT_EQ(*alloc.live, 16);
+
+        // Copies get the same allocator
+        buffer_t copy(buffer);
+        ASSERT_EQ(copy.get_allocator(), alloc);
+        ASSERT_EQ(*alloc.live, 32);
+
+        buffer_t moved(std::move(copy));
+        ASSERT_EQ(*alloc.live, 32);
+        ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), moved.begin(), moved.end()));
+    }
+    ASSERT_EQ(*alloc.live, 0);
+
+    // The whole buffer is in the arena
+    alignas(int) char arena[1024];
+    std::pmr::monotonic_buffer_resource resource(arena, sizeof(arena), std::pmr::null_memory_resource());
+    stl::circular_buffer<int, stl::cb_pow2_capacity, std::pmr::polymorphic_allocator<int>> buffer(100, &resource);
+    for (int i = 0; i < 200; i++)
+        buffer.write_back(i);
+    ASSERT_EQ(buffer.front(), 72);
+    ASSERT_GE((char*)&buffer.front(), arena);
+    ASSERT_LT((char*)&buffer.front(), arena + sizeof(arena));
+}
+
+// Counts how it was constructed
+struct tracked {
+    static int copies, moves, live;
+    std::string value;
+
+    tracked(std::string v): value(std::move(v)) { ++live; }
+    tracked(const tracked& other): value(other.value) { ++copies; ++live; }
+    tracked(tracked&& other) noexcept: value(std::move(other.value)) { ++moves; ++live; }
+    tracked& operator= (const tracked& other) { value = other.value; ++copies; return *this; }
+    tracked& operator= (tracked&& other) noexcept { value = std::move(other.value); ++moves; return *this; }
+    ~tracked() { --live; }
+};
+int tracked::copies = 0, tracked::moves = 0, tracked::live = 0;
+
+TEST(CIRCULAR_BUFFER, EMPLACE) {
+    {
+        stl::circular_buffer<tracked> buffer;
+        for (int i = 0; i < 100; i++) {
+            if (i % 2 == 0)
+                buffer.emplace_back(std::to_string(i));
+            else
+                buffer.emplace_front(std::to_string(i));
+        }
+        // Growth moves, it never copies
+        ASSERT_EQ(tracked::copies, 0);
+        ASSERT_EQ(tracked::live, 100);
+        ASSERT_EQ(buffer.front().value, "99");
+        ASSERT_EQ(buffer.back().value, "98");
+
+        tracked val("x");
+        const int moves = tracked::moves;
+        buffer.push_back(std::move(val));
+        buffer.write_front(tracked("y"));
+        ASSERT_EQ(tracked::copies, 0);
+        ASSERT_EQ(tracked::moves, moves + 2);
+
+        // An element of the buffer itself, pushed while it grows
+        buffer.set_capacity(buffer.size());
+        buffer.push_back(buffer.front());
+        ASSERT_EQ(buffer.back().value, "y");
+        ASSERT_EQ(tracked::copies, 1);
+
+        buffer.write_back(tracked("z"));
+        ASSERT_EQ(buffer.back().value, "z");
+        // And the moved-from val
+        ASSERT_EQ(buffer.size(), 104);
+        ASSERT_EQ(tracked::live, 105);
+    }
+    ASSERT_EQ(tracked::live, 0);
+
+    // Strings in a buffer that wraps around and grows
+    stl::circular_buffer<std::string, stl::cb_pow2_capacity> strings(4);
+    for (int i = 0; i < 3; i++)
+        strings.emplace_back(40, 'a' + i);
+    strings.pop_front();
+    for (int i = 3; i < 20; i++)
+        strings.emplace_back(40, 'a' + i);
+    ASSERT_EQ(strings.size(), 19);
+    for (int i = 0; i < 19; i++)
+        ASSERT_EQ(strings[i], std::string(40, 'b' + i));
+}
+
+// Checks the bulk calls against the element-at-a-time ones
+template <class T>
+static void check_bulk(const std::vector<T>& in) {
+    stl::circular_buffer<T> buffer(8), expected(8);
+    // Starts in the middle, so the ranges wrap around
+    for (int i = 0; i < 5; i++) {
+        buffer.push_back(in[0]);
+        expected.push_back(in[0]);
+    }
+    std::vector<T> popped;
+    ASSERT_EQ(buffer.pop_front_into(std::back_inserter(popped), 4), 4);
+    for (int i = 0; i < 4; i++)
+        expected.pop_front();
+
+    buffer.push_back(in.data(), in.data() + 6);
+    for (int i = 0; i < 6; i++)
+        expected.push_back(in[i]);
+    ASSERT_EQ(buffer.capacity(), 8);
+    ASSERT_FALSE(buffer.linear());
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), expected.begin(), expected.end()));
+
+    // Grows
+    buffer.push_back(in.begin(), in.end());
+    for (const T& val : in)
+        expected.push_back(val);
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), expected.begin(), expected.end()));
+
+    // Overwrites the front, then keeps only the last capacity() elements
+    buffer.set_capacity(buffer.size() + 3);
+    expected.set_capacity(expected.size() + 3);
+    buffer.write_back(in.data(), 5);
+    for (int i = 0; i < 5; i++)
+        expected.write_back(in[i]);
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), expected.begin(), expected.end()));
+    buffer.write_back(in.data(), in.size());
+    for (const T& val : in)
+        expected.write_back(val);
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), expected.begin(), expected.end()));
+
+    std::vector<T> out(buffer.size() + 5);
+    ASSERT_EQ(buffer.pop_front_into(out.data(), 7), 7);
+    ASSERT_EQ(buffer.pop_front_into(out.data() + 7, 100), expected.size() - 7);
+    ASSERT_TRUE(buffer.empty());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), out.begin()));
+}
+
+TEST(CIRCULAR_BUFFER, BULK) {
+    std::vector<int> ints(20);
+    std::iota(ints.begin(), ints.end(), 1);
+    check_bulk(ints);
+
+    std::vector<std::string> strings;
+    for (int i = 0; i < 20; i++)
+        strings.push_back(std::string(30, 'a' + i));
+    check_bulk(strings);
+
+    // Input iterators are read once
+    stl::circular_buffer<int> buffer;
+    std::istringstream stream("1 2 3 4 5");
+    buffer.push_back(std::istream_iterator<int>(stream), std::istream_iterator<int>());
+    ASSERT_EQ(buffer.size(), 5);
+    ASSERT_EQ(buffer.back(), 5);
+}
+
+// Copies the elements out of array_one() and array_two()
+template <class Buffer>
+static std::vector<int> pieces(const Buffer& buffer) {
+    std::vector<int> out(buffer.array_one().first, buffer.array_one().first + buffer.array_one().second);
+    out.insert(out.end(), buffer.array_two().first, buffer.array_two().first + buffer.array_two().second);
+    return out;
+}
+
+TEST(CIRCULAR_BUFFER, ARRAY_RANGES) {
+    stl::circular_buffer<int> buffer(8);
+    ASSERT_EQ(buffer.array_one().second + buffer.array_two().second, 0);
+    ASSERT_EQ(buffer.free_array_one().second, 8);
+    ASSERT_EQ(buffer.free_array_two().second, 0);
+
+    for (int i = 0; i < 6; i++)
+        buffer.push_back(i);
+    buffer.pop_front(4);
+    ASSERT_EQ(buffer.front(), 4);
+    // Elements in slots 4-5, free slots 6-7 and 0-3
+    ASSERT_EQ(buffer.free_array_one().second, 2);
+    ASSERT_EQ(buffer.free_array_two().first, &buffer[0] - 4);
+    ASSERT_EQ(buffer.free_array_two().second, 4);
+
+    // Writes straight into the free slots, over the end
+    int val = 6;
+    for (auto range : {buffer.free_array_one(), buffer.free_array_two()}) {
+        for (size_t i = 0; i < range.second && val < 11; i++)
+            range.first[i] = val++;
+    }
+    buffer.commit_back(5);
+    ASSERT_EQ(buffer.size(), 7);
+    ASSERT_FALSE(buffer.linear());
+    ASSERT_EQ(buffer.array_one().second, 4);
+    ASSERT_EQ(buffer.array_two().second, 3);
+    std::vector<int> expected(7);
+    std::iota(expected.begin(), expected.end(), 4);
+    ASSERT_EQ(pieces(buffer), expected);
+    ASSERT_EQ(buffer.free_array_one().second + buffer.free_array_two().second, 1);
+
+    buffer.linearize();
+    ASSERT_EQ(buffer.array_two().second, 0);
+    ASSERT_EQ(pieces(buffer), expected);
+}
+
+TEST(CIRCULAR_BUFFER, READV_WRITEV) {
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+    stl::circular_buffer<char> in(16), out(16);
+    // Both buffers start in the middle, so the reads and writes wrap around
+    for (auto buffer : {&in, &out}) {
+        for (int i = 0; i < 10; i++)
+            buffer->push_back('-');
+        buffer->pop_front(10);
+    }
+
+    const std::string text = "hello, circular world";
+    std::string got;
+    size_t sent = 0;
+    while (got.size() < text.size()) {
+        const size_t chunk = std::min<size_t>(out.capacity() - out.size(), text.size() - sent);
+        out.write_back(text.data() + sent, chunk);
+        sent += chunk;
+        ASSERT_EQ(stl::cb_write(fds[1], out), (ssize_t)chunk);
+        ASSERT_TRUE(out.empty());
+
+        ASSERT_EQ(stl::cb_read(fds[0], in), (ssize_t)chunk);
+        got.append(in.begin(), in.end());
+        in.pop_front(in.size());
+    }
+    ASSERT_EQ(got, text);
+
+    // A full buffer reads nothing, the end of the file reads nothing too
+    for (int i = 0; i < 16; i++)
+        in.push_back('x');
+    ASSERT_EQ(stl::cb_read(fds[0], in), 0);
+    ::close(fds[1]);
+    in.clear();
+    ASSERT_EQ(stl::cb_read(fds[0], in), 0);
+    ::close(fds[0]);
+}
+
+TEST(CIRCULAR_BUFFER, MIRRORED) {
+    typedef stl::mirrored_allocator<uint32_t> alloc_t;
+    const size_t page = alloc_t::page_size()/sizeof(uint32_t);
+    ASSERT_EQ(alloc_t::round(1), page);
+    typedef stl::mirrored_allocator<std::array<char, 12>> odd_alloc_t;
+    ASSERT_EQ(odd_alloc_t::round(1)*12 % alloc_t::page_size(), 0);
+
+    stl::circular_buffer<uint32_t, stl::cb_pow2_capacity, alloc_t> buffer(10);
+    ASSERT_EQ(buffer.capacity(), page);
+    // Wraps around the end
+    for (uint32_t i = 0; i < page + page/2; i++) {
+        buffer.write_back(i);
+        if (buffer.size() > page/2)
+            buffer.pop_front();
+    }
+    ASSERT_TRUE(buffer.linear());
+    ASSERT_EQ(buffer.array_one().second, buffer.size());
+    ASSERT_EQ(buffer.array_two().second, 0);
+
+    // Nothing is moved, the end is read through the mirror
+    const uint32_t* front = &buffer.front();
+    ASSERT_EQ(buffer.linearize(), front);
+    for (uint32_t i = 0; i < buffer.size(); i++)
+        ASSERT_EQ(front[i], buffer[i]);
+
+    // Bulk calls go in one piece too
+    std::vector<uint32_t> in(page - buffer.size(), 7), out(page);
+    buffer.write_back(in.data(), in.size());
+    ASSERT_TRUE(buffer.full());
+    ASSERT_EQ(buffer.pop_front_into(out.data(), page), page);
+    ASSERT_TRUE(std::equal(in.begin(), in.end(), out.end() - in.size()));
+
+    // Grows into a bigger mapping
+    for (uint32_t i = 0; i < 3*page; i++)
+        buffer.push_back(i);
+    ASSERT_EQ(buffer.capacity(), 4*page);
+    ASSERT_EQ(buffer.back(), 3*page-1);
+}
+
+// Puts the values into a buffer of their size that wraps around in the middle
+static stl::circular_buffer<int> wrapped(const std::vector<int>& vals) {
+    stl::circular_buffer<int> buffer(vals.size());
+    for (size_t i = 0; i < vals.size()/2; i++)
+        buffer.push_back(0);
+    buffer.pop_front(buffer.size());
+    buffer.push_back(vals.begin(), vals.end());
+    return buffer;
+}
+
+TEST(CIRCULAR_BUFFER, SEGMENTS) {
+    // A pointer to the buffer and an index
+    ASSERT_EQ(sizeof(stl::circular_buffer<int>::iterator), 2*sizeof(void*));
+    static_assert(stl::is_segmented_iterator<stl::circular_buffer<int>::const_iterator>::value);
+    static_assert(!stl::is_segmented_iterator<std::vector<int>::iterator>::value);
+
+    std::vector<int> vals(10);
+    std::iota(vals.begin(), vals.end(), 0);
+    auto buffer = wrapped(vals);
+    ASSERT_FALSE(buffer.linear());
+
+    // [2, 8) goes over the end of the buffer
+    const auto pieces = (buffer.begin() + 2).segments(buffer.begin() + 8);
+    ASSERT_EQ(pieces.count, 2);
+    ASSERT_EQ(pieces.piece[0].first, &buffer[2]);
+    ASSERT_EQ(pieces.piece[1].first, &buffer[5]);
+    std::vector<int> joined;
+    stl::for_each_segment(buffer.cbegin() + 2, buffer.cbegin() + 8, [&](const int* begin, const int* end) {
+        joined.insert(joined.end(), begin, end);
+    });
+    ASSERT_EQ(joined, std::vector<int>(vals.begin() + 2, vals.begin() + 8));
+    ASSERT_EQ((buffer.begin() + 6).segments(buffer.begin() + 6).count, 0);
+
+    // Works with the standard algorithms
+    std::reverse(buffer.begin(), buffer.end());
+    std::sort(buffer.begin(), buffer.end());
+    ASSERT_TRUE(std::equal(buffer.begin(), buffer.end(), vals.begin(), vals.end()));
+    ASSERT_EQ(std::accumulate(buffer.begin(), buffer.end(), 0), 45);
+}
+
+// Runs the algorithms on a vector, a list and a wrapped circular buffer, they all have to agree
+template <class F>
+static void check_algorithm(const std::vector<int>& vals, F f) {
+    const std::list<int> list(vals.begin(), vals.end());
+    const auto buffer = wrapped(vals);
+    const auto expected = f(vals.begin(), vals.end());
+    ASSERT_EQ(f(list.begin(), list.end()), expected);
+    ASSERT_EQ(f(buffer.begin(), buffer.end()), expected);
+}
+
+TEST(ALGORITHMS, PREDICATES) {
+    const auto even = [](int val) { return val % 2 == 0; };
+    const std::vector<std::vector<int>> cases = {
+        {}, {1}, {2}, {2, 4, 6, 8}, {2, 4, 5, 8}, {1, 3, 5, 7, 9}, {1, 3, 5, 6, 9}, {2, 4, 6, 1, 3}, {2, 1, 4, 3},
+    };
+    for (const auto& vals : cases) {
+        check_algorithm(vals, [&](auto first, auto last) { return stl::all_of(first, last, even); });
+        check_algorithm(vals, [&](auto first, auto last) { return stl::any_of(first, last, even); });
+        check_algorithm(vals, [&](auto first, auto last) { return stl::none_of(first, last, even); });
+        check_algorithm(vals, [&](auto first, auto last) { return stl::one_of(first, last, even); });
+        check_algorithm(vals, [&](auto first, auto last) { return stl::is_partitioned(first, last, even); });
+        check_algorithm(vals, [&](auto first, auto last) { return stl::is_sorted(first, last, std::less<int>()); });
+    }
+    ASSERT_TRUE(stl::all_of(cases[3].begin(), cases[3].end(), even));
+    ASSERT_TRUE(stl::one_of(cases[4].begin(), cases[4].end(), [](int val) { return val == 5; }));
+    ASSERT_TRUE(stl::is_partitioned(cases[7].begin(), cases[7].end(), even));
+    ASSERT_FALSE(stl::is_partitioned(cases[8].begin(), cases[8].end(), even));
+
+    // A boundary between the pieces of the buffer is checked like any other
+    std::vector<int> sorted(9);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    const auto buffer = wrapped(sorted);
+    ASSERT_TRUE(stl::is_sorted(buffer.begin(), buffer.end(), std::less<int>()));
+    std::swap(sorted[4], sorted[5]);
+    check_algorithm(sorted, [&](auto first, auto last) { return stl::is_sorted(first, last, std::less<int>()); });
+    ASSERT_FALSE(stl::is_sorted(sorted.begin(), sorted.end(), std::less<int>()));
+
+    // Proxy iterators that give out temporaries instead of references
+    const std::vector<bool> bits = {false, false, true, true};
+    ASSERT_TRUE(stl::is_sorted(bits.begin(), bits.end(), std::less_equal<bool>()));
+    ASSERT_FALSE(stl::is_sorted(bits.rbegin(), bits.rend(), std::less_equal<bool>()));
+}
+
+TEST(ALGORITHMS, SEARCH) {
+    const std::vector<int> vals = {3, 3, 1, 4, 1, 5, 9, 2, 6, 5, 3};
+    // Positions of what's found, the size if nothing is
+    for (int val : {1, 3, 5, 7}) {
+        check_algorithm(vals, [&](auto first, auto last) { return std::distance(first, stl::find_not(first, last, val)); });
+        check_algorithm(vals, [&](auto first, auto last) { return std::distance(first, stl::find_backward(first, last, val)); });
+    }
+    ASSERT_EQ(stl::find_not(vals.begin(), vals.end(), 3) - vals.begin(), 2);
+    ASSERT_EQ(stl::find_backward(vals.begin(), vals.end(), 5) - vals.begin(), 9);
+    ASSERT_EQ(stl::find_backward(vals.begin(), vals.end(), 7), vals.end());
+
+    const std::vector<std::vector<int>> palindromes = {{}, {1}, {1, 1}, {1, 2, 1}, {1, 2, 2, 1}};
+    const std::vector<std::vector<int>> others      = {{1, 2}, {1, 2, 3}, {1, 2, 1, 1}};
+    for (const auto& sequence : palindromes)
+        check_algorithm(sequence, [](auto first, auto last) { return stl::is_palindrome(first, last, std::equal_to<int>()); });
+    ASSERT_TRUE(stl::is_palindrome(palindromes[4].begin(), palindromes[4].end(), std::equal_to<int>()));
+    for (const auto& sequence : others) {
+        check_algorithm(sequence, [](auto first, auto last) { return stl::is_palindrome(first, last, std::equal_to<int>()); });
+        ASSERT_FALSE(stl::is_palindrome(sequence.begin(), sequence.end(), std::equal_to<int>()));
+    }
+}
+
+TEST(SPSC_BUFFER, FIFO) {
+    stl::spsc_circular_buffer<std::string> buffer(4);
+    ASSERT_EQ(buffer.capacity(), 4);
+    ASSERT_TRUE(buffer.empty());
+
+    std::string val;
+    ASSERT_FALSE(buffer.try_pop(val));
+    // Goes around the end of the buffer a few times
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4; i++)
+            ASSERT_TRUE(buffer.try_push(std::to_string(round*4 + i)));
+        ASSERT_TRUE(buffer.full());
+        ASSERT_FALSE(buffer.try_push("extra"));
+        for (int i = 0; i < 4; i++) {
+            ASSERT_TRUE(buffer.try_pop(val));
+            ASSERT_EQ(val, std::to_string(round*4 + i));
+        }
+        ASSERT_TRUE(buffer.empty());
+    }
+
+    // Whatever is left is destroyed with the buffer
+    ASSERT_TRUE(buffer.try_emplace(100, 'x'));
+    ASSERT_EQ(buffer.size(), 1);
+}
+
+TEST(SPSC_BUFFER, BULK) {
+    stl::spsc_circular_buffer<int> buffer(10);
+    std::vector<int> in(25), out;
+    std::iota(in.begin(), in.end(), 0);
+
+    ASSERT_EQ(buffer.try_push(in.begin(), in.begin() + 7), 7);
+    ASSERT_EQ(buffer.try_pop(std::back_inserter(out), 5), 5);
+    // Wraps around, only the free space is taken
+    ASSERT_EQ(buffer.try_push(in.begin() + 7, in.end()), 8);
+    ASSERT_TRUE(buffer.full());
+    ASSERT_EQ(buffer.try_push(in.begin() + 15, in.end()), 0);
+    ASSERT_EQ(buffer.try_pop(std::back_inserter(out), 100), 10);
+    ASSERT_EQ(buffer.try_pop(std::back_inserter(out), 100), 0);
+
+    ASSERT_EQ(out, std::vector<int>(in.begin(), in.begin() + 15));
+}
+
+TEST(SPSC_BUFFER, THREADS) {
+    const int count = 200000;
+    stl::spsc_circular_buffer<int> buffer(64);
+
+    std::thread producer([&] {
+        for (int i = 0; i < count;) {
+            if (i % 3 == 0) {
+                int batch[5] = {i, i+1, i+2, i+3, i+4};
+                i += buffer.try_push(batch, batch + std::min(5, count - i));
+            } else if (buffer.try_push(i)) {
+                ++i;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    // Elements come out in the same order they went in
+    int expected = 0;
+    std::vector<int> batch;
+    while (expected < count) {
+        int val;
+        if (expected % 2 == 0) {
+            batch.clear();
+            if (buffer.try_pop(std::back_inserter(batch), 7) == 0)
+                std::this_thread::yield();
+            for (int v : batch)
+                ASSERT_EQ(v, expected++);
+        } else if (buffer.try_pop(val)) {
+            ASSERT_EQ(val, expected++);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    ASSERT_TRUE(buffer.empty());
+}
+
+TEST(MPMC_BUFFER, FIFO) {
+    // Rounded up to a power of two
+    stl::mpmc_circular_buffer<std::string> buffer(5);
+    ASSERT_EQ(buffer.capacity(), 8);
+
+    std::string val;
+    ASSERT_FALSE(buffer.try_pop(val));
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 8; i++)
+            ASSERT_TRUE(buffer.try_push(std::to_string(round*8 + i)));
+        ASSERT_TRUE(buffer.full());
+        ASSERT_FALSE(buffer.try_emplace(3, 'x'));
+        for (int i = 0; i < 8; i++) {
+            ASSERT_TRUE(buffer.try_pop(val));
+            ASSERT_EQ(val, std::to_string(round*8 + i));
+        }
+        ASSERT_TRUE(buffer.empty());
+    }
+
+    buffer.emplace(3, 'x');
+    ASSERT_EQ(buffer.pop(), "xxx");
+}
+
+TEST(MPMC_BUFFER, THREADS) {
+    const int producers = 4, consumers = 4, count = 50000;
+    stl::mpmc_circular_buffer<uint64_t> buffer(16);
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&, p] {
+            for (uint64_t i = 0; i < count; i++)
+                buffer.push(uint64_t(p) << 32 | i);
+        });
+    }
+
+    // Every consumer sees the elements of a producer in the order they were pushed
+    std::vector<std::vector<uint64_t>> received(consumers);
+    std::atomic<int> left(producers*count);
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([&, c] {
+            while (left.fetch_sub(1) > 0)
+                received[c].push_back(buffer.pop());
+        });
+    }
+    for (std::thread& t : threads)
+        t.join();
+
+    std::vector<uint64_t> next(producers, 0);
+    for (const std::vector<uint64_t>& r : received) {
+        std::vector<int64_t> last(producers, -1);
+        for (uint64_t val : r) {
+            const uint64_t p = val >> 32, i = val & 0xffffffff;
+            ASSERT_GT((int64_t)i, last[p]);
+            last[p] = i;
+            ++next[p];
+        }
+    }
+    for (int p = 0; p < producers; p++)
+        ASSERT_EQ(next[p], count);
+    ASSERT_TRUE(buffer.empty());
+}
+
+TEST(MPMC_BUFFER, MIXED_CALLS) {
+    // Sleepers of the blocking calls are woken by the non-blocking calls of the other side
+    const int count = 20000;
+    stl::mpmc_circular_buffer<int> buffer(4);
+    uint64_t sum = 0;
+    std::thread consumer([&] {
+        for (int i = 0; i < count; i++)
+            sum += buffer.pop();
+    });
+    for (int i = 0; i < count; i++) {
+        while (!buffer.try_push(i))
+            std::this_thread::yield();
+        // Lets the consumer fall asleep now and then
+        if (i % 1000 == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    consumer.join();
+    ASSERT_EQ(sum, uint64_t(count-1)*count/2);
+
+    std::thread producer([&] {
+        for (int i = 0; i < count; i++)
+            buffer.push(i);
+    });
+    sum = 0;
+    for (int i = 0, val; i < count; i++) {
+        while (!buffer.try_pop(val))
+            std::this_thread::yield();
+        sum += val;
+        if (i % 1000 == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    producer.join();
+    ASSERT_EQ(sum, uint64_t(count-1)*count/2);
+    ASSERT_TRUE(buffer.empty());
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}